@@ -24,9 +24,6 @@ typedef uint8_t spi_label_t;
 
 #define SPI_LABEL_UNKNOWN 1
 
-/** Table with classification probabilities */
-typedef double spi_cprob_t[SPI_LABEL_MAX + 1];
-
 /** Endpoint address (proto << 48 | ip << 16 | port) */
 typedef uint64_t spi_epaddr_t;
 
@@ -39,9 +36,18 @@ typedef enum {
 /** spi traffic source type */
 typedef enum {
 	SPI_SOURCE_FILE = 1,
-	SPI_SOURCE_SNIFF
+	SPI_SOURCE_SNIFF,
+	SPI_SOURCE_RING                     /** live AF_PACKET TPACKET_V3 mmap ring */
 } spi_source_t;
 
+/** Classifier backend */
+typedef enum {
+	SPI_CLASSIFIER_RBF = 0,             /** libsvm with RBF kernel */
+	SPI_CLASSIFIER_LINEAR,              /** linear model: a weight vector per pair of classes */
+	SPI_CLASSIFIER_RFF,                 /** linear model on random Fourier features approximating RBF */
+	SPI_CLASSIFIER_FOREST               /** random forest, see forest.h */
+} spi_classifier_t;
+
 /** spi event handler
  * @param spi               spi root
  * @param evname            spi event name
@@ -50,8 +56,40 @@ typedef enum {
  */
 typedef bool spi_event_cb_t(struct spi *spi, const char *evname, void *arg);
 
+/** Built-in spi events (see README), registered in this order so their IDs are the same in each spi */
+typedef enum {
+	SPI_EV_ENDPOINT_PACKETS_READY = 0,  /** endpointPacketsReady */
+	SPI_EV_ENDPOINT_CLASSIFICATION,     /** endpointClassification */
+	SPI_EV_ENDPOINT_VERDICT_CHANGED,    /** endpointVerdictChanged */
+	SPI_EV_CLASSIFIER_BATCH_READY,      /** classifierBatchReady */
+	SPI_EV_TRAINDATA_UPDATED,           /** traindataUpdated */
+	SPI_EV_CLASSIFIER_MODEL_UPDATED,    /** classifierModelUpdated */
+	SPI_EV_CLASSIFIER_TRAINING_FAILED,  /** classifierTrainingFailed */
+	SPI_EV_GC_SUGGESTION,               /** gcSuggestion */
+	SPI_EV_SOURCE_CLOSED,               /** sourceClosed */
+	SPI_EV_WORKERS_SYNCED,              /** workersSynced */
+	SPI_EV_FINISHED,                    /** finished */
+	SPI_EV_BUILTIN                      /** number of built-in events: IDs of other events follow */
+} spi_evid_t;
+
 /************************************************************************/
 
+/** Capture interface of pcap or pcapng file */
+struct spi_pcapif {
+	uint16_t linktype;                  /** link-layer header type */
+	uint64_t tsunits;                   /** timestamp units per second */
+	int64_t tsoffset;                   /** timestamp offset [s] */
+};
+
+/** AF_PACKET TPACKET_V3 rx ring of a single socket */
+struct spi_ring {
+	int fd;                             /** AF_PACKET socket */
+	uint8_t *map;                       /** mmaped ring */
+	uint32_t block_size;                /** size of ring block */
+	uint32_t block_nr;                  /** number of ring blocks */
+	uint32_t block;                     /** next block to read */
+};
+
 /** Traffic source */
 struct spi_source {
 	struct spi *spi;                    /** root node */
@@ -67,20 +105,37 @@ struct spi_source {
 	unsigned int eps;                   /** number of endpoints */
 
 	bool closed;                        /** true if source is finished */
+	bool offline;                       /** learning file read by spi_learn(), not in the event loop */
 
 	/** internal data depending on type */
 	union {
 		struct {
-			pcap_t *pcap;               /** libpcap handler */
 			const char *path;           /** file path */
 			struct timeval time;        /** virtual current time in file (time of last packet or inf.) */
 			struct timeval gctime;      /** virtual time of last garbage collector call */
+
+			uint8_t *map;               /** mmaped file */
+			size_t size;                /** file size */
+			size_t pos;                 /** offset of next record */
+			bool ng;                    /** pcapng format */
+			bool swap;                  /** file byte order differs from ours */
+			struct spi_pcapif *ifs;     /** capture interfaces (current pcapng section) */
+			int ifs_num;                /** number of interfaces */
+			int ifs_size;               /** size of ifs array */
+			struct bpf_program filter;  /** compiled pcap filter */
 		} file;
 
 		struct {
 			pcap_t *pcap;               /** libpcap handler */
 			const char *ifname;         /** interface name */
 		} sniff;
+
+		struct {
+			const char *ifname;         /** interface name */
+			int fanout;                 /** PACKET_FANOUT group id or -1 */
+			int num;                    /** number of sockets: 1 or one per worker thread */
+			struct spi_ring *rx;        /** rx rings, one per socket */
+		} ring;
 	} as;
 };
 
@@ -91,13 +146,22 @@ struct spi_signature {
 		int index;
 		double value;
 	} *c;
+	struct spi_pool *pool;              /** pool of the signature, see spi_signature_new(); NULL if c allocated separately */
+};
+
+/** Free-list of fixed-size objects, see pool.h */
+struct spi_pool {
+	mmatic *mm;                         /** mm for the objects */
+	size_t size;                        /** size of objects */
+	void *free;                         /** free objects */
+	uint32_t count;                     /** number of free objects */
 };
 
 /** Represents information extracted from single packet */
 struct spi_pkt {
-	uint8_t *payload;                   /** payload */
 	struct timeval ts;                  /** time of packet (NB: may be from pcap file) */
 	uint16_t size;                      /** packet size */
+	uint8_t payload[];                  /** payload (N bytes) */
 };
 
 /** Represents a single endpoint */
@@ -107,30 +171,92 @@ struct spi_ep {
 	spi_epaddr_t epa;                   /** endpoint address */
 
 	struct timeval last;                /** time of last packet (for GC) */
-	tlist *pkts;                        /** collected packets */
+	uint32_t expire;                    /** time of the pending expiry check, see wheel_add() */
+	uint8_t *pkts;                      /** ring of collected packets: see ep_pkt() */
+	uint32_t pkts_size;                 /** ring capacity */
+	uint32_t pkts_head;                 /** ring index of the oldest packet */
+	uint32_t pkts_count;                /** number of collected packets */
 	int gclock1;                        /** GC lock: C packets */
 	int gclock2;                        /** GC lock: new classification */
 	int gclock3;                        /** GC lock: verdict changed */
 
+	bool mature;                        /** reached C packets at least once */
+	struct spi_ep *prev;                /** LRU list: more recently active endpoint */
+	struct spi_ep *next;                /** LRU list: less recently active endpoint */
+
 	spi_label_t verdict;                /** current verdict */
 	double verdict_prob;                /** current verdict probability */
 	uint32_t verdict_count;             /** number of verdicts so far */
 	uint32_t predictions;               /** number of predictions made */
 
+	void *cdata;                        /** classifier internal data */
 	void *vdata;                        /** classifier verdict internal data */
 };
 
+/** Endpoint hash table: open addressing, keyed by (source id, endpoint address) */
+struct spi_eptable {
+	mmatic *mm;                         /** mm for the slot array */
+	struct spi *spi;                    /** owner of the endpoints */
+
+	/** table slots */
+	struct spi_eptable_slot {
+		spi_epaddr_t epa;               /** endpoint address */
+		uint32_t sid;                   /** source id: pcap file fd or 0 for live sources */
+		struct spi_ep *ep;              /** endpoint, NULL if free, SPI_EPTABLE_DELETED if deleted */
+	} *slots;
+
+	uint32_t size;                      /** number of slots: a power of 2 */
+	uint32_t count;                     /** number of endpoints */
+	uint32_t used;                      /** number of non-free slots (endpoints + deleted) */
+	uint32_t iter;                      /** iterator position: index of next slot to check */
+
+	/** LRU lists of endpoints, most recently active first: [0] not mature yet, [1] mature
+	 * NB: maintained only if spi->mem_limit is set */
+	struct spi_eplist {
+		struct spi_ep *head;
+		struct spi_ep *tail;
+	} lru[2];
+	uint64_t mem;                       /** estimated memory used by the endpoints [B] */
+};
+
+/** Filter of training samples, see trainset.h */
+struct spi_trainset {
+	mmatic *mm;                         /** mm for the tables */
+
+	/** hashes of quantized samples in traindata: open addressing, 0 marks a free slot */
+	uint64_t *slots;
+	uint32_t size;                      /** number of slots: a power of 2 */
+	uint32_t count;                     /** number of hashes */
+
+	/** reservoirs of samples of each label, NB: only if options.train_cap is set */
+	struct spi_reservoir {
+		struct spi_signature **signs;   /** samples in traindata: up to options.train_cap */
+		uint32_t count;                 /** number of samples */
+		uint64_t seen;                  /** number of unique samples offered */
+	} *res;                             /** indexed by label */
+	uint64_t rnd;                       /** random state of reservoir sampling */
+
+	uint32_t replaced;                  /** number of traindata samples replaced so far */
+};
+
+/** Classification probability of a protocol */
+struct spi_cprob {
+	spi_label_t label;                      /** protocol label */
+	double prob;                            /** probability */
+};
+
 /** Represents classification result */
 struct spi_classresult {
 	struct spi_ep *ep;                      /** endpoint */
 	spi_label_t result;                     /** most probable result */
-	spi_cprob_t cprob;                      /** classification probabilities */
-	spi_cprob_t cprob_lib;                  /** classification probabilities from underlying library */
+	int num;                                /** number of classes in the model */
+	struct spi_cprob cprob[];               /** classification probabilities, in order of the model classes */
 };
 
 /** Represents a flow */
 struct spi_flow {
 	struct timeval last;                /** time of last packet (for GC) */
+	uint32_t expire;                    /** time of the pending expiry check, see wheel_add() */
 
 	struct spi_source *source;          /** source that created this flow */
 	spi_epaddr_t epa1;                  /** lower epaddr */
@@ -141,6 +267,27 @@ struct spi_flow {
 	uint8_t fin;                        /** FIN counter */
 };
 
+/** Number of flows in a single flow table bucket */
+#define SPI_FLOWTABLE_WAYS 4
+
+/** Flow hash table: buckets of SPI_FLOWTABLE_WAYS inline flows, keyed by (source id, epa1, epa2) */
+struct spi_flowtable {
+	mmatic *mm;                         /** mm for the bucket array */
+	void *mem;                          /** bucket array memory, as allocated */
+
+	/** table buckets: aligned to cache line size */
+	struct spi_flowbucket {
+		uint16_t tags[SPI_FLOWTABLE_WAYS];      /** hash tags: 0 if free, 1 if deleted */
+		struct spi_flow flows[SPI_FLOWTABLE_WAYS];
+	} __attribute__ ((aligned (64))) *buckets;
+
+	uint32_t size;                      /** number of buckets: a power of 2 */
+	uint32_t count;                     /** number of flows */
+	uint32_t used;                      /** number of non-free slots (flows + deleted) */
+	uint32_t iter;                      /** iterator position: index of next slot to check */
+	uint32_t sample;                    /** pseudo-random state for flow_oldest() */
+};
+
 /** spi configuration options */
 struct spi_options {
 	uint8_t N;                          /** payload bytes */
@@ -149,7 +296,19 @@ struct spi_options {
 
 	/* KISS */
 	bool kiss_std;                      /** use KISS extensions */
+	bool kiss_stream;                   /** update signatures on each packet, dont store packets */
+	int workers;                        /** number of worker threads handling endpoints, 0 for none */
+	int learn_threads;                  /** read learning files in parallel in spi_learn(), 0 for none */
+	uint32_t mem_limit;                 /** memory budget of endpoints and flows [MB], 0 for none */
+	spi_classifier_t classifier;        /** classifier backend */
+	int rff_dim;                        /** number of random Fourier features, 0 for default */
+	bool online;                        /** learn new samples online, without full retraining (linear and rff) */
+	bool train_dups;                    /** keep duplicate training samples */
+	double train_quant;                 /** coordinate step under which training samples are duplicates, 0 for exact */
+	uint32_t train_cap;                 /** max number of training samples of each label, 0 for no limit */
+	bool train_raw;                     /** keep also all training samples, unfiltered, in spi->trainraw */
 	struct svm_parameter *libsvm_params;/** libsvm params */
+	const char *model_file;             /** file to save trained model to and load it from, NULL for none */
 
 	/* verdict */
 	double verdict_threshold;           /** verdict threshold */
@@ -174,6 +333,21 @@ struct spi_stats {
 
 	uint32_t test_FN[SPI_LABEL_MAX + 1];    /** endpoint classification is a False Negative */
 	uint32_t test_FP[SPI_LABEL_MAX + 1];    /** endpoint classification is a False Positive */
+
+	uint32_t evicted_eps;                   /** endpoints evicted due to memory budget */
+	uint32_t evicted_flows;                 /** flows evicted due to memory budget */
+
+	uint32_t classified_signs;              /** signatures classified */
+
+	uint32_t trainings;                     /** full model trainings */
+	uint32_t online_updates;                /** online model updates */
+	uint32_t online_signs;                  /** signatures learned online */
+
+	uint32_t train_dups;                    /** training samples dropped as duplicates */
+	uint32_t train_capped;                  /** training samples dropped or replaced due to train_cap */
+
+	/* NB: keep uint32_t counters above, see worker.c */
+	uint64_t classify_us;                   /** time spent classifying signatures [us] */
 };
 
 /** Main data root */
@@ -186,31 +360,54 @@ struct spi {
 	struct event_base *eb;              /** libevent root */
 	struct event *evgc;                 /** garbage collector event */
 
-	thash *subscribers;                 /** subscribers of spi events: thash of struct spi_subscribers*/
+	struct spi *root;                   /** for worker shards: the main spi, NULL otherwise */
+	struct event *evqueue_ev;           /** handles evqueue in the event loop (NULL in worker shards) */
+
+	/** zero-delay spi events waiting for handling, oldest first */
+	struct spi_evqueue {
+		struct spi_event *ev;           /** ring of event records */
+		uint32_t size;                  /** number of records: a power of 2 */
+		uint32_t head;                  /** index of the oldest event */
+		uint32_t count;                 /** number of queued events */
+	} evqueue;
+
+	thash *evids;                       /** spi event IDs: thash of event name -> ID + 1 */
+	struct spi_subscribers *events;     /** subscribers of spi events, indexed by event ID */
+	int events_num;                     /** number of registered events */
+	int events_size;                    /** size of the events array */
 
 	tlist *sources;                     /** traffic sources: list of struct spi_source */
-	thash *eps;                         /** endpoints: struct spi_ep indexed by file_fd-epa */
-	thash *flows;                       /** flows: struct spi_flow indexed by file_fd-epa1-epa2 where epa1 < epa2 */
+	struct spi_eptable *eps;            /** endpoints: struct spi_ep indexed by (file_fd, epa) */
+	struct spi_flowtable *flows;        /** flows: struct spi_flow indexed by (file_fd, epa1, epa2) where epa1 < epa2 */
+	tlist *wheels;                      /** expiry of eps and flows: list of struct spi_wheel, one per time domain */
+	uint64_t mem_limit;                 /** memory budget of eps and flows [B], 0 for none */
 
 	tlist *traindata;                   /** signatures for training: list of struct spi_signature */
+	tlist *trainraw;                    /** all signatures given for training, if options.train_raw is set */
+	struct spi_pool sign_pool;          /** memory of signatures */
+	struct spi_pool cr_pool;            /** memory of classification results */
 	tlist *trainqueue;                  /** signatures to be added to traindata */
+	struct spi_trainset trainset;       /** duplicates and reservoirs of traindata */
 
 	struct spi_stats stats;             /** performance measurement */
 
 	void *cdata;                        /** classifiers private data */
 	void *vdata;                        /** verdict private data */
+	void *wdata;                        /** worker threads data: struct workers, or struct worker in shard */
 };
 
-/** Used for conversion between a void pointer and an spi_event callback address */
-union spi_ptr2eventcb_tool {
-	void *ptr;
-	spi_event_cb_t *func;
+/** Handlers of spi event, in order of subscription */
+struct spi_handlers {
+	spi_event_cb_t **cb;                /** handler array */
+	uint32_t num;                       /** number of handlers */
+	uint32_t size;                      /** size of the cb array */
 };
 
 /** represents listeners of spi events */
 struct spi_subscribers {
-	tlist *hl;                          /** handler list */
-	tlist *ahl;                         /** after handler list */
+	char *evname;                       /** event name */
+	struct spi_handlers hl;             /** handler list */
+	struct spi_handlers ahl;            /** after handler list */
 
 	/** event aggregation status */
 	enum spi_aggstatus {
@@ -223,8 +420,7 @@ struct spi_subscribers {
 /** spi event representation */
 struct spi_event {
 	struct spi *spi;                    /** spi root */
-	const char *evname;                 /** event name */
-	struct spi_subscribers *ss;         /** subscribers */
+	spi_evid_t evid;                    /** event ID, see spi_event() */
 	void *arg;                          /** opaque data */
 	bool argfree;                       /** free arg after handler call */
 };
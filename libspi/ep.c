@@ -9,23 +9,246 @@
 #include "datastructures.h"
 #include "spi.h"
 #include "ep.h"
+#include "flow.h"
+#include "kissp.h"
+#include "wheel.h"
+#include "hash.h"
 
-static char *_k(struct spi_source *source, spi_epaddr_t epa)
+/** Source id part of the endpoint key: endpoints seen in pcap files are kept separately */
+static inline uint32_t _sid(struct spi_source *source)
 {
-	static char key[256];
-	snprintf(key, sizeof key, "%u-%llu",
-		(source->type == SPI_SOURCE_FILE) ? source->fd : 0,
-		epa);
-	return key;
+	return (source->type == SPI_SOURCE_FILE) ? source->fd : 0;
+}
+
+/** True if slot holds an endpoint */
+static inline bool _live(struct spi_ep *ep)
+{
+	return (ep && ep != SPI_EPTABLE_DELETED);
+}
+
+/** Remove endpoint from its LRU list */
+static inline void _lru_unlink(struct spi_eptable *table, struct spi_ep *ep)
+{
+	struct spi_eplist *list = &table->lru[ep->mature];
+
+	if (ep->prev)
+		ep->prev->next = ep->next;
+	else
+		list->head = ep->next;
+
+	if (ep->next)
+		ep->next->prev = ep->prev;
+	else
+		list->tail = ep->prev;
+
+	ep->prev = ep->next = NULL;
+}
+
+/** Put endpoint at the head of its LRU list */
+static inline void _lru_push(struct spi_eptable *table, struct spi_ep *ep)
+{
+	struct spi_eplist *list = &table->lru[ep->mature];
+
+	ep->prev = NULL;
+	ep->next = list->head;
+
+	if (list->head)
+		list->head->prev = ep;
+	else
+		list->tail = ep;
+
+	list->head = ep;
+}
+
+/** Estimated memory used by endpoint, see SPI_EP_OVERHEAD */
+static inline uint64_t _mem(struct spi *spi, struct spi_ep *ep)
+{
+	uint64_t mem = SPI_EP_OVERHEAD + sizeof(struct spi_ep);
+
+	if (spi->options.kiss_stream)
+		mem += sizeof(struct kissp_ep) + sizeof(struct kissp_window)
+			+ sizeof(uint32_t) * spi->options.C + spi->options.N * 2 * 16;
+	else if (ep)
+		mem += ep->pkts_size * SPI_PKT_SLOT(spi->options.N);
+	else
+		mem += spi->options.C * SPI_PKT_SLOT(spi->options.N);
+
+	return mem;
+}
+
+/** 64-bit integer hash of the endpoint key */
+static inline uint64_t _hash(uint32_t sid, spi_epaddr_t epa)
+{
+	return hash_u64(epa ^ ((uint64_t) sid << 52));
+}
+
+/** Find slot holding given endpoint, or the slot where it should be inserted */
+static inline struct spi_eptable_slot *_lookup(struct spi_eptable *table, uint32_t sid, spi_epaddr_t epa)
+{
+	struct spi_eptable_slot *slot, *deleted = NULL;
+	uint32_t mask = table->size - 1;
+	uint32_t i;
+
+	/* NB: terminates because there is always at least 1 free slot */
+	for (i = _hash(sid, epa) & mask;; i = (i + 1) & mask) {
+		slot = &table->slots[i];
+
+		if (!slot->ep)
+			return deleted ? deleted : slot;
+		else if (slot->ep == SPI_EPTABLE_DELETED)
+			deleted = deleted ? deleted : slot;
+		else if (slot->epa == epa && slot->sid == sid)
+			return slot;
+	}
+}
+
+/** Rehash all endpoints into a new slot array of given size */
+static void _resize(struct spi_eptable *table, uint32_t size)
+{
+	struct spi_eptable_slot *old = table->slots, *slot;
+	uint32_t i, oldsize = table->size;
+
+	table->slots = mmatic_zalloc(table->mm, sizeof(*table->slots) * size);
+	table->size = size;
+	table->used = table->count;
+
+	for (i = 0; i < oldsize; i++) {
+		if (!_live(old[i].ep))
+			continue;
+
+		slot = _lookup(table, old[i].sid, old[i].epa);
+		memcpy(slot, &old[i], sizeof *slot);
+	}
+
+	mmatic_free(old);
+	dbg(5, "endpoint table resized to %u slots (%u endpoints)\n", size, table->count);
+}
+
+/** Insert new endpoint into the table */
+static void _insert(struct spi_eptable *table, struct spi_ep *ep)
+{
+	struct spi_eptable_slot *slot;
+	uint32_t sid = _sid(ep->source);
+
+	/* keep load factor (including deleted slots) below 3/4 */
+	if ((table->used + 1) * 4 > table->size * 3) {
+		if ((table->count + 1) * 2 > table->size)
+			_resize(table, table->size * 2);
+		else
+			_resize(table, table->size); /* just drop the deleted slots */
+	}
+
+	slot = _lookup(table, sid, ep->epa);
+	if (!slot->ep)
+		table->used++;
+
+	slot->epa = ep->epa;
+	slot->sid = sid;
+	slot->ep = ep;
+	table->count++;
+}
+
+/******************/
+
+struct spi_eptable *ep_table_create(struct spi *spi)
+{
+	mmatic *mm = spi->mm;
+	struct spi_eptable *table;
+
+	table = mmatic_zalloc(mm, sizeof *table);
+	table->mm = mm;
+	table->spi = spi;
+	table->size = SPI_EPTABLE_SIZE;
+	table->slots = mmatic_zalloc(mm, sizeof(*table->slots) * table->size);
+
+	return table;
+}
+
+void ep_table_free(struct spi_eptable *table)
+{
+	ep_table_flush(table);
+	mmatic_free(table->slots);
+	mmatic_free(table);
+}
+
+void ep_table_flush(struct spi_eptable *table)
+{
+	uint32_t i;
+
+	for (i = 0; i < table->size; i++) {
+		if (_live(table->slots[i].ep))
+			ep_destroy(table->spi, table->slots[i].ep);
+	}
+
+	memset(table->slots, 0, sizeof(*table->slots) * table->size);
+	table->count = 0;
+	table->used = 0;
+	table->iter = 0;
+}
+
+struct spi_ep *ep_table_get(struct spi_eptable *table, struct spi_source *source, spi_epaddr_t epa)
+{
+	struct spi_eptable_slot *slot = _lookup(table, _sid(source), epa);
+	return (slot->ep == SPI_EPTABLE_DELETED) ? NULL : slot->ep;
+}
+
+void ep_table_reset(struct spi_eptable *table)
+{
+	table->iter = 0;
+}
+
+struct spi_ep *ep_table_iter(struct spi_eptable *table)
+{
+	struct spi_ep *ep;
+
+	while (table->iter < table->size) {
+		ep = table->slots[table->iter++].ep;
+		if (_live(ep))
+			return ep;
+	}
+
+	return NULL;
+}
+
+void ep_table_remove(struct spi_eptable *table)
+{
+	struct spi_eptable_slot *slot;
+
+	if (table->iter == 0)
+		return;
+
+	slot = &table->slots[table->iter - 1];
+	if (!_live(slot->ep))
+		return;
+
+	ep_destroy(table->spi, slot->ep);
+	slot->ep = SPI_EPTABLE_DELETED;
+	table->count--;
+}
+
+void ep_table_delete(struct spi_eptable *table, struct spi_ep *ep)
+{
+	struct spi_eptable_slot *slot = _lookup(table, _sid(ep->source), ep->epa);
+
+	if (slot->ep != ep)
+		return;
+
+	ep_destroy(table->spi, ep);
+	slot->ep = SPI_EPTABLE_DELETED;
+	table->count--;
 }
 
 /******************/
 
 /** Handle moment in which endpoint is deleted */
-void ep_destroy(struct spi_ep *ep)
+void ep_destroy(struct spi *spi, struct spi_ep *ep)
 {
 	struct spi_source *source = ep->source;
-	struct spi_stats *stats = &(source->spi->stats);
+	struct spi_stats *stats = &spi->stats;
+
+	spi->eps->mem -= _mem(spi, ep);
+	if (spi->mem_limit)
+		_lru_unlink(spi->eps, ep);
 
 	/* a testing endpoint: update performance metrics */
 	if (source->testing && ep->predictions > 0) {
@@ -54,50 +277,170 @@ void ep_destroy(struct spi_ep *ep)
 	mmatic_destroy(ep->mm);
 }
 
-struct spi_ep *ep_new_pkt(struct spi_source *source, spi_epaddr_t epa,
+/** Find the least recently active endpoint not in use
+ * @param mature     LRU list to search */
+static struct spi_ep *_victim(struct spi_eptable *table, bool mature)
+{
+	struct spi_ep *ep, *first = NULL;
+
+	while ((ep = table->lru[mature].tail) && ep != first) {
+		if (!ep_pinned(ep))
+			return ep;
+
+		/* endpoint under use: treat as recently active */
+		_lru_unlink(table, ep);
+		_lru_push(table, ep);
+
+		if (!first)
+			first = ep;
+	}
+
+	return NULL;
+}
+
+void ep_evict(struct spi *spi, uint64_t need)
+{
+	struct spi_ep *ep;
+	struct spi_flow *flow;
+
+	while (spi_mem(spi) + need > spi->mem_limit) {
+		/* endpoints that never reached C packets go first */
+		ep = _victim(spi->eps, false);
+
+		/* then flows and mature endpoints, least recently active first */
+		if (!ep) {
+			ep = _victim(spi->eps, true);
+			flow = (spi->flows && spi->flows->count > 0) ? flow_oldest(spi) : NULL;
+
+			if (flow && (!ep || timercmp(&flow->last, &ep->last, <))) {
+				flow_remove(spi, flow);
+				spi->stats.evicted_flows++;
+				continue;
+			}
+		}
+
+		if (!ep) {
+			dbg(5, "memory budget exceeded, but all endpoints are in use\n");
+			return;
+		}
+
+		dbg(8, "evicting ep %s\n", spi_epa2a(ep->epa));
+		ep_table_delete(spi->eps, ep);
+		spi->stats.evicted_eps++;
+	}
+}
+
+/** Endpoint reached C packets for the first time */
+static inline void _mature(struct spi *spi, struct spi_ep *ep)
+{
+	if (ep->mature)
+		return;
+
+	if (spi->mem_limit) {
+		_lru_unlink(spi->eps, ep);
+		ep->mature = true;
+		_lru_push(spi->eps, ep);
+	} else {
+		ep->mature = true;
+	}
+}
+
+/** Double the packet ring capacity
+ * Happens only if packets arrive faster than the endpoint is handled */
+static void _pkts_grow(struct spi_ep *ep, uint32_t slot)
+{
+	uint8_t *pkts;
+	uint32_t first;
+
+	pkts = mmatic_alloc(ep->mm, 2 * ep->pkts_size * slot);
+
+	/* linearize: oldest packet goes to slot 0 */
+	first = ep->pkts_size - ep->pkts_head;
+	memcpy(pkts, ep->pkts + ep->pkts_head * slot, first * slot);
+	memcpy(pkts + first * slot, ep->pkts, ep->pkts_head * slot);
+
+	mmatic_free(ep->pkts);
+	ep->pkts = pkts;
+	ep->pkts_head = 0;
+	ep->pkts_size *= 2;
+}
+
+struct spi_ep *ep_new_pkt(struct spi *spi, struct spi_source *source, spi_epaddr_t epa,
 	const struct timeval *ts, void *data, uint32_t size)
 {
-	struct spi *spi = source->spi;
 	struct spi_ep *ep;
-	char *key;
 	struct spi_pkt *pkt;
+	uint32_t slot = SPI_PKT_SLOT(spi->options.N);
 	mmatic *mm;
 
-	key = _k(source, epa);
-	ep = thash_get(spi->eps, key);
+	ep = ep_table_get(spi->eps, source, epa);
 	if (!ep) {
+		/* make room in memory budget */
+		if (spi->mem_limit)
+			ep_evict(spi, _mem(spi, NULL));
+
 		mm = mmatic_create();
 		ep = mmatic_zalloc(mm, sizeof *ep);
 		ep->mm = mm;
 		ep->source = source;
 		ep->epa = epa;
-		thash_set(spi->eps, key, ep);
+		_insert(spi->eps, ep);
+		spi->eps->mem += _mem(spi, ep);
+		if (spi->mem_limit)
+			_lru_push(spi->eps, ep);
 
-		source->eps++;
+		/* schedule the first expiry check */
+		ep->expire = wheel_add(wheel_get(spi, source), SPI_WHEEL_EP, source, epa, 0,
+			ts->tv_sec, ts->tv_sec + SPI_EP_TIMEOUT + 1);
+
+		__atomic_add_fetch(&source->eps, 1, __ATOMIC_RELAXED);
 
 		dbg(8, "new ep %s\n", spi_epa2a(epa));
 	}
 
-	/* make packet */
-	pkt = mmatic_zalloc(ep->mm, sizeof *pkt);
-	pkt->size = size;
-	pkt->payload = mmatic_zalloc(ep->mm, spi->options.N);
-	memcpy(pkt->payload, data, spi->options.N);
-	memcpy(&pkt->ts, ts, sizeof(struct timeval));
-
 	/* update last packet time */
 	memcpy(&ep->last, ts, sizeof(struct timeval));
 
-	/* store packet */
-	if (!ep->pkts)
-		ep->pkts = tlist_create(mmatic_free, ep->mm);
+	/* most recently active */
+	if (spi->mem_limit && spi->eps->lru[ep->mature].head != ep) {
+		_lru_unlink(spi->eps, ep);
+		_lru_push(spi->eps, ep);
+	}
+
+	/* streaming mode: just update the signature */
+	if (spi->options.kiss_stream) {
+		if (kissp_stream(spi, ep, ts, data, size) && ep->gclock1 == 0) {
+			_mature(spi, ep);
+			ep->gclock1++;
+			spi_announce_id(spi, SPI_EV_ENDPOINT_PACKETS_READY, 0, ep, false);
+			dbg(7, "ep %s ready\n", spi_epa2a(epa));
+		}
+
+		return ep;
+	}
+
+	/* get ring slot for the packet */
+	if (!ep->pkts) {
+		ep->pkts_size = spi->options.C;
+		ep->pkts = mmatic_alloc(ep->mm, ep->pkts_size * slot);
+		spi->eps->mem += ep->pkts_size * slot;
+	} else if (ep->pkts_count == ep->pkts_size) {
+		spi->eps->mem += ep->pkts_size * slot;
+		_pkts_grow(ep, slot);
+	}
+
+	pkt = ep_pkt(ep, ep->pkts_count++);
 
-	tlist_push(ep->pkts, pkt);
+	/* store packet */
+	pkt->size = size;
+	memcpy(pkt->payload, data, spi->options.N);
+	memcpy(&pkt->ts, ts, sizeof(struct timeval));
 
 	/* generate event if pkts big enough */
-	if (ep->gclock1 == 0 && tlist_count(ep->pkts) >= spi->options.C) {
+	if (ep->gclock1 == 0 && ep->pkts_count >= spi->options.C) {
+		_mature(spi, ep);
 		ep->gclock1++;
-		spi_announce(spi, "endpointPacketsReady", 0, ep, false);
+		spi_announce_id(spi, SPI_EV_ENDPOINT_PACKETS_READY, 0, ep, false);
 		dbg(7, "ep %s ready\n", spi_epa2a(epa));
 	}
 
@@ -8,11 +8,81 @@
 #define _EP_H_
 
 #include "datastructures.h"
+#include "spi.h"
 
-/** Destroy endpoint memory */
-void ep_destroy(struct spi_ep *ep);
+/** Marks a deleted slot in struct spi_eptable */
+#define SPI_EPTABLE_DELETED ((struct spi_ep *) 1)
+
+/** Iterate over all endpoints in the table
+ * @note ep_table_remove() may be called inside the loop */
+#define ep_table_iter_loop(table, ep) for (ep_table_reset(table); (ep = ep_table_iter(table));)
+
+/** Create endpoint hash table
+ * @param spi        spi root or worker shard owning the endpoints */
+struct spi_eptable *ep_table_create(struct spi *spi);
+
+/** Destroy all endpoints and free the table */
+void ep_table_free(struct spi_eptable *table);
+
+/** Destroy all endpoints, but keep the table */
+void ep_table_flush(struct spi_eptable *table);
+
+/** Find endpoint
+ * @param source     packet source
+ * @param epa        endpoint address
+ * @retval NULL      endpoint not found
+ */
+struct spi_ep *ep_table_get(struct spi_eptable *table, struct spi_source *source, spi_epaddr_t epa);
+
+/** Rewind table iterator */
+void ep_table_reset(struct spi_eptable *table);
+
+/** Return next endpoint or NULL if end of table reached */
+struct spi_ep *ep_table_iter(struct spi_eptable *table);
+
+/** Destroy the endpoint last returned by ep_table_iter() */
+void ep_table_remove(struct spi_eptable *table);
+
+/** Destroy given endpoint and remove it from the table */
+void ep_table_delete(struct spi_eptable *table, struct spi_ep *ep);
+
+/** Size of single ring slot holding struct spi_pkt with N bytes of payload */
+#define SPI_PKT_SLOT(N) ((sizeof(struct spi_pkt) + (N) + 7) & ~7)
+
+/** Get i-th oldest packet collected by endpoint */
+static inline struct spi_pkt *ep_pkt(struct spi_ep *ep, uint32_t i)
+{
+	uint32_t slot = SPI_PKT_SLOT(ep->source->spi->options.N);
+	return (struct spi_pkt *) (ep->pkts + ((ep->pkts_head + i) % ep->pkts_size) * slot);
+}
+
+/** Drop given number of oldest packets collected by endpoint */
+static inline void ep_pkts_eat(struct spi_ep *ep, uint32_t num)
+{
+	num = MIN(num, ep->pkts_count);
+	ep->pkts_head = (ep->pkts_head + num) % ep->pkts_size;
+	ep->pkts_count -= num;
+}
+
+/** True if endpoint is in use: locked by any GC lock */
+static inline bool ep_pinned(struct spi_ep *ep)
+{
+	return (ep->gclock1 || ep->gclock2 || ep->gclock3);
+}
+
+/** Evict least recently active endpoints and flows not in use until there is room in memory budget
+ * Endpoints which never reached C packets are evicted first.
+ * @param spi        spi root or worker shard with spi->mem_limit set
+ * @param need       memory to make room for [B]
+ */
+void ep_evict(struct spi *spi, uint64_t need);
+
+/** Destroy endpoint memory
+ * @param spi        owner of the endpoint: its stats are updated */
+void ep_destroy(struct spi *spi, struct spi_ep *ep);
 
 /** Save packet of endpoint given by ip and port
+ * @param spi        spi root or worker shard owning the endpoint
  * @param source     packet source
  * @param epa        endpoint address
  * @param ts         packet timestamp
@@ -20,7 +90,7 @@ void ep_destroy(struct spi_ep *ep);
  * @param size       real packet size
  * @return           endpoint structure
  */
-struct spi_ep *ep_new_pkt(struct spi_source *source, spi_epaddr_t epa,
+struct spi_ep *ep_new_pkt(struct spi *spi, struct spi_source *source, spi_epaddr_t epa,
 	const struct timeval *ts, void *data, uint32_t size);
 
 #endif
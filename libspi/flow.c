@@ -12,72 +12,293 @@
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 
+#include "settings.h"
+#include "datastructures.h"
 #include "flow.h"
 #include "ep.h"
-#include "datastructures.h"
+#include "wheel.h"
+
+/** Source id part of the flow key: flows seen in pcap files are kept separately */
+static inline uint32_t _sid(struct spi_source *source)
+{
+	return (source->type == SPI_SOURCE_FILE) ? source->fd : 0;
+}
 
-static inline char *_k(struct spi_source *source, spi_epaddr_t src, spi_epaddr_t dst)
+/** 64-bit integer hash of the flow key */
+static inline uint64_t _hash(uint32_t sid, spi_epaddr_t epa1, spi_epaddr_t epa2)
 {
-	static char key[258];
+	uint64_t h = epa1 ^ ((uint64_t) sid << 52);
 
-	snprintf(key, sizeof key, "%u-%llu-%llu",
-			(source->type == SPI_SOURCE_FILE) ? source->fd : 0,
-			MIN(src, dst), MAX(src, dst));
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= epa2;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
 
-	return key;
+	return h;
 }
 
-static inline struct spi_flow *_get_flow(struct spi_source *source, spi_epaddr_t src, spi_epaddr_t dst)
+/** Hash tag stored in bucket: never 0 (free) nor 1 (deleted) */
+static inline uint16_t _tag(uint64_t hash)
 {
-	return thash_get(source->spi->flows, _k(source, src, dst));
+	uint16_t tag = hash >> 48;
+	return (tag < 2) ? tag + 2 : tag;
 }
 
-static inline void _set_flow(struct spi_source *source, spi_epaddr_t src, spi_epaddr_t dst, struct spi_flow *flow)
+/** Find flow by its key
+ * @param ins         if not NULL, store there the slot where the flow should be inserted
+ * @retval NULL       flow not found
+ */
+static inline struct spi_flow *_lookup(struct spi_flowtable *table, uint32_t sid,
+	spi_epaddr_t epa1, spi_epaddr_t epa2, struct spi_flow **ins)
 {
-	thash_set(source->spi->flows, _k(source, src, dst), flow);
+	struct spi_flowbucket *b;
+	struct spi_flow *flow;
+	uint64_t hash = _hash(sid, epa1, epa2);
+	uint16_t tag = _tag(hash);
+	uint32_t mask = table->size - 1;
+	uint32_t i;
+	int j;
+	bool end = false;
+
+	if (ins)
+		*ins = NULL;
+
+	/* NB: terminates because there is always at least 1 free slot */
+	for (i = hash & mask; !end; i = (i + 1) & mask) {
+		b = &table->buckets[i];
+
+		for (j = 0; j < SPI_FLOWTABLE_WAYS; j++) {
+			if (b->tags[j] == tag) {
+				flow = &b->flows[j];
+				if (flow->epa1 == epa1 && flow->epa2 == epa2 && _sid(flow->source) == sid)
+					return flow;
+			} else if (b->tags[j] < 2) {
+				if (ins && !*ins)
+					*ins = &b->flows[j];
+
+				/* free slot - end of probing chain */
+				if (b->tags[j] == 0)
+					end = true;
+			}
+		}
+	}
+
+	return NULL;
 }
 
-/***********/
+/** Return tag of given flow slot */
+static inline uint16_t *_tagp(struct spi_flowtable *table, struct spi_flow *flow)
+{
+	struct spi_flowbucket *b;
+	size_t i = ((uint8_t *) flow - (uint8_t *) table->buckets) / sizeof *b;
 
-void flow_destroy(struct spi_flow *flow)
+	b = &table->buckets[i];
+	return &b->tags[flow - b->flows];
+}
+
+/** Allocate zeroed, cache line aligned bucket array */
+static void _alloc(struct spi_flowtable *table, uint32_t size)
 {
-	mmatic_free(flow);
+	uintptr_t p;
+
+	table->mem = mmatic_zalloc(table->mm, sizeof(*table->buckets) * size + 63);
+	p = ((uintptr_t) table->mem + 63) & ~((uintptr_t) 63);
+
+	table->buckets = (struct spi_flowbucket *) p;
+	table->size = size;
 }
 
-void flow_tcp_flags(struct spi_source *source, spi_epaddr_t src, spi_epaddr_t dst, struct tcphdr *tcp)
+/** Rehash all flows into a new bucket array of given size */
+static void _resize(struct spi_flowtable *table, uint32_t size)
 {
+	struct spi_flowbucket *old = table->buckets;
+	void *oldmem = table->mem;
+	uint32_t i, oldsize = table->size;
 	struct spi_flow *flow;
+	int j;
 
-	flow = _get_flow(source, src, dst);
-	if (!flow)
+	_alloc(table, size);
+	table->used = table->count;
+
+	for (i = 0; i < oldsize; i++) {
+		for (j = 0; j < SPI_FLOWTABLE_WAYS; j++) {
+			if (old[i].tags[j] < 2)
+				continue;
+
+			_lookup(table, _sid(old[i].flows[j].source),
+				old[i].flows[j].epa1, old[i].flows[j].epa2, &flow);
+			memcpy(flow, &old[i].flows[j], sizeof *flow);
+			*_tagp(table, flow) = old[i].tags[j];
+		}
+	}
+
+	mmatic_free(oldmem);
+	dbg(5, "flow table resized to %u buckets (%u flows)\n", size, table->count);
+}
+
+/***********/
+
+struct spi_flowtable *flow_table_create(mmatic *mm)
+{
+	struct spi_flowtable *table;
+
+	table = mmatic_zalloc(mm, sizeof *table);
+	table->mm = mm;
+	table->sample = 2463534242U;
+	_alloc(table, SPI_FLOWTABLE_SIZE);
+
+	return table;
+}
+
+void flow_table_free(struct spi_flowtable *table)
+{
+	mmatic_free(table->mem);
+	mmatic_free(table);
+}
+
+void flow_table_flush(struct spi_flowtable *table)
+{
+	memset(table->buckets, 0, sizeof(*table->buckets) * table->size);
+	table->count = 0;
+	table->used = 0;
+	table->iter = 0;
+}
+
+void flow_table_reset(struct spi_flowtable *table)
+{
+	table->iter = 0;
+}
+
+struct spi_flow *flow_table_iter(struct spi_flowtable *table)
+{
+	uint32_t i;
+
+	while (table->iter < table->size * SPI_FLOWTABLE_WAYS) {
+		i = table->iter++;
+		if (table->buckets[i / SPI_FLOWTABLE_WAYS].tags[i % SPI_FLOWTABLE_WAYS] >= 2)
+			return &table->buckets[i / SPI_FLOWTABLE_WAYS].flows[i % SPI_FLOWTABLE_WAYS];
+	}
+
+	return NULL;
+}
+
+void flow_table_remove(struct spi_flowtable *table)
+{
+	uint16_t *tag;
+	uint32_t i;
+
+	if (table->iter == 0)
 		return;
 
+	i = table->iter - 1;
+	tag = &table->buckets[i / SPI_FLOWTABLE_WAYS].tags[i % SPI_FLOWTABLE_WAYS];
+	if (*tag < 2)
+		return;
+
+	*tag = 1;
+	table->count--;
+}
+
+struct spi_flow *flow_get(struct spi *spi, struct spi_source *source, spi_epaddr_t src, spi_epaddr_t dst)
+{
+	return _lookup(spi->flows, _sid(source), MIN(src, dst), MAX(src, dst), NULL);
+}
+
+bool flow_tcp_flags(struct spi_flow *flow, spi_epaddr_t src, spi_epaddr_t dst, struct tcphdr *tcp)
+{
+	if (!flow)
+		return false;
+
 	/* handle RST */
 	if (tcp->th_flags & TH_RST) {
 		flow->rst |= 1 + (src > dst);
-		return;
+		return (flow->rst == 3);
 	}
 
 	/* handle FIN */
 	if (tcp->th_flags & TH_FIN) {
 		flow->fin++;
 		flow->fin |= 1 + (src > dst);
+		return (flow->fin == 3);
+	}
+
+	return false;
+}
+
+void flow_remove(struct spi *spi, struct spi_flow *flow)
+{
+	uint16_t *tag = _tagp(spi->flows, flow);
+
+	if (*tag < 2)
 		return;
+
+	*tag = 1;
+	spi->flows->count--;
+}
+
+struct spi_flow *flow_oldest(struct spi *spi)
+{
+	struct spi_flowtable *table = spi->flows;
+	struct spi_flowbucket *b;
+	struct spi_flow *oldest = NULL;
+	int i, j;
+
+	for (i = 0; i < SPI_EVICT_SAMPLES; i++) {
+		/* xorshift32 */
+		table->sample ^= table->sample << 13;
+		table->sample ^= table->sample >> 17;
+		table->sample ^= table->sample << 5;
+
+		b = &table->buckets[table->sample & (table->size - 1)];
+		for (j = 0; j < SPI_FLOWTABLE_WAYS; j++) {
+			if (b->tags[j] < 2)
+				continue;
+
+			if (!oldest || timercmp(&b->flows[j].last, &oldest->last, <))
+				oldest = &b->flows[j];
+		}
 	}
+
+	return oldest;
 }
 
-int flow_count(struct spi_source *source, spi_epaddr_t src, spi_epaddr_t dst, const struct timeval *ts)
+int flow_count(struct spi *spi, struct spi_source *source, struct spi_flow *flow,
+	spi_epaddr_t src, spi_epaddr_t dst, const struct timeval *ts)
 {
-	struct spi *spi = source->spi;
-	struct spi_flow *flow;
+	struct spi_flowtable *table = spi->flows;
+	uint32_t sid = _sid(source);
+	uint16_t *tag;
 
-	flow = _get_flow(source, src, dst);
 	if (!flow) {
-		flow = mmatic_zalloc(spi, sizeof *flow);
+		/* make room in memory budget */
+		if (spi->mem_limit)
+			ep_evict(spi, SPI_FLOW_MEM);
+
+		/* keep load factor (including deleted slots) below 3/4 */
+		if ((table->used + 1) * 4 > table->size * SPI_FLOWTABLE_WAYS * 3) {
+			if ((table->count + 1) * 2 > table->size * SPI_FLOWTABLE_WAYS)
+				_resize(table, table->size * 2);
+			else
+				_resize(table, table->size); /* just drop the deleted slots */
+		}
+
+		_lookup(table, sid, MIN(src, dst), MAX(src, dst), &flow);
+		tag = _tagp(table, flow);
+		if (*tag == 0)
+			table->used++;
+		*tag = _tag(_hash(sid, MIN(src, dst), MAX(src, dst)));
+		table->count++;
+
+		memset(flow, 0, sizeof *flow);
 		flow->source = source;
 		flow->epa1 = MIN(src, dst);
 		flow->epa2 = MAX(src, dst);
-		_set_flow(source, src, dst, flow);
+
+		/* schedule the first expiry check */
+		flow->expire = wheel_add(wheel_get(spi, source), SPI_WHEEL_FLOW, source, flow->epa1, flow->epa2,
+			ts->tv_sec, ts->tv_sec + SPI_FLOW_TIMEOUT + 1);
 	}
 
 	memcpy(&flow->last, ts, sizeof(struct timeval));
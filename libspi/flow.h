@@ -11,23 +11,72 @@
 #include <netinet/tcp.h>
 #include "datastructures.h"
 
-/** Destroy flow memory */
-void flow_destroy(struct spi_flow *flow);
+/** Estimated memory used by single flow (the table is kept about half full) */
+#define SPI_FLOW_MEM (2 * sizeof(struct spi_flowbucket) / SPI_FLOWTABLE_WAYS)
+
+/** Iterate over all flows in the table
+ * @note flow_table_remove() may be called inside the loop */
+#define flow_table_iter_loop(table, flow) for (flow_table_reset(table); (flow = flow_table_iter(table));)
+
+/** Create flow hash table */
+struct spi_flowtable *flow_table_create(mmatic *mm);
+
+/** Free the table and all flows */
+void flow_table_free(struct spi_flowtable *table);
+
+/** Drop all flows, but keep the table */
+void flow_table_flush(struct spi_flowtable *table);
+
+/** Rewind table iterator */
+void flow_table_reset(struct spi_flowtable *table);
+
+/** Return next flow or NULL if end of table reached */
+struct spi_flow *flow_table_iter(struct spi_flowtable *table);
+
+/** Drop the flow last returned by flow_table_iter() */
+void flow_table_remove(struct spi_flowtable *table);
+
+/** Find flow between two endpoints
+ * @param spi         spi root or worker shard owning the flow table
+ * @param source      packet source
+ * @param src         source endpoint address
+ * @param dst         destination endpoint address
+ * @retval NULL       flow not tracked yet
+ */
+struct spi_flow *flow_get(struct spi *spi, struct spi_source *source, spi_epaddr_t src, spi_epaddr_t dst);
 
 /** Interpret TCP flags
- * Look for RST and FIN flags and close matching flow if necessary
+ * Look for RST and FIN flags and mark matching flow as closed if necessary
+ * @param flow        flow found by flow_get() (may be NULL)
  * @param src         source endpoint address
  * @param dst         destination endpoint address
  * @param tcp         tcp header
+ * @retval true       connection closed: drop the flow with flow_remove() after counting the packet
+ */
+bool flow_tcp_flags(struct spi_flow *flow, spi_epaddr_t src, spi_epaddr_t dst, struct tcphdr *tcp);
+
+/** Drop flow found by flow_get()
+ * @param spi         spi root or worker shard owning the flow table
+ * @param flow        the flow
+ */
+void flow_remove(struct spi *spi, struct spi_flow *flow);
+
+/** Find the least recently active flow among a few random table buckets
+ * @param spi         spi root or worker shard owning the flow table
+ * @retval NULL       no flows in sampled buckets
  */
-void flow_tcp_flags(struct spi_source *source, spi_epaddr_t src, spi_epaddr_t dst, struct tcphdr *tcp);
+struct spi_flow *flow_oldest(struct spi *spi);
 
 /** Count flow packet
+ * @param spi         spi root or worker shard owning the flow table
+ * @param source      packet source
+ * @param flow        flow found by flow_get(): if NULL, a new flow is created
  * @param src         source endpoint address
  * @param dst         destination endpoint address
  * @param ts          packet timestamp
  * @return            flow packet counter
  */
-int flow_count(struct spi_source *source, spi_epaddr_t src, spi_epaddr_t dst, const struct timeval *ts);
+int flow_count(struct spi *spi, struct spi_source *source, struct spi_flow *flow,
+	spi_epaddr_t src, spi_epaddr_t dst, const struct timeval *ts);
 
 #endif
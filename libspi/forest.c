@@ -0,0 +1,451 @@
+/*
+ * spi: Statistical Packet Inspection: random forest classifier
+ * Copyright (C) 2011 Paweł Foremski <pawel@foremski.pl>
+ * This software is licensed under GNU GPL version 3
+ */
+
+#include <math.h>
+#include <libpjf/lib.h>
+
+#include "datastructures.h"
+#include "forest.h"
+#include "hash.h"
+
+/** Header of saved forest, in host byte order, followed by:
+ *  - labels: nr_class x int32_t
+ *  - root: trees x int32_t
+ *  - feature: nodes x uint16_t
+ *  - threshold: nodes x double
+ *  - child: nodes x int32_t
+ *  - prob: leaves x nr_class x float
+ */
+struct forest_header {
+	char magic[4];                   /** SPI_FOREST_MAGIC */
+	uint32_t version;                /** SPI_FOREST_VERSION */
+	uint32_t trees;                  /** number of trees */
+	uint32_t features;               /** number of signature coordinates */
+	uint32_t nr_class;               /** number of classes */
+	uint32_t nodes;                  /** number of nodes */
+	uint32_t leaves;                 /** number of leaves */
+};
+
+/** Sample value of a feature, for split search */
+struct forest_pair {
+	double v;                        /** feature value */
+	int c;                           /** class index */
+};
+
+/** Training state */
+struct forest_train {
+	struct forest *f;                /** forest being built */
+	const double *x;                 /** dense samples: l x d */
+	const int *y;                    /** class index of each sample */
+	int l;                           /** number of samples */
+	int d;                           /** number of features */
+	int nc;                          /** number of classes */
+	uint64_t rnd;                    /** random generator state */
+
+	int nodes_size;                  /** allocated nodes */
+	int leaves_size;                 /** allocated leaves */
+
+	struct forest_pair *pairs;       /** split search: values of node samples */
+	int *L;                          /** split search: class counts on the left */
+	int *R;                          /** split search: class counts on the right */
+	int *feat;                       /** split search: permutation of features */
+};
+
+/** Allocate memory or die */
+static void *_realloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (!ptr)
+		die("random forest: out of memory\n");
+
+	return ptr;
+}
+
+/** Allocate consecutive nodes
+ * @return index of the first one */
+static int _nodes(struct forest_train *t, int num)
+{
+	struct forest *f = t->f;
+	int n = f->nodes;
+
+	if (f->nodes + num > t->nodes_size) {
+		t->nodes_size = t->nodes_size ? t->nodes_size * 2 : 1024;
+		f->feature = _realloc(f->feature, sizeof *f->feature * t->nodes_size);
+		f->threshold = _realloc(f->threshold, sizeof *f->threshold * t->nodes_size);
+		f->child = _realloc(f->child, sizeof *f->child * t->nodes_size);
+	}
+
+	f->nodes += num;
+	return n;
+}
+
+/** Make node a leaf with class distribution of its samples */
+static void _leaf(struct forest_train *t, int node, const int *counts, int n)
+{
+	struct forest *f = t->f;
+	int c;
+
+	if (f->leaves == t->leaves_size) {
+		t->leaves_size = t->leaves_size ? t->leaves_size * 2 : 512;
+		f->prob = _realloc(f->prob, sizeof *f->prob * t->leaves_size * t->nc);
+	}
+
+	for (c = 0; c < t->nc; c++)
+		f->prob[f->leaves * t->nc + c] = (float) counts[c] / n;
+
+	f->feature[node] = 0;
+	f->threshold[node] = 0.0;
+	f->child[node] = -1 - f->leaves++;
+}
+
+static int _pair_cmp(const void *a, const void *b)
+{
+	const struct forest_pair *pa = a, *pb = b;
+
+	return (pa->v > pb->v) - (pa->v < pb->v);
+}
+
+/** Find best split of node samples on random subset of features (Gini impurity)
+ * @param counts     class counts of node samples
+ * @retval false     no split improves the node
+ */
+static bool _split(struct forest_train *t, const int *idx, int n, const int *counts,
+	int *feature, double *threshold)
+{
+	struct forest_pair *pr = t->pairs;
+	int i, j, k, c, fi, tmp, mtry;
+	double sumL, sumR, score, best;
+
+	mtry = MAX(1, (int) sqrt(t->d));
+
+	/* the node itself */
+	for (best = 0.0, c = 0; c < t->nc; c++)
+		best += (double) counts[c] * counts[c];
+	best = best / n + 1e-9;
+
+	for (k = 0; k < mtry; k++) {
+		/* draw feature without replacement */
+		j = k + hash_rand(&t->rnd) % (t->d - k);
+		tmp = t->feat[k]; t->feat[k] = t->feat[j]; t->feat[j] = tmp;
+		fi = t->feat[k];
+
+		for (i = 0; i < n; i++) {
+			pr[i].v = t->x[(size_t) idx[i] * t->d + fi];
+			pr[i].c = t->y[idx[i]];
+		}
+		qsort(pr, n, sizeof *pr, _pair_cmp);
+
+		/* move samples from right to left, keeping sums of squared class counts */
+		memset(t->L, 0, sizeof(int) * t->nc);
+		memcpy(t->R, counts, sizeof(int) * t->nc);
+		sumL = 0.0;
+		for (sumR = 0.0, c = 0; c < t->nc; c++)
+			sumR += (double) counts[c] * counts[c];
+
+		for (i = 0; i < n - 1; i++) {
+			c = pr[i].c;
+			sumL += 2 * t->L[c]++ + 1;
+			sumR -= 2 * t->R[c]-- - 1;
+
+			if (pr[i].v == pr[i + 1].v)
+				continue;
+
+			score = sumL / (i + 1) + sumR / (n - i - 1);
+			if (score > best) {
+				best = score;
+				*feature = fi;
+
+				/* NB: midpoint may round up to the greater value */
+				*threshold = pr[i].v + (pr[i + 1].v - pr[i].v) / 2;
+				if (*threshold >= pr[i + 1].v)
+					*threshold = pr[i].v;
+			}
+		}
+	}
+
+	return (*feature >= 0);
+}
+
+/** Grow subtree of node on given samples */
+static void _grow(struct forest_train *t, int node, int *idx, int n, int depth)
+{
+	int counts[t->nc];
+	int i, j, c, k, feature = -1, tmp, classes = 0;
+	double threshold = 0.0;
+
+	memset(counts, 0, sizeof counts);
+	for (i = 0; i < n; i++)
+		counts[t->y[idx[i]]]++;
+
+	for (c = 0; c < t->nc; c++) {
+		if (counts[c])
+			classes++;
+	}
+
+	if (classes < 2 || n < SPI_FOREST_MIN_SPLIT || depth >= SPI_FOREST_DEPTH
+		|| !_split(t, idx, n, counts, &feature, &threshold)) {
+		_leaf(t, node, counts, n);
+		return;
+	}
+
+	/* partition: x <= threshold to the left */
+	for (i = 0, j = n - 1; i <= j;) {
+		if (t->x[(size_t) idx[i] * t->d + feature] <= threshold) {
+			i++;
+		} else {
+			tmp = idx[i]; idx[i] = idx[j]; idx[j] = tmp;
+			j--;
+		}
+	}
+
+	/* NB: _nodes() may move the arrays */
+	k = _nodes(t, 2);
+	t->f->feature[node] = feature;
+	t->f->threshold[node] = threshold;
+	t->f->child[node] = k;
+
+	_grow(t, k, idx, i, depth + 1);
+	_grow(t, k + 1, idx + i, n - i, depth + 1);
+}
+
+/******************/
+
+struct forest *forest_train(const struct svm_problem *p, int features)
+{
+	struct forest_train t;
+	struct forest *f;
+	const struct svm_node *node;
+	int map[SPI_LABEL_MAX + 1];
+	int i, c, tree, *idx;
+	double *x;
+	int *y;
+
+	if (p->l < 1)
+		return NULL;
+
+	memset(&t, 0, sizeof t);
+	f = t.f = _realloc(NULL, sizeof *f);
+	memset(f, 0, sizeof *f);
+	f->features = features;
+
+	/* classes: labels in ascending order */
+	memset(map, 0, sizeof map);
+	for (i = 0; i < p->l; i++)
+		map[(spi_label_t) p->y[i]] = 1;
+
+	for (c = 0; c <= SPI_LABEL_MAX; c++) {
+		if (map[c] && f->nr_class < SPI_LABEL_MAX) {
+			f->labels[f->nr_class] = c;
+			map[c] = f->nr_class++;
+		} else {
+			map[c] = 0;
+		}
+	}
+
+	/* dense samples */
+	x = _realloc(NULL, sizeof(double) * p->l * features);
+	y = _realloc(NULL, sizeof(int) * p->l);
+	memset(x, 0, sizeof(double) * p->l * features);
+
+	for (i = 0; i < p->l; i++) {
+		for (node = p->x[i]; node->index != -1; node++) {
+			if (node->index > 0 && node->index <= features)
+				x[(size_t) i * features + node->index - 1] = node->value;
+		}
+		y[i] = map[(spi_label_t) p->y[i]];
+	}
+
+	t.x = x;
+	t.y = y;
+	t.l = p->l;
+	t.d = features;
+	t.nc = f->nr_class;
+	t.rnd = SPI_FOREST_SEED;
+	t.pairs = _realloc(NULL, sizeof *t.pairs * p->l);
+	t.L = _realloc(NULL, sizeof(int) * t.nc);
+	t.R = _realloc(NULL, sizeof(int) * t.nc);
+	t.feat = _realloc(NULL, sizeof(int) * features);
+	for (i = 0; i < features; i++)
+		t.feat[i] = i;
+
+	/* grow each tree on a bootstrap sample */
+	idx = _realloc(NULL, sizeof(int) * p->l);
+	f->trees = SPI_FOREST_TREES;
+	f->root = _realloc(NULL, sizeof *f->root * f->trees);
+
+	for (tree = 0; tree < f->trees; tree++) {
+		for (i = 0; i < p->l; i++)
+			idx[i] = hash_rand(&t.rnd) % p->l;
+
+		f->root[tree] = _nodes(&t, 1);
+		_grow(&t, f->root[tree], idx, p->l, 0);
+	}
+
+	free(idx);
+	free(t.feat);
+	free(t.R);
+	free(t.L);
+	free(t.pairs);
+	free(y);
+	free(x);
+
+	return f;
+}
+
+void forest_predict(const struct forest *f, const double *x, double *prob)
+{
+	const float *p;
+	int32_t node[f->trees];
+	int t, c, n, k;
+	bool more;
+
+	memset(prob, 0, sizeof(double) * f->nr_class);
+	memcpy(node, f->root, sizeof node);
+
+	/* descend all trees one level at a time, so their memory loads overlap */
+	do {
+		more = false;
+		for (t = 0; t < f->trees; t++) {
+			n = node[t];
+			k = f->child[n];
+			node[t] = k >= 0 ? k + (x[f->feature[n]] > f->threshold[n]) : n;
+			more |= (k >= 0);
+		}
+	} while (more);
+
+	for (t = 0; t < f->trees; t++) {
+		p = f->prob + (size_t) (-1 - f->child[node[t]]) * f->nr_class;
+		for (c = 0; c < f->nr_class; c++)
+			prob[c] += p[c];
+	}
+
+	for (c = 0; c < f->nr_class; c++)
+		prob[c] /= f->trees;
+}
+
+int forest_save(const char *path, const struct forest *f)
+{
+	struct forest_header h;
+	int32_t labels[SPI_LABEL_MAX];
+	FILE *fp;
+	int i, rc;
+
+	fp = fopen(path, "w");
+	if (!fp)
+		return -1;
+
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, SPI_FOREST_MAGIC, sizeof h.magic);
+	h.version = SPI_FOREST_VERSION;
+	h.trees = f->trees;
+	h.features = f->features;
+	h.nr_class = f->nr_class;
+	h.nodes = f->nodes;
+	h.leaves = f->leaves;
+
+	for (i = 0; i < f->nr_class; i++)
+		labels[i] = f->labels[i];
+
+	fwrite(&h, sizeof h, 1, fp);
+	fwrite(labels, sizeof *labels, f->nr_class, fp);
+	fwrite(f->root, sizeof *f->root, f->trees, fp);
+	fwrite(f->feature, sizeof *f->feature, f->nodes, fp);
+	fwrite(f->threshold, sizeof *f->threshold, f->nodes, fp);
+	fwrite(f->child, sizeof *f->child, f->nodes, fp);
+	fwrite(f->prob, sizeof *f->prob, (size_t) f->leaves * f->nr_class, fp);
+
+	rc = (fflush(fp) != 0 || ferror(fp)) ? -1 : 0;
+	if (fclose(fp) != 0)
+		rc = -1;
+
+	return rc;
+}
+
+struct forest *forest_load(const char *path)
+{
+	struct forest_header h;
+	struct forest *f;
+	int32_t labels[SPI_LABEL_MAX];
+	FILE *fp;
+	int i, k;
+	bool ok;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return NULL;
+
+	/* NB: limits keep the sizes below from overflowing */
+	if (fread(&h, sizeof h, 1, fp) != 1 || memcmp(h.magic, SPI_FOREST_MAGIC, sizeof h.magic) != 0
+		|| h.version != SPI_FOREST_VERSION || h.trees < 1 || h.trees > 65536
+		|| h.nr_class < 1 || h.nr_class > SPI_LABEL_MAX || h.features < 1 || h.features > 65536
+		|| h.nodes < h.trees || h.nodes > (1 << 28) || h.leaves < 1 || h.leaves > h.nodes) {
+		fclose(fp);
+		return NULL;
+	}
+
+	f = _realloc(NULL, sizeof *f);
+	memset(f, 0, sizeof *f);
+	f->trees = h.trees;
+	f->features = h.features;
+	f->nr_class = h.nr_class;
+	f->nodes = h.nodes;
+	f->leaves = h.leaves;
+
+	f->root = _realloc(NULL, sizeof *f->root * f->trees);
+	f->feature = _realloc(NULL, sizeof *f->feature * f->nodes);
+	f->threshold = _realloc(NULL, sizeof *f->threshold * f->nodes);
+	f->child = _realloc(NULL, sizeof *f->child * f->nodes);
+	f->prob = _realloc(NULL, sizeof *f->prob * f->leaves * f->nr_class);
+
+	ok = fread(labels, sizeof *labels, f->nr_class, fp) == (size_t) f->nr_class
+		&& fread(f->root, sizeof *f->root, f->trees, fp) == (size_t) f->trees
+		&& fread(f->feature, sizeof *f->feature, f->nodes, fp) == (size_t) f->nodes
+		&& fread(f->threshold, sizeof *f->threshold, f->nodes, fp) == (size_t) f->nodes
+		&& fread(f->child, sizeof *f->child, f->nodes, fp) == (size_t) f->nodes
+		&& fread(f->prob, sizeof *f->prob, (size_t) f->leaves * f->nr_class, fp)
+			== (size_t) f->leaves * f->nr_class;
+	fclose(fp);
+
+	/* check structure: prediction must end in a leaf */
+	for (i = 0; ok && i < f->nr_class; i++) {
+		f->labels[i] = labels[i];
+		ok = (labels[i] >= 0 && labels[i] <= SPI_LABEL_MAX);
+	}
+
+	for (i = 0; ok && i < f->trees; i++)
+		ok = (f->root[i] >= 0 && f->root[i] < f->nodes);
+
+	for (i = 0; ok && i < f->nodes; i++) {
+		k = f->child[i];
+		if (k >= 0)
+			ok = (k > i && k < f->nodes - 1);
+		else
+			ok = (-1 - k < f->leaves);
+
+		/* NB: leaves are read too, see forest_predict() */
+		ok = ok && f->feature[i] < f->features;
+	}
+
+	if (!ok) {
+		forest_free(f);
+		return NULL;
+	}
+
+	return f;
+}
+
+void forest_free(struct forest *f)
+{
+	if (!f)
+		return;
+
+	free(f->prob);
+	free(f->child);
+	free(f->threshold);
+	free(f->feature);
+	free(f->root);
+	free(f);
+}
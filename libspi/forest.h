@@ -0,0 +1,84 @@
+/*
+ * spi: Statistical Packet Inspection: random forest classifier
+ * Copyright (C) 2011 Paweł Foremski <pawel@foremski.pl>
+ * This software is licensed under GNU GPL version 3
+ */
+
+#ifndef _FOREST_H_
+#define _FOREST_H_
+
+#include <libsvm/svm.h>
+
+#include "datastructures.h"
+
+/** Number of trees */
+#define SPI_FOREST_TREES 16
+
+/** Max depth of a tree */
+#define SPI_FOREST_DEPTH 12
+
+/** Min number of samples in a node to split it */
+#define SPI_FOREST_MIN_SPLIT 4
+
+/** Seed of bootstrap and feature sampling: fixed, so training is reproducible */
+#define SPI_FOREST_SEED 0x7265657366726f66ULL
+
+/** Magic bytes of saved forest */
+#define SPI_FOREST_MAGIC "SPRF"
+
+/** Version of saved forest format */
+#define SPI_FOREST_VERSION 1
+
+/** Random forest, flattened for prediction
+ *
+ * Nodes of all trees are stored as struct of arrays. Both children of a node
+ * are adjacent, so prediction moves to child[n] + (x[feature[n]] > threshold[n])
+ * without a branch, until it reaches a leaf, marked by child = -1 - leaf index.
+ * Children always follow their parent.
+ *
+ * @note allocated with malloc(): it is trained outside of the event loop
+ */
+struct forest {
+	int trees;                       /** number of trees */
+	int features;                    /** number of signature coordinates */
+	int nr_class;                    /** number of classes */
+	int labels[SPI_LABEL_MAX];       /** libspi label of each class, ascending */
+	int nodes;                       /** number of nodes, including leaves */
+	int leaves;                      /** number of leaves */
+
+	int32_t *root;                   /** root node of each tree */
+	uint16_t *feature;               /** split coordinate of each node, 0-based */
+	double *threshold;               /** split threshold of each node */
+	int32_t *child;                  /** left child of each node, or -1 - leaf index */
+	float *prob;                     /** class probabilities of each leaf: leaves x nr_class */
+};
+
+/** Train random forest
+ * @param p          training samples, labels in p->y
+ * @param features   number of signature coordinates
+ * @retval NULL      no samples
+ * @note thread-safe: does not use mmatic
+ */
+struct forest *forest_train(const struct svm_problem *p, int features);
+
+/** Compute class probabilities of signature
+ * @param x          dense signature: features
+ * @param prob       output: nr_class
+ */
+void forest_predict(const struct forest *f, const double *x, double *prob);
+
+/** Save forest to file
+ * @retval 0         success
+ * @note thread-safe: does not use mmatic
+ */
+int forest_save(const char *path, const struct forest *f);
+
+/** Load forest saved by forest_save()
+ * @retval NULL      error or invalid file
+ */
+struct forest *forest_load(const char *path);
+
+/** Free forest memory */
+void forest_free(struct forest *f);
+
+#endif
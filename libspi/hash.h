@@ -0,0 +1,41 @@
+/*
+ * spi: Statistical Packet Inspection: integer hashing and random numbers
+ * Copyright (C) 2011 Paweł Foremski <pawel@foremski.pl>
+ * This software is licensed under GNU GPL version 3
+ */
+
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stdint.h>
+
+/** 64-bit integer hash (MurmurHash3 finalizer) */
+static inline uint64_t hash_u64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+/** 64-bit hash step: hash of value combined with previous hash */
+static inline uint64_t hash_step(uint64_t h, uint64_t v)
+{
+	return hash_u64(h ^ v);
+}
+
+/** xorshift64* generator: the same sequence on each platform, unlike rand()
+ * @param s          generator state, must not be 0 */
+static inline uint64_t hash_rand(uint64_t *s)
+{
+	*s ^= *s >> 12;
+	*s ^= *s << 25;
+	*s ^= *s >> 27;
+
+	return *s * 2685821657736338717ULL;
+}
+
+#endif
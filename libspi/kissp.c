@@ -5,113 +5,1492 @@
  */
 
 #include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+#include <event2/event.h>
 #include <libsvm/svm.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "datastructures.h"
 #include "spi.h"
 #include "kissp.h"
 #include "ep.h"
+#include "pool.h"
+#include "forest.h"
+#include "hash.h"
+
+static void _batch_model_init(struct spi *spi, struct kissp_model *m);
+
+/********** random Fourier features */
+
+/*
+ * With SPI_CLASSIFIER_RFF, signatures are mapped into D random Fourier features
+ * z(x) = sqrt(2/D) cos(W x + b), with rows of W drawn from N(0, 2 gamma I) and b
+ * from U[0, 2 pi), so that z(x) * z(y) approximates the RBF kernel
+ * exp(-gamma |x - y|^2). A linear model trained on z(x) then approximates the
+ * RBF model, at prediction cost independent of the number of support vectors.
+ */
+
+/** Uniform random number in (0, 1) */
+static inline double _randu(uint64_t *s)
+{
+	return ((hash_rand(s) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+/** Draw random Fourier features of the RBF kernel in libsvm params */
+static void _rff_init(struct spi *spi)
+{
+	struct kissp *kissp = spi->cdata;
+	int i, d = kissp->feature_num, D;
+	uint64_t s = SPI_KISSP_RFF_SEED;
+	double sigma = sqrt(2.0 * kissp->svm.params.gamma);
+
+	D = spi->options.rff_dim > 0 ? spi->options.rff_dim : SPI_DEFAULT_RFF_DIM;
+	kissp->rff.D = D;
+	kissp->rff.W = mmatic_alloc(spi->mm, sizeof(double) * D * d);
+	kissp->rff.b = mmatic_alloc(spi->mm, sizeof(double) * D);
+
+	/* NB: Box-Muller transform */
+	for (i = 0; i < D * d; i++)
+		kissp->rff.W[i] = sigma * sqrt(-2.0 * log(_randu(&s))) * cos(2.0 * M_PI * _randu(&s));
+
+	for (i = 0; i < D; i++)
+		kissp->rff.b[i] = 2.0 * M_PI * _randu(&s);
+
+	dbg(3, "using %d random Fourier features\n", D);
+}
+
+/** Copy signature coordinates into dense vector of feature_num */
+static void _dense(const struct kissp *kissp, const struct spi_coordinate *c, double *x)
+{
+	memset(x, 0, sizeof(double) * kissp->feature_num);
+
+	for (; c->index != -1; c++) {
+		if (c->index > 0 && c->index <= kissp->feature_num)
+			x[c->index - 1] = c->value;
+	}
+}
+
+/** Map dense signature into random Fourier features
+ * @param z      output: D features */
+static void _rff_map(const struct kissp *kissp, const double *x, double *z)
+{
+	int k, f, D = kissp->rff.D;
+	const double *w;
+	double scale = sqrt(2.0 / D);
+
+	memcpy(z, kissp->rff.b, sizeof(double) * D);
+
+	/* NB: feature by feature, so the sums do not depend on each other */
+	for (f = 0, w = kissp->rff.W; f < kissp->feature_num; f++, w += D) {
+		if (x[f] == 0.0)
+			continue;
+
+		for (k = 0; k < D; k++)
+			z[k] += w[k] * x[f];
+	}
+
+	for (k = 0; k < D; k++)
+		z[k] = scale * cos(z[k]);
+}
+
+/** Map signature into random Fourier features, as libsvm vector
+ * @param z      scratch memory: D features
+ * @param out    output: D + 1 nodes */
+static void _rff_nodes(const struct kissp *kissp, const struct spi_coordinate *c, double *z, struct svm_node *out)
+{
+	double x[kissp->feature_num];
+	int k;
+
+	_dense(kissp, c, x);
+	_rff_map(kissp, x, z);
+
+	for (k = 0; k < kissp->rff.D; k++) {
+		out[k].index = k + 1;
+		out[k].value = z[k];
+	}
+	out[k].index = -1;
+}
+
+/** Number of features the model is trained on */
+static inline int _model_dim(const struct kissp *kissp)
+{
+	return kissp->rff.D ? kissp->rff.D : kissp->feature_num;
+}
 
 /********** libsvm */
+
+/*
+ * Models are trained in a worker thread, on a copy of spi->traindata, while the
+ * event loop keeps classifying with the previous model. When done, the worker
+ * publishes the new libsvm model (or random forest, see forest.c) and wakes up
+ * the event loop through a pipe,
+ * which swaps kissp->svm.model. The old model is freed when the last
+ * prediction referencing it drops its reference - possibly in a worker thread,
+ * so each model has its own mm.
+ */
+
 static void _svm_print_func(const char *msg)
 {
-	while (*msg == '\n') msg++;
-	dbg(7, "libsvm: %s", msg);
+	while (*msg == '\n') msg++;
+	dbg(7, "libsvm: %s", msg);
+}
+
+static void _svm_init(struct spi *spi)
+{
+	struct kissp *kissp = spi->cdata;
+
+	if (spi->options.libsvm_params) {
+		memcpy(&kissp->svm.params, spi->options.libsvm_params, sizeof kissp->svm.params);
+	} else {
+		/* defaults */
+		kissp->svm.params.kernel_type = RBF;
+		kissp->svm.params.gamma = 0.5; /* found by grid.py */
+		kissp->svm.params.C = 2.0; /* found by grid.py */
+		kissp->svm.params.eps = 0.1;
+
+		kissp->svm.params.nr_weight = 0;     /* NB: .weight_label and .weight not set */
+		kissp->svm.params.cache_size = 100;
+		kissp->svm.params.shrinking = 1;
+	}
+
+	/* required options */
+	if (spi->options.classifier == SPI_CLASSIFIER_LINEAR || spi->options.classifier == SPI_CLASSIFIER_RFF)
+		kissp->svm.params.kernel_type = LINEAR;
+
+	kissp->svm.params.svm_type = C_SVC;
+	kissp->svm.params.probability = 1; /* NB */
+
+	svm_set_print_string_function(_svm_print_func);
+}
+
+/** Get KISSP data holding the model: worker shards use the main one */
+static inline struct kissp *_model_owner(struct spi *spi)
+{
+	return spi->root ? spi->root->cdata : spi->cdata;
+}
+
+/** Get reference to current model
+ * @retval NULL       no model trained yet */
+static struct kissp_model *_model_get(struct spi *spi)
+{
+	struct kissp *kissp = _model_owner(spi);
+	struct kissp_model *m;
+
+	pthread_mutex_lock(&kissp->svm.lock);
+	m = __atomic_load_n(&kissp->svm.model, __ATOMIC_ACQUIRE);
+	if (m)
+		__atomic_add_fetch(&m->refcnt, 1, __ATOMIC_ACQ_REL);
+	pthread_mutex_unlock(&kissp->svm.lock);
+
+	return m;
+}
+
+/** Drop reference to model, free it if not used anymore */
+static void _model_put(struct kissp_model *m)
+{
+	if (!m || __atomic_sub_fetch(&m->refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	if (m->base)
+		_model_put(m->base);
+	else if (m->svm)
+		svm_free_and_destroy_model(&m->svm);
+	forest_free(m->forest);
+	mmatic_destroy(m->mm);
+}
+
+/** Free traindata snapshot */
+static void _train_cleanup(struct kissp *kissp)
+{
+	if (kissp->train.mm)
+		mmatic_destroy(kissp->train.mm);
+
+	kissp->train.mm = NULL;
+	kissp->train.p.x = NULL;
+	kissp->train.p.y = NULL;
+	kissp->train.x = NULL;
+}
+
+/** Hash step over a double */
+static inline uint64_t _hash_dbl(uint64_t h, double v)
+{
+	uint64_t u;
+
+	memcpy(&u, &v, sizeof u);
+	return hash_step(h, u);
+}
+
+/** Hash traindata snapshot together with everything else that determines the trained model */
+static uint64_t _train_hash(struct spi *spi, const struct svm_problem *p)
+{
+	struct kissp *kissp = spi->cdata;
+	const struct svm_parameter *par = &kissp->svm.params;
+	const struct svm_node *x;
+	uint64_t h = SPI_KISSP_MODEL_VERSION;
+	int i;
+
+	/* signatures */
+	h = hash_step(h, spi->options.classifier);
+	h = hash_step(h, spi->options.N);
+	h = hash_step(h, spi->options.C);
+	h = hash_step(h, spi->options.kiss_std);
+	h = hash_step(h, kissp->feature_num);
+
+	/* libsvm */
+	h = hash_step(h, par->svm_type);
+	h = hash_step(h, par->kernel_type);
+	h = hash_step(h, par->degree);
+	h = _hash_dbl(h, par->gamma);
+	h = _hash_dbl(h, par->coef0);
+	h = _hash_dbl(h, par->C);
+	h = _hash_dbl(h, par->eps);
+	h = _hash_dbl(h, par->nu);
+	h = _hash_dbl(h, par->p);
+	h = hash_step(h, par->shrinking);
+	h = hash_step(h, par->probability);
+	h = hash_step(h, par->nr_weight);
+	for (i = 0; i < par->nr_weight; i++) {
+		h = hash_step(h, par->weight_label[i]);
+		h = _hash_dbl(h, par->weight[i]);
+	}
+
+	/* samples, in order */
+	h = hash_step(h, p->l);
+	for (i = 0; i < p->l; i++) {
+		h = _hash_dbl(h, p->y[i]);
+		for (x = p->x[i]; x->index != -1; x++) {
+			h = hash_step(h, x->index);
+			h = _hash_dbl(h, x->value);
+		}
+		h = hash_step(h, -1);
+	}
+
+	return h;
+}
+
+/** Save trained model with its metadata in <path>.meta
+ * @param model       libsvm model, or NULL
+ * @param forest      random forest, or NULL
+ * @note called in the training thread: no mmatic calls allowed */
+static void _model_save(const char *path, const struct svm_model *model, const struct forest *forest,
+	uint64_t hash)
+{
+	char tmp[PATH_MAX], meta[PATH_MAX], metatmp[PATH_MAX];
+	int labels[SPI_LABEL_MAX];
+	FILE *fp;
+	int i, fd, rc, nc;
+
+	snprintf(tmp, sizeof tmp, "%s.tmp", path);
+	snprintf(meta, sizeof meta, "%s.meta", path);
+	snprintf(metatmp, sizeof metatmp, "%s.meta.tmp", path);
+
+	if (forest) {
+		nc = forest->nr_class;
+		memcpy(labels, forest->labels, sizeof(int) * nc);
+		rc = forest_save(tmp, forest);
+	} else {
+		nc = svm_get_nr_class(model);
+		svm_get_labels(model, labels);
+		rc = svm_save_model(tmp, model);
+	}
+
+	if (rc != 0) {
+		dbg(1, "%s: saving model failed\n", tmp);
+		goto fail;
+	}
+
+	fd = open(tmp, O_RDONLY);
+	if (fd < 0 || fsync(fd) != 0) {
+		dbg(1, "%s: fsync() failed: %s\n", tmp, strerror(errno));
+		if (fd >= 0) close(fd);
+		goto fail;
+	}
+	close(fd);
+
+	fp = fopen(metatmp, "w");
+	if (!fp) {
+		dbg(1, "%s: opening for write failed: %s\n", metatmp, strerror(errno));
+		goto fail;
+	}
+
+	fprintf(fp, "spi-model %d\nhash %016" PRIx64 "\nlabels", SPI_KISSP_MODEL_VERSION, hash);
+	for (i = 0; i < nc; i++)
+		fprintf(fp, " %d", labels[i]);
+	fprintf(fp, "\n");
+
+	if (fflush(fp) != 0 || ferror(fp) || fsync(fileno(fp)) != 0) {
+		dbg(1, "%s: writing failed: %s\n", metatmp, strerror(errno));
+		fclose(fp);
+		goto fail;
+	}
+	fclose(fp);
+
+	/* NB: drop old metadata first, so it never describes the new model */
+	unlink(meta);
+	if (rename(tmp, path) != 0 || rename(metatmp, meta) != 0) {
+		dbg(1, "%s: renaming saved model failed: %s\n", path, strerror(errno));
+		goto fail;
+	}
+
+	dbg(5, "%s: saved model\n", path);
+	return;
+
+fail:
+	unlink(tmp);
+	unlink(metatmp);
+}
+
+/** Load model saved by _model_save()
+ * @param hash        hash of current traindata, see _train_hash()
+ * @param model       output: libsvm model
+ * @param forest      output: random forest, if kissp uses it
+ * @retval false      no saved model of the same traindata */
+static bool _model_load(struct kissp *kissp, const char *path, uint64_t hash,
+	struct svm_model **model, struct forest **forest)
+{
+	char meta[PATH_MAX];
+	int labels[SPI_LABEL_MAX], mlabels[SPI_LABEL_MAX];
+	int version, i, nc = 0;
+	uint64_t h;
+	FILE *fp;
+
+	*model = NULL;
+	*forest = NULL;
+	snprintf(meta, sizeof meta, "%s.meta", path);
+
+	fp = fopen(meta, "r");
+	if (!fp)
+		return false;
+
+	if (fscanf(fp, "spi-model %d hash %" SCNx64 " labels", &version, &h) != 2
+		|| version != SPI_KISSP_MODEL_VERSION || h != hash) {
+		dbg(3, "%s: saved model does not match training samples\n", path);
+		fclose(fp);
+		return false;
+	}
+
+	while (nc < SPI_LABEL_MAX && fscanf(fp, "%d", &labels[nc]) == 1)
+		nc++;
+	fclose(fp);
+
+	if (kissp->options.forest) {
+		*forest = forest_load(path);
+		if (!*forest) {
+			dbg(1, "%s: loading model failed\n", path);
+			return false;
+		}
+
+		if ((*forest)->nr_class != nc || (*forest)->features != kissp->feature_num)
+			goto mismatch;
+
+		memcpy(mlabels, (*forest)->labels, sizeof(int) * nc);
+	} else {
+		*model = svm_load_model(path);
+		if (!*model) {
+			dbg(1, "%s: loading model failed\n", path);
+			return false;
+		}
+
+		if (svm_get_nr_class(*model) != nc || svm_check_probability_model(*model) == 0)
+			goto mismatch;
+
+		svm_get_labels(*model, mlabels);
+	}
+
+	/* check if model matches its metadata */
+	for (i = 0; i < nc; i++) {
+		if (mlabels[i] != labels[i])
+			goto mismatch;
+	}
+
+	return true;
+
+mismatch:
+	dbg(1, "%s: model does not match its metadata\n", path);
+	if (*model)
+		svm_free_and_destroy_model(model);
+	forest_free(*forest);
+	*forest = NULL;
+	return false;
+}
+
+/** Make model the current one, drop reference to the previous model */
+static void _model_swap(struct spi *spi, struct kissp_model *m)
+{
+	struct kissp *kissp = spi->cdata;
+	struct kissp_model *old;
+
+	pthread_mutex_lock(&kissp->svm.lock);
+	old = __atomic_exchange_n(&kissp->svm.model, m, __ATOMIC_ACQ_REL);
+	pthread_mutex_unlock(&kissp->svm.lock);
+	_model_put(old);
+
+	spi_announce_id(spi, SPI_EV_CLASSIFIER_MODEL_UPDATED, 0, NULL, false);
+}
+
+/** Make trained model the current one
+ * @param model       libsvm model, or NULL
+ * @param forest      random forest, or NULL
+ * @param mm          memory of the model, taken over
+ * @param x           vectors referenced by the model, NULL if model has its own copy */
+static void _model_publish(struct spi *spi, struct svm_model *model, struct forest *forest,
+	mmatic *mm, struct svm_node *x)
+{
+	struct kissp_model *m;
+
+	m = mmatic_zalloc(mm, sizeof *m);
+	m->mm = mm;
+	m->refcnt = 1;
+	m->svm = model;
+	m->forest = forest;
+	m->x = x;
+
+	if (forest) {
+		m->nr_class = forest->nr_class;
+		memcpy(m->labels, forest->labels, sizeof(int) * m->nr_class);
+	} else {
+		m->nr_class = svm_get_nr_class(model);
+		svm_get_labels(model, m->labels);
+		_batch_model_init(spi, m);
+	}
+
+	dbg(5, "updated %s model, nr_class=%d\n", forest ? "random forest" : "libsvm", m->nr_class);
+	_model_swap(spi, m);
+}
+
+/** Find class of label in model
+ * @retval -1         label not known to model */
+static int _model_class(const struct kissp_model *m, spi_label_t label)
+{
+	int i;
+
+	for (i = 0; i < m->nr_class; i++) {
+		if (m->labels[i] == label)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Online learning updates a linear model with samples added to traindata since
+ * it was trained, instead of training it from scratch on the whole history.
+ * Each new sample of class c takes a passive-aggressive (PA-I) step on weights
+ * of the pairs of classes (c, j), with libsvm C as the aggressiveness, so the
+ * cost is proportional to the number of new samples. The probability estimates
+ * of the pairs are kept. Samples of new classes, more than
+ * 1/SPI_KISSP_ONLINE_PART new samples since the last full training, or samples
+ * replaced in traindata (see trainset.h) trigger full training. Models updated
+ * online are not saved in options.model_file.
+ */
+
+/** Take online learning step on sample
+ * @param w           weights of pairs of classes, updated
+ * @param rho         bias of each pair, updated
+ * @param z           sample features: d
+ * @param c           sample class
+ * @param dec         scratch memory: nc*(nc-1)/2
+ */
+static void _online_step(double *w, double *rho, const double *z, int d, int nc, int c, double C, double *dec)
+{
+	int i, j, f, p, np = nc * (nc - 1) / 2;
+	double norm = 1.0, t, loss, tau;   /* NB: 1 for the bias */
+
+	for (p = 0; p < np; p++)
+		dec[p] = -rho[p];
+
+	for (f = 0; f < d; f++) {
+		if (z[f] == 0.0)
+			continue;
+
+		norm += z[f] * z[f];
+		for (p = 0; p < np; p++)
+			dec[p] += w[f * np + p] * z[f];
+	}
+
+	/* positive decision value votes for class i of pair (i, j) */
+	for (i = 0, p = 0; i < nc; i++) {
+		for (j = i + 1; j < nc; j++, p++) {
+			if (c != i && c != j)
+				continue;
+
+			t = (c == i) ? 1.0 : -1.0;
+			loss = 1.0 - t * dec[p];
+			if (loss <= 0.0)
+				continue;
+
+			tau = t * MIN(C, loss / norm);
+			for (f = 0; f < d; f++)
+				w[f * np + p] += tau * z[f];
+			rho[p] -= tau;
+		}
+	}
+}
+
+/** Update current model with new traindata samples, if possible
+ * @retval false      full training needed */
+static bool _online_update(struct spi *spi)
+{
+	struct kissp *kissp = spi->cdata;
+	struct kissp_model *old, *m;
+	struct spi_signature *s;
+	mmatic *mm;
+	int i, c, n, nc, np, d = _model_dim(kissp);
+	double x[kissp->feature_num], zz[d], *z;
+
+	if (!kissp->options.online)
+		return false;
+
+	n = tlist_count(spi->traindata);
+	if (kissp->online.samples == 0 || n <= kissp->online.samples
+		|| n - kissp->online.trained > kissp->online.trained / SPI_KISSP_ONLINE_PART
+		|| spi->trainset.replaced != kissp->online.replaced)
+		return false;
+
+	old = _model_get(spi);
+	if (!old || !old->w) {
+		_model_put(old);
+		return false;
+	}
+
+	nc = old->nr_class;
+	np = nc * (nc - 1) / 2;
+
+	/* copy: the current model can be in use */
+	mm = mmatic_create();
+	m = mmatic_zalloc(mm, sizeof *m);
+	m->mm = mm;
+	m->refcnt = 1;
+	m->base = old->base ? old->base : old;
+	__atomic_add_fetch(&m->base->refcnt, 1, __ATOMIC_ACQ_REL);
+	m->svm = old->svm;
+	m->nr_class = nc;
+	memcpy(m->labels, old->labels, sizeof(int) * nc);
+	m->w = mmatic_alloc(mm, sizeof(double) * np * d);
+	memcpy(m->w, old->w, sizeof(double) * np * d);
+	m->rho = mmatic_alloc(mm, sizeof(double) * np);
+	memcpy(m->rho, old->rho, sizeof(double) * np);
+	_model_put(old);
+
+	{
+		double dec[np];
+
+		i = 0;
+		tlist_iter_loop(spi->traindata, s) {
+			if (i++ < kissp->online.samples)
+				continue;
+
+			/* new classes need full training */
+			c = _model_class(m, s->label);
+			if (c < 0) {
+				_model_put(m);
+				return false;
+			}
+
+			_dense(kissp, s->c, x);
+			if (kissp->rff.D) {
+				_rff_map(kissp, x, zz);
+				z = zz;
+			} else {
+				z = x;
+			}
+
+			_online_step(m->w, m->rho, z, d, nc, c, kissp->svm.params.C, dec);
+		}
+	}
+
+	dbg(5, "online update of %d samples, %d since full training\n",
+		n - kissp->online.samples, n - kissp->online.trained);
+	spi->stats.online_updates++;
+	spi->stats.online_signs += n - kissp->online.samples;
+	kissp->online.samples = n;
+
+	_model_swap(spi, m);
+	return true;
+}
+
+/** Worker thread: train model on traindata snapshot
+ * @note no mmatic calls allowed here */
+static void *_train_thread(void *arg)
+{
+	struct kissp *kissp = arg;
+	struct svm_model *model = NULL;
+	struct forest *forest = NULL;
+
+	if (kissp->options.forest)
+		forest = forest_train(&kissp->train.p, kissp->feature_num);
+	else
+		model = svm_train(&kissp->train.p, &kissp->svm.params);
+
+	if ((model || forest) && kissp->train.file)
+		_model_save(kissp->train.file, model, forest, kissp->train.hash);
+
+	__atomic_store_n(&kissp->train.forest, forest, __ATOMIC_RELEASE);
+	__atomic_store_n(&kissp->train.result, model, __ATOMIC_RELEASE);
+
+	/* wake up the event loop */
+	while (write(kissp->train.pipe[1], "", 1) < 0 && errno == EINTR);
+
+	return NULL;
+}
+
+/** Take snapshot of traindata and start training it */
+static void _train_start(struct spi *spi)
+{
+	struct kissp *kissp = spi->cdata;
+	struct svm_problem *p = &kissp->train.p;
+	struct svm_model *model;
+	struct forest *forest;
+	struct spi_signature *s;
+	struct spi_coordinate *c;
+	struct svm_node *x;
+	double *z = NULL;
+	int i, rc, n = 0;
+	const char *err;
+
+	/* nothing to train on (NB: forest_train() would fail) */
+	if (tlist_count(spi->traindata) == 0) {
+		dbg(5, "no training samples\n");
+		_train_cleanup(kissp);
+		return;
+	}
+
+	/* count nodes */
+	if (kissp->rff.D) {
+		z = mmatic_alloc(spi->mm, sizeof(double) * kissp->rff.D);
+		n = tlist_count(spi->traindata) * (kissp->rff.D + 1);
+	} else {
+		tlist_iter_loop(spi->traindata, s) {
+			for (c = s->c; c->index != -1; c++)
+				n++;
+			n++;
+		}
+	}
+
+	/* describe the problem on a copy of traindata: it can change while training,
+	 * and the model will keep pointers to its support vectors */
+	kissp->train.mm = mmatic_create();
+	kissp->train.replaced = spi->trainset.replaced;
+	p->l = tlist_count(spi->traindata);
+	p->x = mmatic_alloc(kissp->train.mm, (sizeof (void *)) * p->l);
+	p->y = mmatic_alloc(kissp->train.mm, (sizeof (double)) * p->l);
+	x = kissp->train.x = mmatic_alloc(kissp->train.mm, (sizeof (struct svm_node)) * n);
+
+	i = 0;
+	tlist_iter_loop(spi->traindata, s) {
+		if (kissp->rff.D) {
+			_rff_nodes(kissp, s->c, z, x);
+			n = kissp->rff.D + 1;
+		} else {
+			for (c = s->c; c->index != -1; c++);
+			n = c - s->c + 1;
+
+			memcpy(x, s->c, (sizeof (struct svm_node)) * n);   /* NB: identical */
+		}
+
+		p->x[i] = x;
+		p->y[i] = s->label;
+
+		x += n;
+		i++;
+	}
+
+	if (z)
+		mmatic_free(z);
+
+	/* check */
+	err = kissp->options.forest ? NULL : svm_check_parameter(p, &kissp->svm.params);
+	if (err) {
+		dbg(1, "libsvm training failed: check_parameter(): %s\n", err);
+		_train_cleanup(kissp);
+		return;
+	}
+
+	/* the same samples trained before: use the saved model */
+	kissp->train.hash = _train_hash(spi, p);
+	if (kissp->train.file && _model_load(kissp, kissp->train.file, kissp->train.hash, &model, &forest)) {
+		dbg(5, "loaded model of %d samples\n", p->l);
+		kissp->online.samples = kissp->online.trained = p->l;
+		kissp->online.replaced = kissp->train.replaced;
+		_train_cleanup(kissp);
+		_model_publish(spi, model, forest, mmatic_create(), NULL);
+		return;
+	}
+
+	/* run */
+	dbg(5, "training %s model on %d samples\n", kissp->options.forest ? "random forest" : "libsvm", p->l);
+	kissp->train.running = true;
+
+	rc = pthread_create(&kissp->train.thread, NULL, _train_thread, kissp);
+	if (rc == 0) {
+		kissp->train.threaded = true;
+	} else {
+		dbg(1, "pthread_create() failed: %s, training in foreground\n", strerror(rc));
+		kissp->train.threaded = false;
+		_train_thread(kissp);
+	}
+}
+
+/** Receives "traindataUpdated" */
+static bool _svm_train(struct spi *spi, const char *evname, void *data)
+{
+	struct kissp *kissp = spi->cdata;
+
+	/* retrain after current training finishes */
+	if (kissp->train.running)
+		kissp->train.again = true;
+	else if (!_online_update(spi))
+		_train_start(spi);
+
+	return true;
+}
+
+/** Swap in model trained in background */
+static void _train_done(int fd, short evtype, void *arg)
+{
+	struct spi *spi = arg;
+	struct kissp *kissp = spi->cdata;
+	struct svm_model *model;
+	struct forest *forest;
+	struct svm_node *x;
+	mmatic *mm;
+	char buf[16];
+
+	while (read(fd, buf, sizeof buf) > 0);
+
+	if (!kissp->train.running)
+		return;
+
+	if (kissp->train.threaded)
+		pthread_join(kissp->train.thread, NULL);
+	kissp->train.running = false;
+
+	forest = __atomic_exchange_n(&kissp->train.forest, NULL, __ATOMIC_ACQUIRE);
+	model = __atomic_exchange_n(&kissp->train.result, NULL, __ATOMIC_ACQUIRE);
+
+	if (!model && !forest) {
+		dbg(1, "training on %d samples failed\n", kissp->train.p.l);
+		_train_cleanup(kissp);
+		spi_announce_id(spi, SPI_EV_CLASSIFIER_TRAINING_FAILED, 0, NULL, false);
+	} else {
+		spi->stats.trainings++;
+		kissp->online.samples = kissp->online.trained = kissp->train.p.l;
+		kissp->online.replaced = kissp->train.replaced;
+	}
+
+	if (forest) {
+		/* forest has its own memory */
+		_train_cleanup(kissp);
+		_model_publish(spi, NULL, forest, mmatic_create(), NULL);
+	} else if (model) {
+		/* take over the snapshot memory: model references the support vectors */
+		mm = kissp->train.mm;
+		x = kissp->train.x;
+
+		mmatic_free(kissp->train.p.x);
+		mmatic_free(kissp->train.p.y);
+		kissp->train.mm = NULL;
+		_train_cleanup(kissp);
+
+		_model_publish(spi, model, NULL, mm, x);
+	}
+
+	/* new samples arrived during training */
+	if (kissp->train.again) {
+		kissp->train.again = false;
+		if (!_online_update(spi))
+			_train_start(spi);
+	}
+}
+
+/** Announce classification result
+ * @param result      libsvm label of most probable class
+ * @param prob        libsvm class probabilities
+ */
+static void _classresult(struct spi *spi, struct kissp_model *m, struct spi_ep *ep, int result, const double *prob)
+{
+	struct spi_classresult *cr;
+	int i;
+
+	cr = pool_get(&spi->cr_pool, sizeof *cr + m->nr_class * sizeof cr->cprob[0]);
+	cr->ep = ep;
+	cr->result = result;
+	cr->num = m->nr_class;
+
+	/* rewrite from libsvm's to ours */
+	for (i = 0; i < m->nr_class; i++) {
+		cr->cprob[i].label = m->labels[i];
+		cr->cprob[i].prob = prob[i];
+	}
+
+	ep->predictions++;
+	spi_announce_id(spi, SPI_EV_ENDPOINT_CLASSIFICATION, 0, cr, false);
+}
+
+/** Classify single signature using libsvm
+ * @note endpoint must already be locked by gclock2 */
+static void _svm_predict(struct spi *spi, struct kissp_model *m, struct spi_signature *sign, struct spi_ep *ep)
+{
+	struct kissp *owner = _model_owner(spi);
+	struct svm_node *x;
+	double prob[m->nr_class], *z;
+	int result;
+
+	if (owner->rff.D) {
+		x = mmatic_alloc(spi->mm, sizeof(struct svm_node) * (owner->rff.D + 1));
+		z = mmatic_alloc(spi->mm, sizeof(double) * owner->rff.D);
+		_rff_nodes(owner, sign->c, z, x);
+		result = svm_predict_probability(m->svm, x, prob);
+		mmatic_free(z);
+		mmatic_free(x);
+	} else {
+		result = svm_predict_probability(m->svm, (struct svm_node *) sign->c, prob);
+	}
+
+	_classresult(spi, m, ep, result, prob);
+}
+
+/********** chi-square kernels */
+
+/*
+ * For a group of 16 occurance counters o[j] summing up to P packets, the KISS
+ * coordinate is sum_j (E - o[j])^2 / E / max, where E = P/16 and max is the
+ * value for one constant nibble. This simplifies to:
+ *
+ *   (16 * sum_j o[j]^2 - P^2) / (15 * P^2)
+ *
+ * so we only need the integer sum of squared counters for each group.
+ */
+
+static void _chisq_scalar(const uint8_t *o, int groups, int pkts, double *out)
+{
+	double p2 = (double) pkts * pkts;
+	double scale = 1.0 / (15.0 * pkts * pkts);
+	uint32_t sq;
+	int i, j;
+
+	for (i = 0; i < groups; i++) {
+		sq = 0;
+		for (j = 0; j < 16; j++)
+			sq += o[i*16 + j] * o[i*16 + j];
+		out[i] = (16.0 * sq - p2) * scale;
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/** Sum of squared counters of a single group, as 4 partial sums */
+__attribute__ ((target ("sse4.1")))
+static inline __m128i _sq_sse4(const uint8_t *o)
+{
+	__m128i v, lo, hi;
+
+	v  = _mm_loadu_si128((const __m128i *) o);
+	lo = _mm_cvtepu8_epi16(v);
+	hi = _mm_cvtepu8_epi16(_mm_srli_si128(v, 8));
+
+	return _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi));
+}
+
+__attribute__ ((target ("sse4.1")))
+static void _chisq_sse4(const uint8_t *o, int groups, int pkts, double *out)
+{
+	__m128i s;
+	__m128d p2 = _mm_set1_pd((double) pkts * pkts);
+	__m128d k16 = _mm_set1_pd(16.0);
+	__m128d scale = _mm_set1_pd(1.0 / (15.0 * pkts * pkts));
+	int i;
+
+	/* 4 groups at once */
+	for (i = 0; i + 4 <= groups; i += 4) {
+		s = _mm_hadd_epi32(
+			_mm_hadd_epi32(_sq_sse4(o + (i+0)*16), _sq_sse4(o + (i+1)*16)),
+			_mm_hadd_epi32(_sq_sse4(o + (i+2)*16), _sq_sse4(o + (i+3)*16)));
+
+		_mm_storeu_pd(out + i, _mm_mul_pd(
+			_mm_sub_pd(_mm_mul_pd(k16, _mm_cvtepi32_pd(s)), p2), scale));
+		_mm_storeu_pd(out + i + 2, _mm_mul_pd(
+			_mm_sub_pd(_mm_mul_pd(k16, _mm_cvtepi32_pd(_mm_srli_si128(s, 8))), p2), scale));
+	}
+
+	_chisq_scalar(o + i*16, groups - i, pkts, out + i);
+}
+
+/** Sum of squared counters of a single group, as 8 partial sums */
+__attribute__ ((target ("avx2")))
+static inline __m256i _sq_avx2(const uint8_t *o)
+{
+	__m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) o));
+	return _mm256_madd_epi16(v, v);
+}
+
+__attribute__ ((target ("avx2")))
+static void _chisq_avx2(const uint8_t *o, int groups, int pkts, double *out)
+{
+	__m256i h;
+	__m128i s;
+	__m256d p2 = _mm256_set1_pd((double) pkts * pkts);
+	__m256d k16 = _mm256_set1_pd(16.0);
+	__m256d scale = _mm256_set1_pd(1.0 / (15.0 * pkts * pkts));
+	int i;
+
+	/* 4 groups at once */
+	for (i = 0; i + 4 <= groups; i += 4) {
+		h = _mm256_hadd_epi32(
+			_mm256_hadd_epi32(_sq_avx2(o + (i+0)*16), _sq_avx2(o + (i+1)*16)),
+			_mm256_hadd_epi32(_sq_avx2(o + (i+2)*16), _sq_avx2(o + (i+3)*16)));
+		s = _mm_add_epi32(_mm256_castsi256_si128(h), _mm256_extracti128_si256(h, 1));
+
+		_mm256_storeu_pd(out + i, _mm256_mul_pd(
+			_mm256_sub_pd(_mm256_mul_pd(k16, _mm256_cvtepi32_pd(s)), p2), scale));
+	}
+
+	/* avoid AVX-SSE transition penalty in non-VEX code */
+	_mm256_zeroupper();
+
+	_chisq_scalar(o + i*16, groups - i, pkts, out + i);
+}
+
+#endif
+
+/** Select the best chi-square kernel for this CPU */
+static void _chisq_init(struct kissp *kissp)
+{
+	kissp->chisq = _chisq_scalar;
+	kissp->chisq_name = "scalar";
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		kissp->chisq = _chisq_avx2;
+		kissp->chisq_name = "AVX2";
+	} else if (__builtin_cpu_supports("sse4.1")) {
+		kissp->chisq = _chisq_sse4;
+		kissp->chisq_name = "SSE4.1";
+	}
+#endif
+
+	dbg(3, "using %s chi-square kernel\n", kissp->chisq_name);
+}
+
+/********** batch prediction */
+
+/*
+ * Signatures waiting for classification are collected in kissp->batch and
+ * scored together, at most once per event loop iteration. For RBF models, the
+ * support vectors are packed into panels of 4 vectors stored feature by
+ * feature, and the kernel values are computed in 4x4 tiles of (signature,
+ * support vector) pairs over cache-sized blocks of support vectors. Other
+ * kernels fall back to svm_predict_probability().
+ *
+ * Instead of accumulating each of nr_class*(nr_class-1)/2 decision values
+ * separately, for each signature and each class c we accumulate a vector
+ * T[c][m] = sum of sv_coef[m][i] * K(x, SV_i) over the support vectors of class
+ * c. Decision value of pair (i, j) is then T[i][j-1] + T[j][i] - rho.
+ *
+ * For linear models, the same sums collapse into one weight vector per pair of
+ * classes, computed once per model: decision value of pair p is w[p] * x - rho.
+ * Random forests are scored by forest_predict() on dense signatures.
+ */
+
+/** Return true if batch prediction can handle the model */
+static bool _batch_supported(struct svm_model *model)
+{
+	return ((model->param.kernel_type == RBF || model->param.kernel_type == LINEAR)
+		&& model->nr_class > 1 && model->probA && model->probB);
 }
 
-static void _svm_init(struct spi *spi)
+/** Collapse support vectors of a new linear model into weight vectors */
+static void _batch_model_init_linear(struct spi *spi, struct kissp_model *m)
 {
 	struct kissp *kissp = spi->cdata;
+	struct svm_model *model = m->svm;
+	struct svm_node *n;
+	int start[model->nr_class];
+	int i, j, k, p, np, d = _model_dim(kissp), nc = model->nr_class;
+
+	np = nc * (nc - 1) / 2;
+	m->w = mmatic_zalloc(m->mm, sizeof(double) * np * d);
+	m->rho = model->rho;
+
+	for (start[0] = 0, i = 1; i < nc; i++)
+		start[i] = start[i - 1] + model->nSV[i - 1];
+
+	/* pair (i, j): support vectors of class i with sv_coef[j-1], of class j with sv_coef[i] */
+	for (i = 0, p = 0; i < nc; i++) {
+		for (j = i + 1; j < nc; j++, p++) {
+			for (k = start[i]; k < start[i] + model->nSV[i]; k++) {
+				for (n = model->SV[k]; n->index != -1; n++) {
+					if (n->index > 0 && n->index <= d)
+						m->w[(n->index - 1) * np + p] += model->sv_coef[j - 1][k] * n->value;
+				}
+			}
 
-	if (spi->options.libsvm_params) {
-		memcpy(&kissp->svm.params, spi->options.libsvm_params, sizeof kissp->svm.params);
-	} else {
-		/* defaults */
-		kissp->svm.params.kernel_type = RBF;
-		kissp->svm.params.gamma = 0.5; /* found by grid.py */
-		kissp->svm.params.C = 2.0; /* found by grid.py */
-		kissp->svm.params.eps = 0.1;
+			for (k = start[j]; k < start[j] + model->nSV[j]; k++) {
+				for (n = model->SV[k]; n->index != -1; n++) {
+					if (n->index > 0 && n->index <= d)
+						m->w[(n->index - 1) * np + p] += model->sv_coef[i][k] * n->value;
+				}
+			}
+		}
+	}
+}
 
-		kissp->svm.params.nr_weight = 0;     /* NB: .weight_label and .weight not set */
-		kissp->svm.params.cache_size = 100;
-		kissp->svm.params.shrinking = 1;
+/** Prepare a new model for batch prediction */
+static void _batch_model_init(struct spi *spi, struct kissp_model *m)
+{
+	struct kissp *kissp = spi->cdata;
+	struct svm_model *model = m->svm;
+	struct svm_node *n;
+	int i, k, c, p, l, d = kissp->feature_num, nc = model->nr_class;
+
+	if (!_batch_supported(model))
+		return;
+
+	if (model->param.kernel_type == LINEAR) {
+		_batch_model_init_linear(spi, m);
+		return;
 	}
 
-	/* required options */
-	kissp->svm.params.svm_type = C_SVC;
-	kissp->svm.params.probability = 1; /* NB */
+	/* round up to full panels: padding vectors have zero coefficients */
+	l = (model->l + 3) & ~3;
+	m->l = l;
+	m->sv = mmatic_zalloc(m->mm, sizeof(double) * l * d);
+	m->coef = mmatic_zalloc(m->mm, sizeof(double) * l * (nc - 1));
+	m->svclass = mmatic_zalloc(m->mm, sizeof(int) * l);
+
+	/* support vectors of class c are stored at [start, start + nSV[c]) */
+	for (c = 0, i = 0; c < nc; c++) {
+		for (k = 0; k < model->nSV[c]; k++, i++) {
+			for (n = model->SV[i]; n->index != -1; n++) {
+				if (n->index > 0 && n->index <= d)
+					m->sv[(i / 4) * 4 * d + (n->index - 1) * 4 + (i % 4)] = n->value;
+			}
+
+			m->svclass[i] = c;
+			for (p = 0; p < nc - 1; p++)
+				m->coef[i * (nc - 1) + p] = model->sv_coef[p][i];
+		}
+	}
+}
 
-	kissp->svm.labels = mmatic_zalloc(spi->mm, sizeof(int) * SPI_LABEL_MAX);
+/** Compute RBF kernel values for 4 signatures x 4 support vectors
+ * @param x       signature panel: d x 4
+ * @param sv      support vector panel: d x 4
+ * @param k       output: k[4*i + j] = K(x_i, sv_j)
+ */
+static void _rbf_scalar(const double *x, const double *sv, int d, double gamma, double *k)
+{
+	double acc[16] = { 0 }, diff;
+	int f, i, j;
+
+	for (f = 0; f < d; f++) {
+		for (i = 0; i < 4; i++) {
+			for (j = 0; j < 4; j++) {
+				diff = x[f*4 + i] - sv[f*4 + j];
+				acc[i*4 + j] += diff * diff;
+			}
+		}
+	}
 
-	svm_set_print_string_function(_svm_print_func);
+	for (i = 0; i < 16; i++)
+		k[i] = exp(-gamma * acc[i]);
 }
 
-static bool _svm_train(struct spi *spi, const char *evname, void *data)
+#if defined(__x86_64__) || defined(__i386__)
+
+/** exp(x) for 4 doubles, x <= 0
+ * Cody-Waite range reduction and Taylor series of degree 12 (error within 2 ulp) */
+__attribute__ ((target ("avx2,fma")))
+static inline __m256d _exp_avx2(__m256d x)
 {
-	struct kissp *kissp = spi->cdata;
-	struct svm_problem p;
-	struct spi_signature *s;
+	static const double c[] = {
+		1.0 / 479001600, 1.0 / 39916800, 1.0 / 3628800, 1.0 / 362880,
+		1.0 / 40320, 1.0 / 5040, 1.0 / 720, 1.0 / 120, 1.0 / 24, 1.0 / 6, 1.0 / 2, 1.0, 1.0 };
+	__m256d n, r, p;
+	__m128i n32;
 	int i;
-	const char *err;
 
-	/* describe the problem */
-	p.l = tlist_count(spi->traindata);
-	p.x = mmatic_alloc(spi->mm, (sizeof (void *)) * p.l);
-	p.y = mmatic_alloc(spi->mm, (sizeof (double)) * p.l);
+	/* exp(-708) is close to the smallest normal number */
+	x = _mm256_max_pd(x, _mm256_set1_pd(-708.0));
 
-	i = 0;
-	tlist_iter_loop(spi->traindata, s) {
-		p.x[i] = (struct svm_node *) s->c;   /* NB: identical */
-		p.y[i] = s->label;
-		i++;
+	/* x = n*ln2 + r */
+	n = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(1.44269504088896340736)),
+		_MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	r = _mm256_fnmadd_pd(n, _mm256_set1_pd(6.93147180369123816490e-01), x);
+	r = _mm256_fnmadd_pd(n, _mm256_set1_pd(1.90821492927058770002e-10), r);
+
+	/* exp(r) */
+	p = _mm256_set1_pd(c[0]);
+	for (i = 1; i < sizeof c / sizeof c[0]; i++)
+		p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(c[i]));
+
+	/* multiply by 2^n */
+	n32 = _mm_add_epi32(_mm256_cvtpd_epi32(n), _mm_set1_epi32(1023));
+	return _mm256_mul_pd(p, _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_cvtepi32_epi64(n32), 52)));
+}
+
+__attribute__ ((target ("avx2,fma")))
+static void _rbf_avx2(const double *x, const double *sv, int d, double gamma, double *k)
+{
+	__m256d a0, a1, a2, a3, s, t, g;
+	int f;
+
+	a0 = a1 = a2 = a3 = _mm256_setzero_pd();
+
+	for (f = 0; f < d; f++) {
+		s = _mm256_loadu_pd(sv + f*4);
+		t = _mm256_sub_pd(_mm256_broadcast_sd(x + f*4 + 0), s);
+		a0 = _mm256_fmadd_pd(t, t, a0);
+		t = _mm256_sub_pd(_mm256_broadcast_sd(x + f*4 + 1), s);
+		a1 = _mm256_fmadd_pd(t, t, a1);
+		t = _mm256_sub_pd(_mm256_broadcast_sd(x + f*4 + 2), s);
+		a2 = _mm256_fmadd_pd(t, t, a2);
+		t = _mm256_sub_pd(_mm256_broadcast_sd(x + f*4 + 3), s);
+		a3 = _mm256_fmadd_pd(t, t, a3);
 	}
 
-	/* check */
-	err = svm_check_parameter(&p, &kissp->svm.params);
-	if (err) {
-		dbg(1, "libsvm training failed: check_parameter(): %s\n", err);
-		return true;
+	g = _mm256_set1_pd(-gamma);
+	_mm256_storeu_pd(k + 0,  _exp_avx2(_mm256_mul_pd(g, a0)));
+	_mm256_storeu_pd(k + 4,  _exp_avx2(_mm256_mul_pd(g, a1)));
+	_mm256_storeu_pd(k + 8,  _exp_avx2(_mm256_mul_pd(g, a2)));
+	_mm256_storeu_pd(k + 12, _exp_avx2(_mm256_mul_pd(g, a3)));
+
+	/* avoid AVX-SSE transition penalty in non-VEX code */
+	_mm256_zeroupper();
+}
+
+#endif
+
+/** Select the best RBF kernel for this CPU */
+static void _batch_init(struct kissp *kissp)
+{
+	kissp->rbf = _rbf_scalar;
+	kissp->rbf_name = "scalar";
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		kissp->rbf = _rbf_avx2;
+		kissp->rbf_name = "AVX2";
 	}
+#endif
 
-	/* destroy previous model */
-	if (kissp->svm.model)
-		svm_free_and_destroy_model(&kissp->svm.model);
+	dbg(3, "using %s RBF kernel\n", kissp->rbf_name);
+}
 
-	/* run */
-	kissp->svm.model = svm_train(&p, &kissp->svm.params);
-	kissp->svm.nr_class = svm_get_nr_class(kissp->svm.model);
-	svm_get_labels(kissp->svm.model, kissp->svm.labels);
+/** Convert pairwise class probabilities into class probabilities (libsvm method 2) */
+static void _multiclass_probability(int k, double *r, double *Q, double *Qp, double *p)
+{
+	int t, j, iter, max_iter = MAX(100, k);
+	double pQp, diff, error, max_error, eps = 0.005 / k;
+
+	for (t = 0; t < k; t++) {
+		p[t] = 1.0 / k;
+		Q[t*k + t] = 0;
+		for (j = 0; j < t; j++) {
+			Q[t*k + t] += r[j*k + t] * r[j*k + t];
+			Q[t*k + j] = Q[j*k + t];
+		}
+		for (j = t + 1; j < k; j++) {
+			Q[t*k + t] += r[j*k + t] * r[j*k + t];
+			Q[t*k + j] = -r[j*k + t] * r[t*k + j];
+		}
+	}
+
+	for (iter = 0; iter < max_iter; iter++) {
+		/* stopping condition, recalculate QP, pQP for numerical accuracy */
+		pQp = 0;
+		for (t = 0; t < k; t++) {
+			Qp[t] = 0;
+			for (j = 0; j < k; j++)
+				Qp[t] += Q[t*k + j] * p[j];
+			pQp += p[t] * Qp[t];
+		}
+
+		max_error = 0;
+		for (t = 0; t < k; t++) {
+			error = fabs(Qp[t] - pQp);
+			if (error > max_error)
+				max_error = error;
+		}
+		if (max_error < eps)
+			break;
+
+		for (t = 0; t < k; t++) {
+			diff = (-Qp[t] + pQp) / Q[t*k + t];
+			p[t] += diff;
+			pQp = (pQp + diff * (diff * Q[t*k + t] + 2 * Qp[t])) / (1 + diff) / (1 + diff);
+			for (j = 0; j < k; j++) {
+				Qp[j] = (Qp[j] + diff * Q[t*k + j]) / (1 + diff);
+				p[j] /= (1 + diff);
+			}
+		}
+	}
 
-	dbg(5, "updated libsvm model, nr_class=%d\n", kissp->svm.nr_class);
-	spi_announce(spi, "classifierModelUpdated", 0, NULL, false);
+	if (iter >= max_iter)
+		dbg(5, "multiclass probability: exceeds max_iter\n");
+}
 
-	mmatic_free(p.x);
-	mmatic_free(p.y);
+/** Pairwise probability from decision value, as libsvm's sigmoid_predict() */
+static inline double _sigmoid(double dec, double A, double B)
+{
+	double fApB = dec * A + B;
 
-	return true;
+	if (fApB >= 0)
+		return exp(-fApB) / (1.0 + exp(-fApB));
+	else
+		return 1.0 / (1 + exp(fApB));
 }
 
-static bool _svm_predict(struct spi *spi, struct spi_signature *sign, struct spi_ep *ep)
+/** Get scratch memory for batch prediction
+ * @param size        number of doubles */
+static double *_batch_tmp(struct spi *spi, size_t size)
 {
 	struct kissp *kissp = spi->cdata;
-	struct spi_classresult *cr;
+
+	size *= sizeof(double);
+	if (kissp->batch.tmp_size < size) {
+		mmatic_free(kissp->batch.tmp);
+		kissp->batch.tmp = mmatic_alloc(spi->mm, size);
+		kissp->batch.tmp_size = size;
+	}
+
+	return kissp->batch.tmp;
+}
+
+/** Announce classification result given decision values, as svm_predict_probability()
+ * @param dec         decision value of each pair of classes, rho already subtracted
+ * @param r           scratch memory: nr_class x nr_class
+ * @param Q           scratch memory: nr_class x nr_class
+ */
+static void _batch_result(struct spi *spi, struct kissp_model *m, struct spi_ep *ep,
+	const double *dec, double *r, double *Q)
+{
+	struct svm_model *model = m->svm;
+	int i, j, p, best, nc = model->nr_class;
+	double pp, prob[nc], Qp[nc];
+
+	for (i = 0, p = 0; i < nc; i++) {
+		for (j = i + 1; j < nc; j++, p++) {
+			pp = _sigmoid(dec[p], model->probA[p], model->probB[p]);
+			pp = MIN(MAX(pp, 1e-7), 1 - 1e-7);
+			r[i*nc + j] = pp;
+			r[j*nc + i] = 1 - pp;
+		}
+	}
+
+	_multiclass_probability(nc, r, Q, Qp, prob);
+
+	for (best = 0, i = 1; i < nc; i++) {
+		if (prob[i] > prob[best])
+			best = i;
+	}
+
+	_classresult(spi, m, ep, model->label[best], prob);
+}
+
+/** Score all batched signatures against an RBF model */
+static void _batch_predict_rbf(struct spi *spi, struct kissp_model *m)
+{
+	struct kissp *kissp = spi->cdata;
+	struct svm_model *model = m->svm;
+	int B = kissp->batch.count, d = kissp->feature_num, nc = model->nr_class;
+	int nt = nc * (nc - 1);      /* size of T of single signature */
+	int b, bp, i, j, s, s0, s1, p;
+	double x[4 * d], k[16], kv;
+	double *T, *dec, *r, *Q;
+	const double *coef;
+	double *t;
+	struct spi_coordinate *c;
+
+	/* scratch memory: T for each signature, then decision values, pairwise probabilities and Q */
+	T = _batch_tmp(spi, SPI_KISSP_BATCH * nt + nt / 2 + 2 * nc * nc);
+	dec = T + SPI_KISSP_BATCH * nt;
+	r = dec + nt / 2;
+	Q = r + nc * nc;
+
+	memset(T, 0, sizeof(double) * B * nt);
+
+	/* cache blocks of support vectors */
+	for (s0 = 0; s0 < m->l; s0 += SPI_KISSP_SVBLOCK) {
+		s1 = MIN(s0 + SPI_KISSP_SVBLOCK, m->l);
+
+		/* panels of 4 signatures */
+		for (bp = 0; bp < B; bp += 4) {
+			memset(x, 0, sizeof x);
+			for (i = 0; i < 4 && bp + i < B; i++) {
+				for (c = kissp->batch.signs[bp + i]->c; c->index != -1; c++) {
+					if (c->index > 0 && c->index <= d)
+						x[(c->index - 1) * 4 + i] = c->value;
+				}
+			}
+
+			/* panels of 4 support vectors */
+			for (s = s0; s < s1; s += 4) {
+				kissp->rbf(x, m->sv + s * d, d, model->param.gamma, k);
+
+				for (i = 0; i < 4 && bp + i < B; i++) {
+					for (j = 0; j < 4; j++) {
+						kv = k[i*4 + j];
+						coef = m->coef + (s + j) * (nc - 1);
+						t = T + (bp + i) * nt + m->svclass[s + j] * (nc - 1);
+
+						for (p = 0; p < nc - 1; p++)
+							t[p] += coef[p] * kv;
+					}
+				}
+			}
+		}
+	}
+
+	for (b = 0; b < B; b++) {
+		t = T + b * nt;
+
+		for (i = 0, p = 0; i < nc; i++) {
+			for (j = i + 1; j < nc; j++, p++)
+				dec[p] = t[i * (nc - 1) + j - 1] + t[j * (nc - 1) + i] - model->rho[p];
+		}
+
+		_batch_result(spi, m, kissp->batch.eps[b], dec, r, Q);
+	}
+}
+
+/** Score all batched signatures against a linear model */
+static void _batch_predict_linear(struct spi *spi, struct kissp_model *m)
+{
+	struct kissp *kissp = spi->cdata;
+	struct kissp *owner = _model_owner(spi);
+	struct svm_model *model = m->svm;
+	int B = kissp->batch.count, d = _model_dim(owner), nc = model->nr_class;
+	int np = nc * (nc - 1) / 2;
+	int b, f, p;
+	double *dec, *r, *Q, *x, *z;
+	const double *w;
+
+	/* scratch memory: decision values, pairwise probabilities, Q, signature and its features */
+	dec = _batch_tmp(spi, np + 2 * nc * nc + kissp->feature_num + d);
+	r = dec + np;
+	Q = r + nc * nc;
+	x = Q + nc * nc;
+	z = x + kissp->feature_num;
+
+	for (b = 0; b < B; b++) {
+		_dense(kissp, kissp->batch.signs[b]->c, x);
+
+		if (owner->rff.D)
+			_rff_map(owner, x, z);
+		else
+			z = x;
+
+		/* NB: feature by feature, so the sums do not depend on each other */
+		for (p = 0; p < np; p++)
+			dec[p] = -m->rho[p];
+
+		for (f = 0, w = m->w; f < d; f++, w += np) {
+			if (z[f] == 0.0)
+				continue;
+
+			for (p = 0; p < np; p++)
+				dec[p] += w[p] * z[f];
+		}
+
+		_batch_result(spi, m, kissp->batch.eps[b], dec, r, Q);
+	}
+}
+
+/** Score all batched signatures against a random forest */
+static void _batch_predict_forest(struct spi *spi, struct kissp_model *m)
+{
+	struct kissp *kissp = spi->cdata;
+	double x[kissp->feature_num], prob[m->nr_class];
+	int b, i, best;
+
+	for (b = 0; b < kissp->batch.count; b++) {
+		_dense(kissp, kissp->batch.signs[b]->c, x);
+		forest_predict(m->forest, x, prob);
+
+		for (best = 0, i = 1; i < m->nr_class; i++) {
+			if (prob[i] > prob[best])
+				best = i;
+		}
+
+		_classresult(spi, m, kissp->batch.eps[b], m->labels[best], prob);
+	}
+}
+
+/** Classify all batched signatures */
+static void _batch_flush(struct spi *spi)
+{
+	struct kissp *kissp = spi->cdata;
+	struct kissp_model *m;
+	struct timespec t0, t1;
 	int i;
 
-	if (!kissp->svm.model) {
+	if (kissp->batch.count == 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	/* NB: signatures are queued only if there is a model */
+	m = _model_get(spi);
+
+	if (m->forest) {
+		_batch_predict_forest(spi, m);
+	} else if (m->sv) {
+		_batch_predict_rbf(spi, m);
+	} else if (m->w) {
+		_batch_predict_linear(spi, m);
+	} else {
+		for (i = 0; i < kissp->batch.count; i++)
+			_svm_predict(spi, m, kissp->batch.signs[i], kissp->batch.eps[i]);
+	}
+
+	_model_put(m);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	spi->stats.classified_signs += kissp->batch.count;
+	spi->stats.classify_us += (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
+
+	for (i = 0; i < kissp->batch.count; i++)
+		spi_signature_free(kissp->batch.signs[i]);
+
+	dbg(8, "classified batch of %d signatures\n", kissp->batch.count);
+	kissp->batch.count = 0;
+}
+
+/** Queue signature for classification
+ * @retval false      no model - signature not queued */
+static bool _batch_add(struct spi *spi, struct spi_signature *sign, struct spi_ep *ep)
+{
+	struct kissp *kissp = spi->cdata;
+
+	if (!__atomic_load_n(&_model_owner(spi)->svm.model, __ATOMIC_ACQUIRE)) {
 		dbg(1, "cant classify: no model\n");
 		return false;
 	}
 
-	cr = mmatic_zalloc(spi->mm, sizeof *cr);
-	cr->ep = ep;
-	cr->result = svm_predict_probability(kissp->svm.model, (struct svm_node *) sign->c, cr->cprob_lib);
-
-	/* rewrite from libsvm's to ours */
-	for (i = 0; i < kissp->svm.nr_class; i++)
-		cr->cprob[kissp->svm.labels[i]] = cr->cprob_lib[i];
+	kissp->batch.signs[kissp->batch.count] = sign;
+	kissp->batch.eps[kissp->batch.count] = ep;
+	kissp->batch.count++;
 
+	/* lock endpoint until its result is announced */
 	ep->gclock2++;
-	spi_announce(spi, "endpointClassification", 0, cr, true);
+
+	if (kissp->batch.count == SPI_KISSP_BATCH)
+		_batch_flush(spi);
+	else
+		spi_announce_id(spi, SPI_EV_CLASSIFIER_BATCH_READY, 0, NULL, false);
 
 	return true;
 }
@@ -119,93 +1498,103 @@ static bool _svm_predict(struct spi *spi, struct spi_signature *sign, struct spi
 /********** signature generation */
 #define GV2I(group, value) (((group) * 16) + ((value) % 16))
 
-/** Compute window signature and eat packets */
-static struct spi_signature *_signature_compute_eat(struct spi *spi, struct spi_ep *ep)
+/** Allocate window accumulator */
+static struct kissp_window *_window_create(struct spi *spi, mmatic *mm)
 {
-	struct kissp *kissp = spi->cdata;
-	struct spi_signature *sign; /** the resultant signature */
-	struct spi_coordinate *c;   /** shortcut pointer inside sign->c[] */
-	struct spi_pkt *pkt;
-	uint8_t *o;             /** table of occurances note: uint8_t because options.C < 256 */
-	int i, j, pktcnt;
-	double E;               /** expected number of occurances */
-	double max;             /** max value of single KISS signature coordinate */
-	void *v;
+	struct kissp_window *w;
 
-	struct timeval Tp;      /** previous packet time */
-	struct timeval Tdiff;   /** delay to previous packet */
-	uint32_t x, xp = 0;     /** delay: current, previous */
-	tlist *delays;          /** delay queue */
+	w = mmatic_zalloc(mm, sizeof *w
+		+ sizeof(*w->delays) * spi->options.C
+		+ spi->options.N * 2 * 16); /* 2N groups, in each 16 groups */
 
-	double An, A = 0;       /** average delay estimation */
-	double S = 0;           /** delay std deviation estimation */
-	double xlimit;          /** delay outlier limit */
+	w->delays = (uint32_t *) (w + 1);
+	w->o = (uint8_t *) (w->delays + spi->options.C);
 
-	double avgdelay = 0;    /** average delay */
-	double avgjitter = 0;   /** average jitter */
-	double avgsize = 0;     /** average packet size */
+	return w;
+}
 
-	sign = mmatic_zalloc(spi->mm, sizeof *sign);
-	o = mmatic_zalloc(spi->mm, spi->options.N * 2 * 16); /* 2N groups, in each 16 groups */
-	delays = tlist_create(NULL, spi->mm);
+/** Start new window */
+static void _window_reset(struct spi *spi, struct kissp_window *w)
+{
+	w->pkts = 0;
+	w->avgsize = 0;
+	w->A = 0;
+	w->S = 0;
+	timerclear(&w->Tp);
+	memset(w->o, 0, spi->options.N * 2 * 16);
+}
 
-	timerclear(&Tp);
+/** Update window statistics with new packet
+ * 1) count byte occurances in each of 2N groups
+ * 2) compute approximate mean packet size
+ * 3) determine approximate mean delay and its variance */
+static void _window_add(struct spi *spi, struct kissp_window *w,
+	const struct timeval *ts, const uint8_t *payload, uint16_t size)
+{
+	struct timeval Tdiff;   /** delay to previous packet */
+	uint32_t x;             /** delay */
+	double An;              /** new average delay estimation */
+	int i;
 
-	/* +1 for ending index=-1 */
-	sign->c = mmatic_zalloc(spi->mm, sizeof(*sign->c) * (kissp->feature_num + 1));
-
-	/* 1) count byte occurances in each of 2N groups
-	 * 2) compute approximate mean packet size
-	 * 3) determine approximate mean delay and its variance */
-	for (pktcnt = 0; pktcnt < spi->options.C && (pkt = tlist_shift(ep->pkts)); pktcnt++) {
-		for (i = 0; i < spi->options.N; i++) {
-			o[GV2I(2*i + 0, pkt->payload[i] & 0x0f)]++;
-			o[GV2I(2*i + 1, pkt->payload[i]   >> 4)]++;
-		}
+	for (i = 0; i < spi->options.N; i++) {
+		w->o[GV2I(2*i + 0, payload[i] & 0x0f)]++;
+		w->o[GV2I(2*i + 1, payload[i]   >> 4)]++;
+	}
 
-		avgsize += (pkt->size - avgsize) / (pktcnt + 1);
+	w->avgsize += (size - w->avgsize) / (w->pkts + 1);
 
-		if (pktcnt > 0) {
-			timersub(&pkt->ts, &Tp, &Tdiff);
-			x = Tdiff.tv_sec * 1000 + Tdiff.tv_usec / 1000;
+	if (w->pkts > 0) {
+		timersub(ts, &w->Tp, &Tdiff);
+		x = Tdiff.tv_sec * 1000 + Tdiff.tv_usec / 1000;
+		w->delays[w->pkts - 1] = x;
 
-			v = (void *) (x + 1);
-			tlist_push(delays, v);    /* @1: 0 is ~ NULL, avoid it */
+		/* Welford's method */
+		An = w->A + (x - w->A) / w->pkts;
+		w->S += (x - w->A) * (x - An);
+		w->A = An;
+	}
 
-			An = A + (x - A) / pktcnt;
-			S += (x - A) * (x - An);
-			A = An;
-		}
+	memcpy(&w->Tp, ts, sizeof w->Tp);
+	w->pkts++;
+}
 
-		memcpy(&Tp, &pkt->ts, sizeof Tp);
-	}
+/** Compute signature of a window */
+static struct spi_signature *_window_sign(struct spi *spi, struct spi_ep *ep, struct kissp_window *w)
+{
+	struct kissp *kissp = spi->cdata;
+	struct spi_signature *sign; /** the resultant signature */
+	struct spi_coordinate *c;   /** shortcut pointer inside sign->c[] */
+	int i, j, k;
+	double chi[spi->options.N * 2]; /** KISS coordinates */
+
+	uint32_t x, xp = 0;     /** delay: current, previous */
+	double S;               /** delay std deviation estimation */
+	double xlimit;          /** delay outlier limit */
 
-	/* expected value of occurances */
-	E = (double) pktcnt / 16.0;
+	double avgdelay = 0;    /** average delay */
+	double avgjitter = 0;   /** average jitter */
+	double avgsize = w->avgsize; /** average packet size */
 
-	/* max is when there is one constant value and rest=0 */
-	max = (pow(E - pktcnt, 2.0) + 15*pow(E - 0.0, 2.0)) / E;
+	/* +1 for ending index=-1 */
+	sign = spi_signature_new(spi, kissp->feature_num + 1);
 
 	/* for each group sum up the difference of occurance from expected value */
+	kissp->chisq(w->o, spi->options.N * 2, w->pkts, chi);
 	for (i = 0; i < spi->options.N * 2; i++) {
 		c = &sign->c[i];
-
 		c->index = i + 1;
-		for (j = 0; j < 16; j++)
-			c->value += pow(E - o[GV2I(i, j)], 2.0);
-		c->value /= E;
-		c->value /= max; /* normalize */
+		c->value = chi[i];
 	}
 
 	if (!kissp->options.pktstats) {
 		sign->c[spi->options.N * 2].index = -1;
 	} else {
 		/* compute average delay and jitter, without outliers */
-		S = sqrt(S / pktcnt);        /* now its standard deviation */
-		xlimit = A + 1.645 * S;      /* outside of 10% of std dist. area */
+		S = sqrt(w->S / w->pkts);    /* now its standard deviation */
+		xlimit = w->A + 1.645 * S;   /* outside of 10% of std dist. area */
 		i = j = 1;
-		tlist_iter_loop(delays, v) {
-			x = ((uint32_t) v) - 1; /* @1 */
+		for (k = 0; k + 1 < w->pkts; k++) {
+			x = w->delays[k];
 
 			if (x > xlimit)
 				continue;
@@ -266,9 +1655,6 @@ static struct spi_signature *_signature_compute_eat(struct spi *spi, struct spi_
 		sign->c[i].index = -1;
 	}
 
-	mmatic_free(o);
-	tlist_free(delays);
-
 	if (debug >= 5) {
 		dbg(-1, "%-21s ", spi_epa2a(ep->epa));
 		for (i = 0; sign->c[i].index > 0; i++)
@@ -279,36 +1665,105 @@ static struct spi_signature *_signature_compute_eat(struct spi *spi, struct spi_
 	return sign;
 }
 
+/** Compute window signature and eat packets */
+static struct spi_signature *_signature_compute_eat(struct spi *spi, struct spi_ep *ep)
+{
+	struct kissp *kissp = spi->cdata;
+	struct kissp_window *w = kissp->window;
+	struct spi_pkt *pkt;
+	int pktcnt;
+
+	_window_reset(spi, w);
+
+	for (pktcnt = 0; pktcnt < spi->options.C && pktcnt < ep->pkts_count; pktcnt++) {
+		pkt = ep_pkt(ep, pktcnt);
+		_window_add(spi, w, &pkt->ts, pkt->payload, pkt->size);
+	}
+
+	ep_pkts_eat(ep, pktcnt);
+
+	return _window_sign(spi, ep, w);
+}
+
+/** Handle signature of a window: learn or classify */
+static void _signature_handle(struct spi *spi, struct spi_ep *ep, struct spi_signature *sign)
+{
+	struct spi_source *source = ep->source;
+
+	__atomic_add_fetch(&source->signatures, 1, __ATOMIC_RELAXED);
+
+	/* if a learning source, submit as a training sample */
+	if (source->label && !source->testing) {
+		sign->label = source->label;
+
+		spi_train(spi, sign);
+		__atomic_add_fetch(&source->learned, 1, __ATOMIC_RELAXED);
+		spi->stats.learned_pkt++;
+	} else {
+		/* queue for prediction */
+		if (!_batch_add(spi, sign, ep))
+			spi_signature_free(sign);
+	}
+}
+
 /********** event handlers */
 
 /** Receives "endpointPacketsReady */
 static bool _ep_ready(struct spi *spi, const char *evname, void *data)
 {
 	struct spi_ep *ep = data;
-	struct spi_source *source = ep->source;
+	struct kissp_ep *kep = ep->cdata;
 	struct spi_signature *sign;
 
-	while (tlist_count(ep->pkts) >= spi->options.C) {
-		sign = _signature_compute_eat(spi, ep);
-		source->signatures++;
+	if (spi->options.kiss_stream) {
+		/* signatures already computed in kissp_stream() */
+		while ((sign = tlist_shift(kep->signs)))
+			_signature_handle(spi, ep, sign);
+	} else {
+		while (ep->pkts_count >= spi->options.C)
+			_signature_handle(spi, ep, _signature_compute_eat(spi, ep));
+	}
 
-		/* if a learning source, submit as a training sample */
-		if (source->label && !source->testing) {
-			sign->label = source->label;
+	ep->gclock1--;
+	return true;
+}
 
-			spi_train(spi, sign);
-			source->learned++;
-			spi->stats.learned_pkt++;
-		} else {
-			/* make a prediction */
-			if (_svm_predict(spi, sign, ep))
-				ep->predictions++;
+/** Receives "endpointClassification" after all handlers: reuse the result memory */
+static bool _cr_free(struct spi *spi, const char *evname, void *data)
+{
+	pool_put(&spi->cr_pool, data);
+	return true;
+}
 
-			spi_signature_free(sign);
-		}
+/** Receives "classifierBatchReady" */
+static bool _batch_ready(struct spi *spi, const char *evname, void *data)
+{
+	_batch_flush(spi);
+	return true;
+}
+
+/**********/
+
+bool kissp_stream(struct spi *spi, struct spi_ep *ep,
+	const struct timeval *ts, const uint8_t *payload, uint16_t size)
+{
+	struct kissp_ep *kep = ep->cdata;
+
+	if (!kep) {
+		kep = mmatic_zalloc(ep->mm, sizeof *kep);
+		kep->window = _window_create(spi, ep->mm);
+		kep->signs = tlist_create(spi_signature_free, ep->mm);
+		ep->cdata = kep;
 	}
 
-	ep->gclock1--;
+	_window_add(spi, kep->window, ts, payload, size);
+	if (kep->window->pkts < spi->options.C)
+		return false;
+
+	/* window complete: only finalize the statistics */
+	tlist_push(kep->signs, _window_sign(spi, ep, kep->window));
+	_window_reset(spi, kep->window);
+
 	return true;
 }
 
@@ -321,31 +1776,94 @@ void kissp_init(struct spi *spi)
 	/* subscribe to endpoints accumulating 80+ packets */
 	spi_subscribe(spi, "endpointPacketsReady", _ep_ready, false);
 
-	/* subscribe to new learning samples */
-	spi_subscribe(spi, "traindataUpdated", _svm_train, true);
+	/* subscribe to signatures waiting for classification */
+	spi_subscribe(spi, "classifierBatchReady", _batch_ready, true);
+
+	/* take back classification results after they are handled */
+	spi_subscribe_after(spi, "endpointClassification", _cr_free, false);
 
 	/* KISS+ internal data */
 	kissp = mmatic_zalloc(spi->mm, sizeof *kissp);
 	spi->cdata = kissp;
 
-	if (spi->options.kiss_std) {
-		kissp->options.pktstats = false;
-		kissp->feature_num = spi->options.N*2;
-	} else {
-		kissp->options.pktstats = true;
-		kissp->feature_num = spi->options.N*2 + SPI_KISSP_FEATURES;
-	}
+	kissp->options.pktstats = !spi->options.kiss_std;
+	kissp->feature_num = spi_signature_features(spi);
+
+	kissp->options.forest = (spi->options.classifier == SPI_CLASSIFIER_FOREST);
+
+	/* select SIMD kernels */
+	_chisq_init(kissp);
+	_batch_init(kissp);
+
+	/* window accumulator for computing signatures from stored packets */
+	kissp->window = _window_create(spi, spi->mm);
+
+	/* worker shards use the model of main spi */
+	if (spi->root)
+		return;
+
+	/* subscribe to new learning samples */
+	spi_subscribe(spi, "traindataUpdated", _svm_train, true);
 
 	/* initialize underlying classifier library */
 	_svm_init(spi);
+	if (spi->options.classifier == SPI_CLASSIFIER_RFF)
+		_rff_init(spi);
+
+	kissp->options.online = spi->options.online && (spi->options.classifier == SPI_CLASSIFIER_LINEAR
+		|| spi->options.classifier == SPI_CLASSIFIER_RFF);
+	if (spi->options.online && !kissp->options.online)
+		dbg(1, "online learning needs linear or rff classifier, using full training\n");
+
+	kissp->train.file = spi->options.model_file;
+	pthread_mutex_init(&kissp->svm.lock, NULL);
+
+	/* wake-ups from training thread */
+	if (pipe(kissp->train.pipe) != 0)
+		die("pipe() failed: %s\n", strerror(errno));
+	fcntl(kissp->train.pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(kissp->train.pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(kissp->train.pipe[1], F_SETFD, FD_CLOEXEC);
+
+	kissp->train.ev = event_new(spi->eb, kissp->train.pipe[0], EV_READ | EV_PERSIST, _train_done, spi);
+	event_add(kissp->train.ev, 0);
+}
+
+bool kissp_training(struct spi *spi)
+{
+	struct kissp *kissp = spi->cdata;
+	return kissp->train.running;
 }
 
 void kissp_free(struct spi *spi)
 {
 	struct kissp *kissp = spi->cdata;
 
+	if (!spi->root) {
+		/* wait for training in progress */
+		if (kissp->train.running && kissp->train.threaded)
+			pthread_join(kissp->train.thread, NULL);
+		if (kissp->train.result)
+			svm_free_and_destroy_model(&kissp->train.result);
+		forest_free(kissp->train.forest);
+		_train_cleanup(kissp);
+
+		event_del(kissp->train.ev);
+		event_free(kissp->train.ev);
+		close(kissp->train.pipe[0]);
+		close(kissp->train.pipe[1]);
+
+		_model_put(kissp->svm.model);
+		pthread_mutex_destroy(&kissp->svm.lock);
+	}
+
+	if (kissp->rff.D) {
+		mmatic_free(kissp->rff.W);
+		mmatic_free(kissp->rff.b);
+	}
+
+	mmatic_free(kissp->batch.tmp);
+	mmatic_free(kissp->window);
 	mmatic_free(kissp);
 	spi->cdata = NULL;
 }
-
-
@@ -7,34 +7,166 @@
 #ifndef _KISSP_H_
 #define _KISSP_H_
 
+#include <pthread.h>
 #include <libsvm/svm.h>
 
 #include "datastructures.h"
+#include "forest.h"
 
 /** Number of additional features in KISS+ vs KISS */
 #define SPI_KISSP_FEATURES 4
 
+/** Max number of signatures classified at once */
+#define SPI_KISSP_BATCH 64
+
+/** Number of support vectors in a cache block during batch classification */
+#define SPI_KISSP_SVBLOCK 128
+
+/** Version of saved model metadata, see spi_options.model_file */
+#define SPI_KISSP_MODEL_VERSION 1
+
+/** Max number of samples learned online between full trainings, as 1/x of the fully trained ones */
+#define SPI_KISSP_ONLINE_PART 4
+
+/** Seed of random Fourier features: fixed, so saved models stay valid */
+#define SPI_KISSP_RFF_SEED 0x5eed5eed5eed5eedULL
+
+/** Statistics of a window of packets being accumulated */
+struct kissp_window {
+	int pkts;                        /** number of packets in window */
+	struct timeval Tp;               /** previous packet time */
+	double avgsize;                  /** average packet size */
+	double A;                        /** average delay estimation */
+	double S;                        /** sum of squared delay differences (Welford) */
+	uint32_t *delays;                /** delays between packets [ms], for outlier removal */
+	uint8_t *o;                      /** table of occurances note: uint8_t because options.C < 256 */
+};
+
+/** Per-endpoint KISSP data in streaming mode */
+struct kissp_ep {
+	struct kissp_window *window;     /** current window */
+	tlist *signs;                    /** signatures of finished windows, waiting for handling */
+};
+
+/** Chi-square kernel: compute KISS coordinates of groups of 16 occurance counters
+ * @param o       occurance counters: groups * 16
+ * @param groups  number of groups
+ * @param pkts    number of packets in window
+ * @param out     output KISS coordinates: groups
+ */
+typedef void kissp_chisq_t(const uint8_t *o, int groups, int pkts, double *out);
+
+/** RBF kernel: compute K(x_i, sv_j) for 4 signatures x 4 support vectors
+ * @param x       signatures: d x 4, feature by feature
+ * @param sv      support vectors: d x 4, feature by feature
+ * @param d       number of features
+ * @param gamma   RBF gamma
+ * @param k       output: k[4*i + j] = K(x_i, sv_j)
+ */
+typedef void kissp_rbf_t(const double *x, const double *sv, int d, double gamma, double *k);
+
+/** Trained classifier model */
+struct kissp_model {
+	mmatic *mm;                      /** memory of this model */
+	int refcnt;                      /** reference counter */
+	struct svm_model *svm;           /** libsvm model, or NULL */
+	struct kissp_model *base;        /** model owning svm, if this one was updated online */
+	struct forest *forest;           /** random forest, or NULL */
+	struct svm_node *x;              /** copy of training vectors, referenced by svm */
+	int nr_class;                    /** number of classes */
+	int labels[SPI_LABEL_MAX];       /** translation of svm->libspi labels */
+
+	/* support vectors packed for batch prediction (RBF only) */
+	int l;                           /** number of packed vectors, multiple of 4 */
+	double *sv;                      /** panels of 4 vectors, feature by feature: l x feature_num */
+	double *coef;                    /** coefficients of each vector: l x (nr_class-1) */
+	int *svclass;                    /** class index of each vector */
+
+	/* weight vectors for batch prediction (linear only) */
+	double *w;                       /** weights of pairs of classes, feature by feature: dimension x nc*(nc-1)/2 */
+	double *rho;                     /** bias of each pair of classes */
+};
+
 /** Internal KISSP data */
 struct kissp {
 	int feature_num;                 /** number of signature coordinates */
+	struct kissp_window *window;     /** window accumulator for endpoint packet rings */
+	kissp_chisq_t *chisq;            /** chi-square kernel */
+	const char *chisq_name;          /** name of chi-square kernel */
+	kissp_rbf_t *rbf;                /** RBF kernel for batch prediction */
+	const char *rbf_name;            /** name of RBF kernel */
 
 	/** KISSP options */
 	struct {
 		bool pktstats;               /** use packet stats in signatures */
+		bool forest;                 /** use random forest instead of libsvm */
+		bool online;                 /** learn new samples online, see _online_update() */
 	} options;
 
+	/** random Fourier features: z(x) = sqrt(2/D) cos(W x + b) */
+	struct {
+		int D;                       /** number of features, 0 if not used */
+		double *W;                   /** random directions, feature by feature: feature_num x D */
+		double *b;                   /** random phases: D */
+	} rff;
+
 	/** internal SVM data */
 	struct {
-		struct svm_model *model;      /** libsvm model */
+		struct kissp_model *model;    /** current model, swapped atomically */
+		pthread_mutex_t lock;         /** protects taking model references vs. swapping */
 		struct svm_parameter params;  /** libsvm parameters */
-		int *labels;                  /** translation of svm->libspi labels */
-		int nr_class;                 /** number of classes */
 	} svm;
+
+	/** background training */
+	struct {
+		bool running;                 /** training in progress */
+		bool again;                   /** traindata updated during training */
+		bool threaded;                /** training runs in a thread */
+		pthread_t thread;             /** training thread */
+		int pipe[2];                  /** training thread -> event loop wake-ups */
+		mmatic *mm;                   /** memory of traindata snapshot, becomes model memory */
+		struct event *ev;             /** pipe read event */
+		struct svm_problem p;         /** traindata snapshot */
+		struct svm_node *x;           /** vectors of traindata snapshot */
+		struct svm_model *result;     /** trained model, published by training thread */
+		struct forest *forest;        /** trained forest, published by training thread */
+		uint64_t hash;                /** hash of traindata snapshot and training options */
+		uint32_t replaced;            /** spi->trainset.replaced at snapshot */
+		const char *file;             /** where to save trained model, NULL for nowhere */
+	} train;
+
+	/** online learning */
+	struct {
+		int samples;                  /** number of traindata samples learned by current model */
+		int trained;                  /** ...of which learned in full training */
+		uint32_t replaced;            /** spi->trainset.replaced when fully trained */
+	} online;
+
+	/** signatures waiting for batch prediction */
+	struct {
+		int count;                                 /** number of signatures */
+		struct spi_signature *signs[SPI_KISSP_BATCH]; /** signatures */
+		struct spi_ep *eps[SPI_KISSP_BATCH];       /** endpoints */
+		double *tmp;                               /** scratch memory for RBF prediction */
+		size_t tmp_size;                           /** size of tmp */
+	} batch;
 };
 
 /** Initialize KISS+ classifier */
 void kissp_init(struct spi *spi);
 
+/** Update streaming signature of endpoint with new packet
+ * @param ts         packet timestamp
+ * @param payload    packet payload (N bytes)
+ * @param size       real packet size
+ * @retval true      window finished: new signature waiting for "endpointPacketsReady"
+ */
+bool kissp_stream(struct spi *spi, struct spi_ep *ep,
+	const struct timeval *ts, const uint8_t *payload, uint16_t size);
+
+/** Check if classifier model is being trained in background */
+bool kissp_training(struct spi *spi);
+
 /** Deinitialize classifier and free memory */
 void kissp_free(struct spi *spi);
 
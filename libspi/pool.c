@@ -0,0 +1,72 @@
+/*
+ * spi: Statistical Packet Inspection: pools of fixed-size objects
+ * Copyright (C) 2011 Paweł Foremski <pawel@foremski.pl>
+ * This software is licensed under GNU GPL version 3
+ */
+
+#include <libpjf/lib.h>
+
+#include "datastructures.h"
+#include "pool.h"
+
+/** Header of pool object, followed by the object */
+struct pool_obj {
+	struct pool_obj *next;           /** next free object */
+	size_t size;                     /** object size */
+};
+
+void pool_init(struct spi_pool *pool, mmatic *mm)
+{
+	pool->mm = mm;
+	pool->size = 0;
+	pool->free = NULL;
+	pool->count = 0;
+}
+
+void *pool_get(struct spi_pool *pool, size_t size)
+{
+	struct pool_obj *h;
+
+	if (size != pool->size) {
+		pool_flush(pool);
+		pool->size = size;
+	}
+
+	h = pool->free;
+	if (h) {
+		pool->free = h->next;
+		pool->count--;
+	} else {
+		h = mmatic_alloc(pool->mm, sizeof *h + size);
+		h->size = size;
+	}
+
+	return h + 1;
+}
+
+void pool_put(struct spi_pool *pool, void *obj)
+{
+	struct pool_obj *h = (struct pool_obj *) obj - 1;
+
+	/* object of previous size or too many free objects */
+	if (h->size != pool->size || pool->count >= SPI_POOL_MAX) {
+		mmatic_free(h);
+		return;
+	}
+
+	h->next = pool->free;
+	pool->free = h;
+	pool->count++;
+}
+
+void pool_flush(struct spi_pool *pool)
+{
+	struct pool_obj *h;
+
+	while ((h = pool->free)) {
+		pool->free = h->next;
+		mmatic_free(h);
+	}
+
+	pool->count = 0;
+}
@@ -0,0 +1,28 @@
+/*
+ * spi: Statistical Packet Inspection: pools of fixed-size objects
+ * Copyright (C) 2011 Paweł Foremski <pawel@foremski.pl>
+ * This software is licensed under GNU GPL version 3
+ */
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include "settings.h"
+#include "datastructures.h"
+
+/** Initialize empty pool
+ * @param mm         mm for the objects
+ * @note a pool must be used by a single thread only */
+void pool_init(struct spi_pool *pool, mmatic *mm);
+
+/** Get object of given size
+ * @note when the size differs from the previous call, the free objects are dropped */
+void *pool_get(struct spi_pool *pool, size_t size);
+
+/** Return object to its pool */
+void pool_put(struct spi_pool *pool, void *obj);
+
+/** Free all objects kept for reuse */
+void pool_flush(struct spi_pool *pool);
+
+#endif
@@ -19,6 +19,12 @@
 /** Default verdict probability threshold */
 #define SPI_DEFAULT_VERDICT_THRESHOLD 0.6
 
+/** Default number of random Fourier features, see SPI_CLASSIFIER_RFF */
+#define SPI_DEFAULT_RFF_DIM 512
+
+/** Default coordinate step under which training samples are duplicates, see spi_options.train_quant */
+#define SPI_DEFAULT_TRAIN_QUANT (1.0 / 256)
+
 /** Garbage collector interval */
 #define SPI_GC_INTERVAL 10
 
@@ -34,6 +40,21 @@
 /** pcap default filter */
 #define SPI_PCAP_DEFAULT_FILTER "tcp or udp"
 
+/** max no of packet records read once from a pcap file */
+#define SPI_FILE_BATCH 4096
+
+/** AF_PACKET ring: size of a block (a power of 2, multiple of page size) */
+#define SPI_RING_BLOCK_SIZE (1 << 20)
+
+/** AF_PACKET ring: number of blocks */
+#define SPI_RING_BLOCKS 64
+
+/** AF_PACKET ring: frame size hint (TPACKET_V3 packs frames tightly in blocks) */
+#define SPI_RING_FRAME_SIZE 2048
+
+/** AF_PACKET ring: max time to wait before passing a partially filled block [ms] */
+#define SPI_RING_TIMEOUT SPI_PCAP_TIMEOUT
+
 /** Timeout a flow if no packets for given no. of seconds
  * Affects mostly the SPI_DEFAULT_P limit of TCP packets per window */
 #define SPI_FLOW_TIMEOUT 300
@@ -41,6 +62,51 @@
 /** Endpoint timeout */
 #define SPI_EP_TIMEOUT 300
 
+/** Expiry timing wheel: log2 of number of slots at each level */
+#define SPI_WHEEL_BITS 6
+
+/** Expiry timing wheel: number of levels (1 s resolution, 2^(BITS*LEVELS) s range) */
+#define SPI_WHEEL_LEVELS 4
+
+/** Estimated allocator overhead of single endpoint [B] */
+#define SPI_EP_OVERHEAD 256
+
+/** Number of flow table buckets sampled when looking for the least recently active flow */
+#define SPI_EVICT_SAMPLES 8
+
+/** Initial number of queued zero-delay spi events (power of 2) */
+#define SPI_EVQUEUE_SIZE 1024
+
+/** Max number of free objects kept in a pool for reuse */
+#define SPI_POOL_MAX 1024
+
+/** Initial number of slots in endpoint hash table (power of 2) */
+#define SPI_EPTABLE_SIZE 4096
+
+/** Initial number of slots in hash table of training samples (power of 2) */
+#define SPI_TRAINSET_SIZE 1024
+
+/** Seed of reservoir sampling of training samples: fixed, so training is reproducible */
+#define SPI_TRAINSET_SEED 0x7261696e73657421ULL
+
+/** Initial number of buckets in flow hash table (power of 2) */
+#define SPI_FLOWTABLE_SIZE 1024
+
+/** Max number of worker threads */
+#define SPI_WORKERS_MAX 64
+
+/** Number of packets queued for a worker thread (power of 2) */
+#define SPI_WORKER_QUEUE 4096
+
+/** Number of results queued by a worker thread (power of 2) */
+#define SPI_WORKER_REPLIES 256
+
+/** Number of packets queued between two worker threads reading fanout sockets (power of 2) */
+#define SPI_WORKER_MESH 512
+
+/** Max number of fanout sockets read by single worker thread */
+#define SPI_WORKER_RINGS 8
+
 /** Delay in ms between registering first training sample and actual training */
 #define SPI_TRAINING_DELAY 3000
 
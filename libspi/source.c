@@ -4,12 +4,22 @@
  * This software is licensed under GNU GPL version 3
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
 #include <event2/event.h>
 #include <pcap.h>
 
 /* for parsing libpcap packets */
 #define __FAVOR_BSD
 #include <net/if.h>
+#include <net/if_arp.h>
 #include <arpa/inet.h>
 #include <net/ethernet.h>
 #include <netinet/ip.h>
@@ -20,6 +30,7 @@
 #include "spi.h"
 #include "ep.h"
 #include "flow.h"
+#include "worker.h"
 
 #define TCP_EPA_SRC(ip, tcp) (((uint64_t) SPI_PROTO_TCP << 48) | ((uint64_t) (ip)->ip_src.s_addr << 16) | ntohs((tcp)->th_sport))
 #define TCP_EPA_DST(ip, tcp) (((uint64_t) SPI_PROTO_TCP << 48) | ((uint64_t) (ip)->ip_dst.s_addr << 16) | ntohs((tcp)->th_dport))
@@ -50,7 +61,29 @@ static int _pcap_add_filter(struct spi_source *source, pcap_t *pcap, const char
 	return 0;
 }
 
-static void _parse_new_packet(struct spi_source *source,
+/** Compile pcap filter for Ethernet frames, without a pcap handler
+ * @param snaplen    max number of bytes the filter returns
+ * @retval -1        compilation error (see dbg messages) */
+static int _pcap_compile(struct bpf_program *cf, const char *filter, int snaplen)
+{
+	pcap_t *pcap;
+	int rc = 0;
+
+	if (!filter)
+		filter = SPI_PCAP_DEFAULT_FILTER;
+
+	pcap = pcap_open_dead(DLT_EN10MB, snaplen);
+	if (pcap_compile(pcap, cf, filter, 1, PCAP_NETMASK_UNKNOWN) == -1)
+		rc = _pcap_err(pcap, "pcap_compile()", filter);
+
+	pcap_close(pcap);
+	return rc;
+}
+
+/** Parse packet and pass it to its endpoints
+ * @param spi        owner of flows: spi root or worker shard reading a fanout socket
+ */
+static void _parse_new_packet(struct spi *spi, struct spi_source *source,
 	const struct timeval *tstamp, uint16_t pktlen, uint8_t *msg, uint16_t msglen)
 {
 #define PTROK(ptr, s) ((((uint8_t *) ptr) + (s) - msg) <= msglen)
@@ -59,6 +92,9 @@ static void _parse_new_packet(struct spi_source *source,
 	uint16_t iplen;
 	struct tcphdr *tcp;
 	struct udphdr *udp;
+	struct spi_flow *flow;
+	bool closed;
+	int counter;
 	uint8_t *data;
 	spi_epaddr_t src, dst;
 
@@ -107,15 +143,24 @@ static void _parse_new_packet(struct spi_source *source,
 			dst = TCP_EPA_DST(ip, tcp);
 
 			/* catch FIN/RST flags ASAP */
-			flow_tcp_flags(source, src, dst, tcp);
+			flow = flow_get(spi, source, src, dst);
+			closed = flow_tcp_flags(flow, src, dst, tcp);
 
 			/* check if at least N bytes */
 			data = ((uint8_t *) tcp) + tcp->th_off * 4;
-			if (!PTROK(data, source->spi->options.N))
+			if (!PTROK(data, spi->options.N)) {
+				if (closed)
+					flow_remove(spi, flow);
 				return;
+			}
+
+			/* count the packet, drop closed connection right away */
+			counter = flow_count(spi, source, flow, src, dst, tstamp);
+			if (closed)
+				flow_remove(spi, flow);
 
 			/* enforce the P limit */
-			if (flow_count(source, src, dst, tstamp) > source->spi->options.P)
+			if (counter > spi->options.P)
 				return;
 
 			break;
@@ -130,7 +175,7 @@ static void _parse_new_packet(struct spi_source *source,
 
 			/* check if at least N bytes */
 			data = ((uint8_t *) udp) + sizeof *udp;
-			if (!PTROK(data, source->spi->options.N))
+			if (!PTROK(data, spi->options.N))
 				return;
 
 			break;
@@ -143,8 +188,13 @@ static void _parse_new_packet(struct spi_source *source,
 	}
 
 	/* XXX: add at both endpoints */
-	ep_new_pkt(source, src, tstamp, data, pktlen);
-	ep_new_pkt(source, dst, tstamp, data, pktlen);
+	if (spi->wdata) {
+		worker_pkt(spi, source, src, tstamp, data, pktlen);
+		worker_pkt(spi, source, dst, tstamp, data, pktlen);
+	} else {
+		ep_new_pkt(spi, source, src, tstamp, data, pktlen);
+		ep_new_pkt(spi, source, dst, tstamp, data, pktlen);
+	}
 }
 
 static void _pcap_callback(u_char *arg, const struct pcap_pkthdr *msginfo, const u_char *msg)
@@ -153,21 +203,8 @@ static void _pcap_callback(u_char *arg, const struct pcap_pkthdr *msginfo, const
 
 	source->counter++;
 
-	/* move virtual time forward */
-	if (source->type == SPI_SOURCE_FILE) {
-		memcpy(&source->as.file.time, &msginfo->ts, sizeof(struct timeval));
-
-		/* suggest garbage collector each virtual SPI_GC_INTERVAL seconds */
-		if (source->as.file.gctime.tv_sec == 0) {
-			source->as.file.gctime.tv_sec = source->as.file.time.tv_sec;
-		} else if (source->as.file.gctime.tv_sec + SPI_GC_INTERVAL < source->as.file.time.tv_sec) {
-			spi_announce(source->spi, "gcSuggestion", 0, NULL, false);
-			source->as.file.gctime.tv_sec = source->as.file.time.tv_sec;
-		}
-	}
-
 	/* NB: assuming Ethernet header starts at msg[0] */
-	_parse_new_packet(source,
+	_parse_new_packet(source->spi, source,
 		&msginfo->ts, msginfo->len,
 		(uint8_t *) msg, MIN(msginfo->caplen, msginfo->len));
 }
@@ -179,12 +216,7 @@ static inline void _pcap_read(struct spi_source *source, pcap_t *pcap)
 			source_close(source);
 			return;
 		case -1: /* error */
-			if (source->type == SPI_SOURCE_FILE)
-				_pcap_err(pcap, "pcap_dispatch()", source->as.file.path);
-			else if (source->type == SPI_SOURCE_SNIFF)
-				_pcap_err(pcap, "pcap_dispatch()", source->as.sniff.ifname);
-			else
-				_pcap_err(pcap, "pcap_dispatch()", "a pcap source");
+			_pcap_err(pcap, "pcap_dispatch()", source->as.sniff.ifname);
 			return;
 		case -2: /* break loop (?!) */
 			die("pcap_dispatch() returned -2\n");
@@ -204,10 +236,13 @@ void source_close(struct spi_source *source)
 		case SPI_SOURCE_SNIFF:
 			source_sniff_close(source);
 			break;
+		case SPI_SOURCE_RING:
+			source_ring_close(source);
+			break;
 	}
 
-	spi_announce(source->spi, "gcSuggestion", 0, NULL, false);
-	spi_announce(source->spi, "sourceClosed", 0, source, false);
+	spi_announce_id(source->spi, SPI_EV_GC_SUGGESTION, 0, NULL, false);
+	spi_announce_id(source->spi, SPI_EV_SOURCE_CLOSED, 0, source, false);
 }
 
 void source_destroy(struct spi_source *source)
@@ -218,39 +253,348 @@ void source_destroy(struct spi_source *source)
 
 /******/
 
+/** Read 16-bit value in file byte order */
+static inline uint16_t _file_u16(struct spi_source *source, const uint8_t *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof v);
+	return source->as.file.swap ? __builtin_bswap16(v) : v;
+}
+
+/** Read 32-bit value in file byte order */
+static inline uint32_t _file_u32(struct spi_source *source, const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof v);
+	return source->as.file.swap ? __builtin_bswap32(v) : v;
+}
+
+/** Read 64-bit value in file byte order */
+static inline uint64_t _file_u64(struct spi_source *source, const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof v);
+	return source->as.file.swap ? __builtin_bswap64(v) : v;
+}
+
+/** Register capture interface: the single one of pcap file or next one of pcapng section */
+static void _file_if_add(struct spi_source *source, uint16_t linktype, uint64_t tsunits, int64_t tsoffset)
+{
+	struct spi_pcapif *ifs;
+
+	if (source->as.file.ifs_num == source->as.file.ifs_size) {
+		source->as.file.ifs_size = MAX(4, source->as.file.ifs_size * 2);
+		ifs = mmatic_alloc(source->spi->mm, sizeof(struct spi_pcapif) * source->as.file.ifs_size);
+
+		if (source->as.file.ifs) {
+			memcpy(ifs, source->as.file.ifs, sizeof(struct spi_pcapif) * source->as.file.ifs_num);
+			mmatic_free(source->as.file.ifs);
+		}
+
+		source->as.file.ifs = ifs;
+	}
+
+	if (linktype != DLT_EN10MB)
+		dbg(1, "%s: skipping packets of link type %u\n", source->as.file.path, linktype);
+
+	ifs = &source->as.file.ifs[source->as.file.ifs_num++];
+	ifs->linktype = linktype;
+	ifs->tsunits = tsunits;
+	ifs->tsoffset = tsoffset;
+}
+
+/** Handle packet record of file
+ * @param spi        spi root, or shard for offline learning */
+static void _file_packet(struct spi *spi, struct spi_source *source, int ifid, uint64_t ts,
+	uint32_t caplen, uint32_t len, const uint8_t *data)
+{
+	struct spi_pcapif *pif;
+	struct pcap_pkthdr hdr;
+
+	source->counter++;
+
+	if (ifid >= source->as.file.ifs_num) {
+		dbg(5, "%s: packet of unknown interface %d\n", source->as.file.path, ifid);
+		return;
+	}
+
+	pif = &source->as.file.ifs[ifid];
+
+	/* move virtual time forward */
+	source->as.file.time.tv_sec = ts / pif->tsunits + pif->tsoffset;
+	source->as.file.time.tv_usec = (double) (ts % pif->tsunits) * 1000000.0 / pif->tsunits;
+
+	/* suggest garbage collector each virtual SPI_GC_INTERVAL seconds */
+	if (source->as.file.gctime.tv_sec == 0) {
+		source->as.file.gctime.tv_sec = source->as.file.time.tv_sec;
+	} else if (source->as.file.gctime.tv_sec + SPI_GC_INTERVAL < source->as.file.time.tv_sec) {
+		spi_announce_id(spi, SPI_EV_GC_SUGGESTION, 0, NULL, false);
+		source->as.file.gctime.tv_sec = source->as.file.time.tv_sec;
+	}
+
+	if (pif->linktype != DLT_EN10MB)
+		return;
+
+	hdr.ts = source->as.file.time;
+	hdr.caplen = caplen;
+	hdr.len = len;
+	if (!pcap_offline_filter(&source->as.file.filter, &hdr, data))
+		return;
+
+	_parse_new_packet(spi, source, &source->as.file.time, len,
+		(uint8_t *) data, MIN(caplen, len));
+}
+
+/** Handle next record of classic pcap file
+ * @retval -1        end of file */
+static int _pcap_next(struct spi *spi, struct spi_source *source)
+{
+	const uint8_t *p = source->as.file.map + source->as.file.pos;
+	size_t left = source->as.file.size - source->as.file.pos;
+	uint32_t caplen, len;
+	uint64_t ts;
+
+	if (left < 16 || left - 16 < (caplen = _file_u32(source, p + 8))) {
+		if (left > 0)
+			dbg(1, "%s: truncated packet record at offset %zu\n", source->as.file.path, source->as.file.pos);
+		return -1;
+	}
+
+	len = _file_u32(source, p + 12);
+	ts = (uint64_t) _file_u32(source, p) * source->as.file.ifs[0].tsunits + _file_u32(source, p + 4);
+
+	source->as.file.pos += 16 + caplen;
+	_file_packet(spi, source, 0, ts, caplen, len, p + 16);
+	return 0;
+}
+
+/** Parse pcapng Interface Description Block */
+static void _pcapng_idb(struct spi_source *source, const uint8_t *p, uint32_t blen)
+{
+	const uint8_t *opt = p + 16, *end = p + blen - 4;
+	uint16_t code, olen;
+	uint64_t tsunits = 1000000;
+	int64_t tsoffset = 0;
+	uint8_t res;
+
+	while (opt + 4 <= end) {
+		code = _file_u16(source, opt);
+		olen = _file_u16(source, opt + 2);
+		if (code == 0 || opt + 4 + olen > end)
+			break;
+
+		switch (code) {
+			case 9: /* if_tsresol: 10^-v or 2^-v */
+				res = opt[4];
+				if (res & 0x80)
+					tsunits = 1ULL << MIN(res & 0x7f, 63);
+				else
+					for (tsunits = 1; res > 0 && tsunits <= UINT64_MAX / 10; res--)
+						tsunits *= 10;
+				break;
+			case 14: /* if_tsoffset */
+				if (olen == 8)
+					tsoffset = (int64_t) _file_u64(source, opt + 4);
+				break;
+		}
+
+		opt += 4 + ((olen + 3) & ~3);
+	}
+
+	_file_if_add(source, _file_u16(source, p + 8), tsunits, tsoffset);
+}
+
+/** Handle next block of pcapng file
+ * @retval -1        end of file */
+static int _pcapng_next(struct spi *spi, struct spi_source *source)
+{
+	const uint8_t *p = source->as.file.map + source->as.file.pos;
+	size_t left = source->as.file.size - source->as.file.pos;
+	uint32_t type, blen, caplen, len, bom;
+	uint64_t ts;
+
+	if (left < 12)
+		goto end;
+
+	/* NB: block type of SHB reads the same in both byte orders */
+	memcpy(&type, p, sizeof type);
+	if (type == 0x0A0D0D0A) {
+		memcpy(&bom, p + 8, sizeof bom);
+		if (bom == 0x1A2B3C4D)
+			source->as.file.swap = false;
+		else if (bom == 0x4D3C2B1A)
+			source->as.file.swap = true;
+		else
+			goto end;
+
+		/* new section: new interfaces */
+		source->as.file.ifs_num = 0;
+	} else {
+		type = _file_u32(source, p);
+	}
+
+	blen = _file_u32(source, p + 4);
+	if (blen < 12 || blen % 4 != 0 || blen > left)
+		goto end;
+
+	switch (type) {
+		case 1: /* Interface Description Block */
+			if (blen >= 20)
+				_pcapng_idb(source, p, blen);
+			break;
+		case 6: /* Enhanced Packet Block */
+		case 2: /* Packet Block (obsolete) */
+			if (blen < 32)
+				break;
+
+			caplen = _file_u32(source, p + 20);
+			len = _file_u32(source, p + 24);
+			if (caplen > blen - 32)
+				break;
+
+			ts = ((uint64_t) _file_u32(source, p + 12) << 32) | _file_u32(source, p + 16);
+			_file_packet(spi, source, type == 6 ? _file_u32(source, p + 8) : _file_u16(source, p + 8),
+				ts, caplen, len, p + 28);
+			break;
+		case 3: /* Simple Packet Block: no timestamp */
+			if (blen < 16 || source->as.file.ifs_num == 0)
+				break;
+
+			len = _file_u32(source, p + 8);
+			ts = (uint64_t) (source->as.file.time.tv_sec - source->as.file.ifs[0].tsoffset) *
+				source->as.file.ifs[0].tsunits;
+			_file_packet(spi, source, 0, ts, MIN(len, blen - 16), len, p + 12);
+			break;
+	}
+
+	source->as.file.pos += blen;
+	return 0;
+
+end:
+	if (left > 0)
+		dbg(1, "%s: truncated or invalid block at offset %zu\n", source->as.file.path, source->as.file.pos);
+	return -1;
+}
+
+/** Handle next record of file
+ * @retval -1        end of file */
+static inline int _file_next(struct spi *spi, struct spi_source *source)
+{
+	return source->as.file.ng ? _pcapng_next(spi, source) : _pcap_next(spi, source);
+}
+
 int source_file_init(struct spi_source *source, const char *args)
 {
-	char errbuf[PCAP_ERRBUF_SIZE];
-	FILE *stream;
 	char *path, *filter;
+	struct stat st;
+	uint32_t magic;
+	uint8_t *map;
+	int fd;
 
 	path = mmatic_strdup(source->spi->mm, args);
 	filter = strchr(path, ' ');
 	if (filter) *filter++ = '\0';
 
-	source->as.file.pcap = pcap_open_offline(path, errbuf);
-	if (!source->as.file.pcap) {
-		dbg(0, "pcap_open_offline(): %s\n", errbuf);
+	source->as.file.path = path;
+
+	if (_pcap_compile(&source->as.file.filter, filter, 65535) != 0)
 		return -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		dbg(0, "%s: %s\n", path, strerror(errno));
+		goto err_filter;
 	}
 
-	stream = pcap_file(source->as.file.pcap);
-	if (!stream) {
-		dbg(0, "pcap_file(): stream=NULL\n");
-		return -1;
+	if (fstat(fd, &st) != 0 || st.st_size < 24) {
+		dbg(0, "%s: not a pcap file\n", path);
+		goto err_fd;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		dbg(0, "%s: mmap(): %s\n", path, strerror(errno));
+		goto err_fd;
 	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
 
-	dbg(1, "pcap file %s opened\n", path);
+	source->as.file.map = map;
+	source->as.file.size = st.st_size;
 
-	source->as.file.path = path;
-	source->fd = fileno(stream);
-	return _pcap_add_filter(source, source->as.file.pcap, filter);
+	/* detect the format */
+	memcpy(&magic, map, sizeof magic);
+	switch (magic) {
+		case 0xa1b2c3d4: /* pcap, microseconds */
+		case 0xa1b23c4d: /* pcap, nanoseconds */
+			source->as.file.swap = false;
+			break;
+		case 0xd4c3b2a1:
+		case 0x4d3cb2a1:
+			source->as.file.swap = true;
+			magic = __builtin_bswap32(magic);
+			break;
+		case 0x0A0D0D0A: /* pcapng */
+			source->as.file.ng = true;
+			break;
+		default:
+			dbg(0, "%s: unknown file format\n", path);
+			goto err_map;
+	}
+
+	if (!source->as.file.ng) {
+		_file_if_add(source, _file_u32(source, map + 20), magic == 0xa1b23c4d ? 1000000000 : 1000000, 0);
+		source->as.file.pos = 24;
+	}
+
+	dbg(1, "pcap%s file %s opened\n", source->as.file.ng ? "ng" : "", path);
+
+	/* NB: used as source id, so keep the fd open */
+	source->fd = fd;
+	return 0;
+
+err_map:
+	munmap(map, st.st_size);
+err_fd:
+	close(fd);
+err_filter:
+	pcap_freecode(&source->as.file.filter);
+	return -1;
 }
 
 void source_file_read(int fd, short evtype, void *arg)
 {
 	struct spi_source *source = arg;
-	_pcap_read(source, source->as.file.pcap);
+	struct timeval tv = { 0, 0 };
+	int i;
+
+	for (i = 0; i < SPI_FILE_BATCH; i++) {
+		if (_file_next(source->spi, source) < 0) {
+			source_close(source);
+			return;
+		}
+	}
+
+	/* continue after the event loop handles spi events */
+	event_add(source->evread, &tv);
+}
+
+void source_file_learn(struct spi *spi, struct spi_source *source)
+{
+	int i = 0;
+
+	while (_file_next(spi, source) == 0) {
+		/* handle events each SPI_PCAP_MAX packets, like the main loop */
+		if (++i == SPI_PCAP_MAX) {
+			spi_dispatch(spi);
+			i = 0;
+		}
+	}
+
+	spi_dispatch(spi);
+	source_file_close(source);
 }
 
 void source_file_close(struct spi_source *source)
@@ -263,7 +607,9 @@ void source_file_close(struct spi_source *source)
 		source->evread = NULL;
 	}
 
-	pcap_close(source->as.file.pcap);
+	munmap(source->as.file.map, source->as.file.size);
+	close(source->fd);
+	pcap_freecode(&source->as.file.filter);
 	source->as.file.time.tv_sec = -1;  /* = set virtual "now" to infinity */
 
 	dbg(1, "pcap file %s finished and closed\n", source->as.file.path);
@@ -318,3 +664,266 @@ void source_sniff_close(struct spi_source *source)
 	dbg(2, "  read %u packets, %u samples (learned %u), %u endpoints\n",
 		source->counter, source->signatures, source->learned, source->eps);
 }
+
+/******/
+
+/** Compile pcap filter and attach it to AF_PACKET socket */
+static int _ring_add_filter(int fd, const char *filter)
+{
+	struct bpf_program cf;
+	struct sock_fprog fp;
+	int rc = 0;
+
+	/* NB: filter returns at most SPI_PCAP_SNAPLEN bytes, which truncates the frames in ring */
+	if (_pcap_compile(&cf, filter, SPI_PCAP_SNAPLEN) != 0)
+		return -1;
+
+	fp.len = cf.bf_len;
+	fp.filter = (struct sock_filter *) cf.bf_insns;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fp, sizeof fp) < 0) {
+		dbg(0, "setsockopt(SO_ATTACH_FILTER): %s\n", strerror(errno));
+		rc = -1;
+	}
+
+	pcap_freecode(&cf);
+	return rc;
+}
+
+/** Open AF_PACKET socket with rx ring
+ * @param ifindex    interface index
+ * @param filter     pcap filter or NULL
+ * @param fanout     PACKET_FANOUT group id or -1
+ * @retval -1        error (see dbg messages)
+ */
+static int _ring_open(struct spi_ring *rx, int ifindex, const char *filter, int fanout)
+{
+	int fd, v = TPACKET_V3;
+	struct tpacket_req3 req;
+	struct packet_mreq mr;
+	struct sockaddr_ll sll;
+	uint8_t *map;
+
+	/* NB: protocol 0 = no packets until bind(), so nothing bypasses the filter */
+	fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if (fd < 0) {
+		dbg(0, "socket(AF_PACKET): %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &v, sizeof v) < 0) {
+		dbg(0, "setsockopt(PACKET_VERSION): %s\n", strerror(errno));
+		goto err;
+	}
+
+	if (_ring_add_filter(fd, filter) != 0)
+		goto err;
+
+	/* setup the ring */
+	memset(&req, 0, sizeof req);
+	req.tp_block_size = SPI_RING_BLOCK_SIZE;
+	req.tp_block_nr = SPI_RING_BLOCKS;
+	req.tp_frame_size = SPI_RING_FRAME_SIZE;
+	req.tp_frame_nr = (SPI_RING_BLOCK_SIZE / SPI_RING_FRAME_SIZE) * SPI_RING_BLOCKS;
+	req.tp_retire_blk_tov = SPI_RING_TIMEOUT;
+
+	if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof req) < 0) {
+		dbg(0, "setsockopt(PACKET_RX_RING): %s\n", strerror(errno));
+		goto err;
+	}
+
+	map = mmap(NULL, (size_t) req.tp_block_size * req.tp_block_nr,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, fd, 0);
+	if (map == MAP_FAILED) {
+		dbg(0, "mmap(): %s\n", strerror(errno));
+		goto err;
+	}
+
+	rx->fd = fd;
+	rx->map = map;
+	rx->block_size = req.tp_block_size;
+	rx->block_nr = req.tp_block_nr;
+	rx->block = 0;
+
+	memset(&sll, 0, sizeof sll);
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = ifindex;
+	if (bind(fd, (struct sockaddr *) &sll, sizeof sll) < 0) {
+		dbg(0, "bind(): %s\n", strerror(errno));
+		goto err_map;
+	}
+
+	/* let kernel hash flows (both directions alike) on sockets in the group */
+	if (fanout >= 0) {
+		v = fanout | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+		if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &v, sizeof v) < 0) {
+			dbg(0, "setsockopt(PACKET_FANOUT): group %d: %s\n", fanout, strerror(errno));
+			goto err_map;
+		}
+	}
+
+	/* promiscuous mode, as pcap_open_live() */
+	memset(&mr, 0, sizeof mr);
+	mr.mr_ifindex = ifindex;
+	mr.mr_type = PACKET_MR_PROMISC;
+	if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof mr) < 0)
+		dbg(1, "promiscuous mode failed: %s\n", strerror(errno));
+
+	return 0;
+
+err_map:
+	munmap(map, (size_t) req.tp_block_size * req.tp_block_nr);
+err:
+	close(fd);
+	return -1;
+}
+
+/** Close socket opened by _ring_open()
+ * @return number of packets dropped by kernel */
+static unsigned int _ring_close(struct spi_ring *rx)
+{
+	struct tpacket_stats_v3 st;
+	socklen_t len = sizeof st;
+
+	memset(&st, 0, sizeof st);
+	getsockopt(rx->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len);
+
+	munmap(rx->map, (size_t) rx->block_size * rx->block_nr);
+	close(rx->fd);
+
+	return st.tp_drops;
+}
+
+int source_ring_init(struct spi_source *source, const char *args)
+{
+	struct spi_ring *rx;
+	char *ifname, *filter, *group;
+	unsigned int ifindex;
+	int i, num = 1, fanout = -1;
+
+	ifname = mmatic_strdup(source->spi->mm, args);
+	filter = strchr(ifname, ' ');
+	if (filter) *filter++ = '\0';
+
+	/* fanout group: one socket per worker thread */
+	group = strchr(ifname, '@');
+	if (group) {
+		*group++ = '\0';
+		fanout = atoi(group) & 0xffff;
+
+		if (source->spi->wdata)
+			num = worker_count(source->spi);
+	}
+
+	ifindex = if_nametoindex(ifname);
+	if (ifindex == 0) {
+		dbg(0, "%s: no such interface\n", ifname);
+		return -1;
+	}
+
+	rx = mmatic_zalloc(source->spi->mm, sizeof(struct spi_ring) * num);
+	for (i = 0; i < num; i++) {
+		if (_ring_open(&rx[i], ifindex, filter, fanout) != 0) {
+			dbg(0, "%s: opening socket %d failed\n", ifname, i);
+			while (i-- > 0)
+				_ring_close(&rx[i]);
+			return -1;
+		}
+	}
+
+	source->as.ring.ifname = ifname;
+	source->as.ring.fanout = fanout;
+	source->as.ring.num = num;
+	source->as.ring.rx = rx;
+
+	if (num > 1) {
+		/* NB: sockets are read by worker threads, not by the event loop */
+		source->fd = -1;
+		if (worker_ring(source) != 0) {
+			for (i = 0; i < num; i++)
+				_ring_close(&rx[i]);
+			return -1;
+		}
+
+		dbg(1, "interface %s opened (mmap ring, fanout group %d, %d sockets)\n", ifname, fanout, num);
+	} else {
+		source->fd = rx[0].fd;
+		dbg(1, "interface %s opened (mmap ring)\n", ifname);
+	}
+
+	return 0;
+}
+
+int source_ring_block(struct spi *spi, struct spi_source *source, struct spi_ring *rx)
+{
+	struct tpacket_block_desc *bd;
+	struct tpacket3_hdr *hdr;
+	struct sockaddr_ll *sll;
+	struct timeval ts;
+	uint32_t i, num, counter = 0;
+
+	bd = (struct tpacket_block_desc *) (rx->map + (size_t) rx->block * rx->block_size);
+	if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+		return 0;
+
+	/* parse frames in place */
+	num = bd->hdr.bh1.num_pkts;
+	hdr = (struct tpacket3_hdr *) ((uint8_t *) bd + bd->hdr.bh1.offset_to_first_pkt);
+	for (i = 0; i < num; i++,
+	     hdr = (struct tpacket3_hdr *) ((uint8_t *) hdr + hdr->tp_next_offset)) {
+		/* skip outgoing copies on loopback, as libpcap does */
+		sll = (struct sockaddr_ll *) ((uint8_t *) hdr + TPACKET_ALIGN(sizeof *hdr));
+		if (sll->sll_pkttype == PACKET_OUTGOING && sll->sll_hatype == ARPHRD_LOOPBACK)
+			continue;
+
+		counter++;
+
+		ts.tv_sec = hdr->tp_sec;
+		ts.tv_usec = hdr->tp_nsec / 1000;
+
+		_parse_new_packet(spi, source, &ts, hdr->tp_len,
+			(uint8_t *) hdr + hdr->tp_mac, MIN(hdr->tp_snaplen, hdr->tp_len));
+	}
+
+	/* give the block back to kernel */
+	__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+	rx->block = (rx->block + 1) % rx->block_nr;
+
+	/* NB: sockets of a fanout group are read in parallel */
+	__atomic_add_fetch(&source->counter, counter, __ATOMIC_RELAXED);
+
+	return num;
+}
+
+void source_ring_read(int fd, short evtype, void *arg)
+{
+	struct spi_source *source = arg;
+
+	/* NB: one block per call, let the event loop handle spi events in between;
+	 * fd stays readable while more blocks are ready */
+	source_ring_block(source->spi, source, &source->as.ring.rx[0]);
+}
+
+void source_ring_close(struct spi_source *source)
+{
+	unsigned int drops = 0;
+	int i;
+
+	source->closed = true;
+
+	if (source->evread) {
+		event_del(source->evread);
+		event_free(source->evread);
+		source->evread = NULL;
+	}
+
+	/* NB: worker threads reading the sockets are stopped in spi_free() before */
+	for (i = 0; i < source->as.ring.num; i++)
+		drops += _ring_close(&source->as.ring.rx[i]);
+
+	dbg(1, "ring source %s finished and closed\n", source->as.ring.ifname);
+	dbg(2, "  read %u packets, %u samples (learned %u), %u endpoints\n",
+		source->counter, source->signatures, source->learned, source->eps);
+	dbg(2, "  kernel dropped %u packets\n", drops);
+}
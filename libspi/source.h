@@ -15,15 +15,21 @@ void source_close(struct spi_source *source);
 /** Destroy source memory */
 void source_destroy(struct spi_source *source);
 
-/** Initialize a PCAP file source
- * @param args    just file path
- * @retval -1     pcap error (see dbg messages)
+/** Initialize a pcap or pcapng file source: mmap the file
+ * @param args    file path and optional pcap filter
+ * @retval -1     file or filter error (see dbg messages)
  */
 int source_file_init(struct spi_source *source, const char *args);
 
-/** Handle new packets on a PCAP file source */
+/** Handle next SPI_FILE_BATCH packet records of a file source, in place
+ * Reschedules itself until end of file. */
 void source_file_read(int fd, short evtype, void *arg);
 
+/** Read whole file source in current thread, then close it
+ * @param spi     shard for offline learning: gets all endpoints, flows and events
+ */
+void source_file_learn(struct spi *spi, struct spi_source *source);
+
 /** Close a file source */
 void source_file_close(struct spi_source *source);
 
@@ -39,4 +45,25 @@ void source_sniff_read(int fd, short evtype, void *arg);
 /** Close a sniff source */
 void source_sniff_close(struct spi_source *source);
 
+/** Initialize a live AF_PACKET TPACKET_V3 mmap ring source
+ * In worker mode, "<interface>@<group>" opens one socket per worker thread, all in
+ * PACKET_FANOUT group <group>, and the sockets are read by the worker threads.
+ * @param args    interface with optional fanout group, and optional pcap filter
+ * @retval -1     socket or ring setup error (see dbg messages)
+ */
+int source_ring_init(struct spi_source *source, const char *args);
+
+/** Parse one ready block of ring in place and give it back to the kernel
+ * @param spi     owner of flows: spi root or worker shard reading the socket
+ * @param rx      ring of one of the source sockets
+ * @return        number of frames in block (0 if no block ready)
+ */
+int source_ring_block(struct spi *spi, struct spi_source *source, struct spi_ring *rx);
+
+/** Handle new packets on a ring source: parse one ring block */
+void source_ring_read(int fd, short evtype, void *arg);
+
+/** Close a ring source */
+void source_ring_close(struct spi_source *source);
+
 #endif
@@ -17,6 +17,10 @@
 #include "flow.h"
 #include "kissp.h"
 #include "verdict.h"
+#include "worker.h"
+#include "wheel.h"
+#include "pool.h"
+#include "trainset.h"
 
 /* Check if there is still something to do, otherwise announce "finished" */
 static bool _check_if_finished(struct spi *spi, const char *evname, void *data)
@@ -25,7 +29,11 @@ static bool _check_if_finished(struct spi *spi, const char *evname, void *data)
 	int sources = 0;
 
 	/* still some traindata waiting to be used */
-	if (spi_pending(spi, "traindataUpdated"))
+	if (spi_pending_id(spi, SPI_EV_TRAINDATA_UPDATED) || kissp_training(spi))
+		return true;
+
+	/* workers still handling packets of closed sources */
+	if (worker_busy(spi))
 		return true;
 
 	/* traindata queue empty? */
@@ -42,28 +50,115 @@ static bool _check_if_finished(struct spi *spi, const char *evname, void *data)
 		return true;
 
 	/* everything ready */
-	spi_announce(spi, "finished", 0, NULL, false);
+	spi_announce_id(spi, SPI_EV_FINISHED, 0, NULL, false);
 
 	return true;
 }
 
-static void _subscriber_free(void *arg)
+/** Names of built-in events, indexed by spi_evid_t */
+static const char *_builtin[SPI_EV_BUILTIN] = {
+	[SPI_EV_ENDPOINT_PACKETS_READY]   = "endpointPacketsReady",
+	[SPI_EV_ENDPOINT_CLASSIFICATION]  = "endpointClassification",
+	[SPI_EV_ENDPOINT_VERDICT_CHANGED] = "endpointVerdictChanged",
+	[SPI_EV_CLASSIFIER_BATCH_READY]   = "classifierBatchReady",
+	[SPI_EV_TRAINDATA_UPDATED]        = "traindataUpdated",
+	[SPI_EV_CLASSIFIER_MODEL_UPDATED] = "classifierModelUpdated",
+	[SPI_EV_CLASSIFIER_TRAINING_FAILED] = "classifierTrainingFailed",
+	[SPI_EV_GC_SUGGESTION]            = "gcSuggestion",
+	[SPI_EV_SOURCE_CLOSED]            = "sourceClosed",
+	[SPI_EV_WORKERS_SYNCED]           = "workersSynced",
+	[SPI_EV_FINISHED]                 = "finished",
+};
+
+/** Create event registry with built-in events */
+static void _events_init(struct spi *spi)
+{
+	int i;
+
+	spi->evids = thash_create_strkey(NULL, spi->mm);
+
+	for (i = 0; i < SPI_EV_BUILTIN; i++)
+		spi_event(spi, _builtin[i]);
+}
+
+/** Free event registry */
+static void _events_free(struct spi *spi)
+{
+	int i;
+
+	for (i = 0; i < spi->events_num; i++) {
+		mmatic_free(spi->events[i].evname);
+		if (spi->events[i].hl.cb)
+			mmatic_free(spi->events[i].hl.cb);
+		if (spi->events[i].ahl.cb)
+			mmatic_free(spi->events[i].ahl.cb);
+	}
+
+	if (spi->events)
+		mmatic_free(spi->events);
+
+	thash_free(spi->evids);
+}
+
+/** Get handler list of event */
+static inline struct spi_handlers *_handlers(struct spi *spi, spi_evid_t evid, bool after)
+{
+	return after ? &spi->events[evid].ahl : &spi->events[evid].hl;
+}
+
+/** Call handlers of event, unsubscribe those returning false
+ * NB: handlers may register new events, which can move the events array */
+static void _handle_list(struct spi *spi, spi_evid_t evid, bool after, void *arg)
+{
+	struct spi_handlers *hl;
+	uint32_t i = 0;
+
+	while (i < _handlers(spi, evid, after)->num) {
+		if (_handlers(spi, evid, after)->cb[i](spi, spi->events[evid].evname, arg)) {
+			i++;
+			continue;
+		}
+
+		/* unsubscribe, keeping the order */
+		hl = _handlers(spi, evid, after);
+		hl->num--;
+		memmove(&hl->cb[i], &hl->cb[i + 1], (hl->num - i) * sizeof *hl->cb);
+	}
+}
+
+struct spi_signature *spi_signature_new(struct spi *spi, int num)
 {
-	struct spi_subscribers *ss = arg;
+	struct spi_signature *sign;
 
-	tlist_free(ss->hl);
-	tlist_free(ss->ahl);
-	mmatic_free(ss);
+	sign = pool_get(&spi->sign_pool, sizeof *sign + num * sizeof(struct spi_coordinate));
+	sign->label = 0;
+	sign->c = (struct spi_coordinate *) (sign + 1);
+	sign->pool = &spi->sign_pool;
+
+	return sign;
 }
 
 void spi_signature_free(void *arg)
 {
 	struct spi_signature *sign = arg;
 
+	if (sign->pool) {
+		pool_put(sign->pool, sign);
+		return;
+	}
+
 	mmatic_free(sign->c);
 	mmatic_free(sign);
 }
 
+int spi_signature_features(struct spi *spi)
+{
+	if (spi->options.kiss_std)
+		return spi->options.N * 2;
+	else
+		return spi->options.N * 2 + SPI_KISSP_FEATURES;
+}
+
 /** Setup default options */
 static void _options_defaults(struct spi *spi)
 {
@@ -71,50 +166,70 @@ static void _options_defaults(struct spi *spi)
 	spi->options.P = SPI_DEFAULT_P;
 	spi->options.C = SPI_DEFAULT_C;
 	spi->options.verdict_threshold = SPI_DEFAULT_VERDICT_THRESHOLD;
+	spi->options.train_quant = SPI_DEFAULT_TRAIN_QUANT;
+}
+
+/** Handle expiry check of endpoint or flow
+ * @param now        current time in the wheel time domain */
+static void _expire(struct spi *spi, struct spi_wheel *wheel, struct spi_wheel_entry *e, uint32_t now)
+{
+	struct spi_ep *ep;
+	struct spi_flow *flow;
+
+	switch (e->type) {
+		case SPI_WHEEL_EP:
+			/* already gone or rescheduled? */
+			ep = ep_table_get(spi->eps, e->source, e->epa1);
+			if (!ep || ep->expire != e->expire)
+				return;
+
+			/* check eps under use again in next run */
+			if (ep_pinned(ep))
+				wheel_retry(wheel, e);
+			else if (ep->last.tv_sec + SPI_EP_TIMEOUT < now)
+				ep_table_delete(spi->eps, ep);
+			else
+				ep->expire = wheel_add(wheel, e->type, e->source, e->epa1, 0,
+					now, ep->last.tv_sec + SPI_EP_TIMEOUT + 1);
+			break;
+
+		case SPI_WHEEL_FLOW:
+			/* NB: closed TCP connections are dropped in _parse_new_packet() */
+			flow = flow_get(spi, e->source, e->epa1, e->epa2);
+			if (!flow || flow->expire != e->expire)
+				return;
+
+			if (flow->last.tv_sec + SPI_FLOW_TIMEOUT < now)
+				flow_remove(spi, flow);
+			else
+				flow->expire = wheel_add(wheel, e->type, e->source, e->epa1, e->epa2,
+					now, flow->last.tv_sec + SPI_FLOW_TIMEOUT + 1);
+			break;
+	}
 }
 
 /** Garbage collector */
 static void _gc(int fd, short evtype, void *arg)
 {
 	struct spi *spi = arg;
-	const char *key;
-	struct spi_flow *flow;
-	struct spi_ep *ep;
+	struct spi_wheel *wheel;
+	struct spi_wheel_entry e;
 	struct timeval systime;
 	uint32_t now;
 
 	gettimeofday(&systime, NULL);
 
-	thash_iter_loop(spi->flows, key, flow) {
-		/* drop all closed TCP connections */
-		if (flow->rst == 3 || flow->fin == 3) {
-			thash_set(spi->flows, key, NULL);
-			continue;
-		}
-
-		/* check timeout */
-		if (flow->source->type == SPI_SOURCE_FILE)
-			now = flow->source->as.file.time.tv_sec;
-		else
-			now = systime.tv_sec;
-
-		if (flow->last.tv_sec + SPI_FLOW_TIMEOUT < now)
-			thash_set(spi->flows, key, NULL);
+	/* check eps and flows due to expire: file sources have own virtual time */
+	tlist_iter_loop(spi->wheels, wheel) {
+		/* NB: wheel time may be a bit ahead, e.g. after reordered packets */
+		now = MAX(wheel_time(wheel, &systime), wheel->now);
+		while (wheel_next(wheel, now, &e))
+			_expire(spi, wheel, &e, now);
 	}
 
-	thash_iter_loop(spi->eps, key, ep) {
-		/* skip eps under use */
-		if (ep->gclock1 || ep->gclock2 || ep->gclock3)
-			continue;
-
-		if (ep->source->type == SPI_SOURCE_FILE)
-			now = ep->source->as.file.time.tv_sec;
-		else
-			now = systime.tv_sec;
-
-		if (ep->last.tv_sec + SPI_EP_TIMEOUT < now)
-			thash_set(spi->eps, key, NULL);
-	}
+	/* collect endpoints kept by worker threads */
+	if (spi->wdata && !spi->root)
+		worker_gc(spi);
 }
 
 static bool _gc_suggested(struct spi *spi, const char *evname, void *data)
@@ -123,33 +238,103 @@ static bool _gc_suggested(struct spi *spi, const char *evname, void *data)
 	return true;
 }
 
-/** Handler for new spi events */
+/** Call subscribers of spi event */
+static void _handle(struct spi_event *se)
+{
+	struct spi *spi = se->spi;
+
+	if (spi_pending_id(spi, se->evid))
+		spi->events[se->evid].aggstatus = SPI_AGG_READY;
+
+	_handle_list(spi, se->evid, false, se->arg);
+	_handle_list(spi, se->evid, true, se->arg);
+
+	if (se->argfree)
+		mmatic_free(se->arg);
+}
+
+/** Handler for delayed spi events */
 static void _new_spi_event(int fd, short evtype, void *arg)
 {
 	struct spi_event *se = arg;
-	struct spi_subscribers *ss = se->ss;
-	struct spi *spi = se->spi;
-	union spi_ptr2eventcb_tool pf;
 
-	if (spi_pending(spi, se->evname))
-		ss->aggstatus = SPI_AGG_READY;
+	_handle(se);
+	mmatic_free(se);
+}
 
-	/* handler list */
-	tlist_iter_loop(se->ss->hl, pf.ptr) {
-		if (!pf.func(spi, se->evname, se->arg))
-			tlist_remove(se->ss->hl);
+/** Get record for new zero-delay event at the end of queue */
+static struct spi_event *_evqueue_push(struct spi *spi)
+{
+	struct spi_evqueue *q = &spi->evqueue;
+	struct spi_event *ev;
+	uint32_t first;
+
+	/* double the ring, oldest event goes to record 0 */
+	if (q->count == q->size) {
+		ev = mmatic_alloc(spi->mm, 2 * q->size * sizeof *ev);
+
+		first = q->size - q->head;
+		memcpy(ev, q->ev + q->head, first * sizeof *ev);
+		memcpy(ev + first, q->ev, q->head * sizeof *ev);
+
+		mmatic_free(q->ev);
+		q->ev = ev;
+		q->head = 0;
+		q->size *= 2;
 	}
 
-	/* after handler list */
-	tlist_iter_loop(se->ss->ahl, pf.ptr) {
-		if (!pf.func(spi, se->evname, se->arg))
-			tlist_remove(se->ss->ahl);
+	return &q->ev[(q->head + q->count++) & (q->size - 1)];
+}
+
+/** Handle up to num oldest queued events */
+static void _evqueue_handle(struct spi *spi, uint32_t num)
+{
+	struct spi_evqueue *q = &spi->evqueue;
+	struct spi_event se;
+
+	while (num-- > 0 && q->count > 0) {
+		/* NB: handlers may announce new events and move the ring */
+		memcpy(&se, &q->ev[q->head], sizeof se);
+		q->head = (q->head + 1) & (q->size - 1);
+		q->count--;
+
+		_handle(&se);
 	}
+}
 
-	if (se->argfree)
-		mmatic_free(se->arg);
+/** Handle events queued so far, once per event loop iteration */
+static void _evqueue_cb(int fd, short evtype, void *arg)
+{
+	struct spi *spi = arg;
 
-	mmatic_free(se);
+	_evqueue_handle(spi, spi->evqueue.count);
+
+	/* events announced by the handlers */
+	if (spi->evqueue.count > 0)
+		event_active(spi->evqueue_ev, EV_TIMEOUT, 0);
+}
+
+/** Allocate the event queue */
+static void _evqueue_init(struct spi *spi)
+{
+	spi->evqueue.size = SPI_EVQUEUE_SIZE;
+	spi->evqueue.ev = mmatic_alloc(spi->mm, SPI_EVQUEUE_SIZE * sizeof(struct spi_event));
+}
+
+/** Free the event queue and arguments of events not handled */
+static void _evqueue_free(struct spi *spi)
+{
+	struct spi_evqueue *q = &spi->evqueue;
+	struct spi_event *se;
+
+	for (; q->count > 0; q->count--) {
+		se = &q->ev[q->head];
+		if (se->argfree)
+			mmatic_free(se->arg);
+		q->head = (q->head + 1) & (q->size - 1);
+	}
+
+	mmatic_free(q->ev);
 }
 
 /*******************************/
@@ -160,19 +345,19 @@ struct spi *spi_init(struct spi_options *so)
 	struct spi *spi;
 	struct timeval tv;
 
-	/* avoid epoll as it fails on pcap file fds */
-	putenv("EVENT_NOEPOLL=1");
-
 	/* data structure */
 	mm = mmatic_create();
 	spi = mmatic_zalloc(mm, sizeof *spi);
 	spi->mm = mm;
 	spi->eb = event_base_new();
 	spi->sources = tlist_create(source_destroy, mm);
-	spi->eps = thash_create_strkey(ep_destroy, mm);
-	spi->flows = thash_create_strkey(flow_destroy, mm);
-	spi->subscribers = thash_create_strkey(_subscriber_free, mm);
+	spi->eps = ep_table_create(spi);
+	spi->flows = flow_table_create(mm);
+	spi->wheels = tlist_create(wheel_free, mm);
+	_events_init(spi);
 	spi->traindata = tlist_create(spi_signature_free, spi->mm);
+	pool_init(&spi->sign_pool, mm);
+	pool_init(&spi->cr_pool, mm);
 	spi->trainqueue = tlist_create(NULL, spi->mm); /* @1: dont free */
 
 	/* options */
@@ -181,11 +366,20 @@ struct spi *spi_init(struct spi_options *so)
 	else
 		_options_defaults(spi);
 
+	spi->mem_limit = (uint64_t) spi->options.mem_limit << 20;
+	trainset_init(spi);
+	if (spi->options.train_raw)
+		spi->trainraw = tlist_create(spi_signature_free, spi->mm);
+
 	/*
 	 * setup events
 	 * NB: new packet events will be added in spi_add()
 	 */
 
+	/* zero-delay spi events */
+	_evqueue_init(spi);
+	spi->evqueue_ev = event_new(spi->eb, -1, 0, _evqueue_cb, spi);
+
 	/* garbage collector */
 	tv.tv_sec = SPI_GC_INTERVAL;
 	tv.tv_usec = 0;
@@ -197,6 +391,9 @@ struct spi *spi_init(struct spi_options *so)
 	/* monitor for end of work */
 	spi_subscribe_after(spi, "sourceClosed", _check_if_finished, true);
 	spi_subscribe_after(spi, "traindataUpdated", _check_if_finished, true);
+	spi_subscribe_after(spi, "classifierModelUpdated", _check_if_finished, true);
+	spi_subscribe_after(spi, "classifierTrainingFailed", _check_if_finished, true);
+	spi_subscribe_after(spi, "workersSynced", _check_if_finished, true);
 
 	/* initialize classifier */
 	kissp_init(spi);
@@ -204,14 +401,69 @@ struct spi *spi_init(struct spi_options *so)
 	/* initialize verdict */
 	verdict_init(spi);
 
+	/* start worker threads */
+	if (spi->options.workers > 0)
+		worker_init(spi);
+
+	return spi;
+}
+
+struct spi *spi_shard_create(struct spi *root)
+{
+	mmatic *mm;
+	struct spi *spi;
+
+	mm = mmatic_create();
+	spi = mmatic_zalloc(mm, sizeof *spi);
+	spi->mm = mm;
+	spi->root = root;
+	_evqueue_init(spi);
+	spi->eps = ep_table_create(spi);
+	spi->wheels = tlist_create(wheel_free, mm);
+	_events_init(spi);
+	pool_init(&spi->sign_pool, mm);
+	pool_init(&spi->cr_pool, mm);
+	memcpy(&spi->options, &root->options, sizeof spi->options);
+	spi->mem_limit = root->mem_limit;
+
+	spi_subscribe(spi, "gcSuggestion", _gc_suggested, true);
+
+	kissp_init(spi);
+	verdict_init(spi);
+
 	return spi;
 }
 
+void spi_shard_free(struct spi *spi)
+{
+	verdict_free(spi);
+	kissp_free(spi);
+
+	_evqueue_free(spi);
+	_events_free(spi);
+	ep_table_free(spi->eps);
+	if (spi->flows)
+		flow_table_free(spi->flows);
+	tlist_free(spi->wheels);
+	if (spi->traindata)
+		tlist_free(spi->traindata);
+	pool_flush(&spi->sign_pool);
+	pool_flush(&spi->cr_pool);
+
+	mmatic_destroy(spi->mm);
+}
+
+void spi_dispatch(struct spi *spi)
+{
+	_evqueue_handle(spi, UINT32_MAX);
+}
+
 int spi_add(struct spi *spi, spi_source_t type, spi_label_t label, bool test, const char *args)
 {
 	struct spi_source *source;
 	int (*initcb)(struct spi_source *source, const char *args);
 	void (*readcb)(int fd, short evtype, void *arg);
+	struct timeval tv = { 0, 0 };
 	int rc;
 
 	source = mmatic_zalloc(spi->mm, sizeof *source);
@@ -230,6 +482,10 @@ int spi_add(struct spi *spi, spi_source_t type, spi_label_t label, bool test, co
 			initcb  = source_sniff_init;
 			readcb = source_sniff_read;
 			break;
+		case SPI_SOURCE_RING:
+			initcb = source_ring_init;
+			readcb = source_ring_read;
+			break;
 	}
 
 	/* initialize source handler, should give us valid source->fd to monitor */
@@ -237,14 +493,36 @@ int spi_add(struct spi *spi, spi_source_t type, spi_label_t label, bool test, co
 	if (rc != 0)
 		return rc;
 
-	/* monitor source fd for new packets */
-	source->evread = event_new(spi->eb, source->fd, EV_READ | EV_PERSIST, readcb, source);
-	event_add(source->evread, 0);
+	/* learning files read in parallel by spi_learn() */
+	if (type == SPI_SOURCE_FILE && label && !test && spi->options.learn_threads > 0) {
+		source->offline = true;
+	}
+
+	/* files are read in batches, with no need to poll */
+	else if (type == SPI_SOURCE_FILE) {
+		source->evread = evtimer_new(spi->eb, readcb, source);
+		evtimer_add(source->evread, &tv);
+	}
+
+	/* monitor source fd for new packets (NB: -1 if read by worker threads) */
+	else if (source->fd >= 0) {
+		source->evread = event_new(spi->eb, source->fd, EV_READ | EV_PERSIST, readcb, source);
+		event_add(source->evread, 0);
+	}
 
 	tlist_push(spi->sources, source);
+
+	if (spi->wdata)
+		worker_mem(spi);
+
 	return rc;
 }
 
+void spi_learn(struct spi *spi)
+{
+	worker_learn(spi);
+}
+
 int spi_loop(struct spi *spi)
 {
 	int rc;
@@ -264,21 +542,53 @@ void spi_stop(struct spi *spi)
 	spi->quitting = true;
 
 	/* close all flows and endpoints */
-	thash_flush(spi->flows);
-	thash_flush(spi->eps);
+	flow_table_flush(spi->flows);
+	ep_table_flush(spi->eps);
+	wheel_flush(spi);
+
+	if (spi->wdata)
+		worker_stop(spi);
 
 	event_base_loopbreak(spi->eb);
 }
 
-void spi_announce(struct spi *spi, const char *evname, uint32_t delay_ms, void *arg, bool argfree)
+spi_evid_t spi_event(struct spi *spi, const char *evname)
 {
-	struct spi_event *se;
-	struct timeval tv;
 	struct spi_subscribers *ss;
+	struct spi_subscribers *events;
+	spi_evid_t evid;
+
+	evid = (intptr_t) thash_get(spi->evids, evname);
+	if (evid > 0)
+		return evid - 1;
+
+	/* new event */
+	if (spi->events_num == spi->events_size) {
+		spi->events_size = spi->events_size ? spi->events_size * 2 : 2 * SPI_EV_BUILTIN;
+		events = mmatic_zalloc(spi->mm, spi->events_size * sizeof *events);
+		if (spi->events) {
+			memcpy(events, spi->events, spi->events_num * sizeof *events);
+			mmatic_free(spi->events);
+		}
+		spi->events = events;
+	}
+
+	evid = spi->events_num++;
+	ss = &spi->events[evid];
+	ss->evname = mmatic_strdup(spi->mm, evname);
+
+	thash_set(spi->evids, evname, (void *) (intptr_t) (evid + 1));
+	return evid;
+}
+
+void spi_announce_id(struct spi *spi, spi_evid_t evid, uint32_t delay_ms, void *arg, bool argfree)
+{
+	struct spi_event ev, *se;
+	struct timeval tv;
+	struct spi_subscribers *ss = &spi->events[evid];
 
-	/* get subscribers */
-	ss = thash_get(spi->subscribers, evname);
-	if (!ss)
+	/* no subscribers */
+	if (ss->hl.num + ss->ahl.num == 0)
 		goto quit;
 
 	/* handle event aggregation */
@@ -289,21 +599,31 @@ void spi_announce(struct spi *spi, const char *evname, uint32_t delay_ms, void *
 	}
 
 	if (delay_ms)
-		dbg(8, "event %s in %u ms\n", evname, delay_ms);
+		dbg(8, "event %s in %u ms\n", ss->evname, delay_ms);
 	else
-		dbg(8, "event %s\n", evname);
+		dbg(8, "event %s\n", ss->evname);
+
+	ev.spi = spi;
+	ev.evid = evid;
+	ev.arg = arg;
+	ev.argfree = argfree;
+
+	/* zero-delay events: handle in order, in next event loop iteration (NB: worker shards have no delays) */
+	if (!delay_ms || spi->root) {
+		memcpy(_evqueue_push(spi), &ev, sizeof ev);
+
+		if (spi->evqueue.count == 1 && spi->evqueue_ev)
+			event_active(spi->evqueue_ev, EV_TIMEOUT, 0);
+
+		return;
+	}
 
 	se = mmatic_alloc(spi->mm, sizeof *se);
-	se->spi = spi;
-	se->evname = evname;
-	se->ss = ss;
-	se->arg = arg;
-	se->argfree = argfree;
+	memcpy(se, &ev, sizeof ev);
 
 	tv.tv_sec  = delay_ms / 1000;
 	tv.tv_usec = (delay_ms % 1000) * 1000;
 
-	/* XXX: queue instead of instant handler call */
 	event_base_once(spi->eb, -1, EV_TIMEOUT, _new_spi_event, se, &tv);
 	return;
 
@@ -312,25 +632,34 @@ quit:
 	return;
 }
 
+void spi_announce(struct spi *spi, const char *evname, uint32_t delay_ms, void *arg, bool argfree)
+{
+	spi_announce_id(spi, spi_event(spi, evname), delay_ms, arg, argfree);
+}
+
 static void _subscribe_to(struct spi *spi, const char *evname, spi_event_cb_t *cb, bool aggregate, bool to_ah)
 {
-	struct spi_subscribers *ss;
-	union spi_ptr2eventcb_tool pf;
-
-	/* get subscribers */
-	ss = thash_get(spi->subscribers, evname);
-	if (!ss) {
-		ss = mmatic_zalloc(spi->mm, sizeof *ss);
-		ss->hl = tlist_create(NULL, spi->mm);
-		ss->ahl = tlist_create(NULL, spi->mm);
+	spi_evid_t evid = spi_event(spi, evname);
+	struct spi_subscribers *ss = &spi->events[evid];
+	struct spi_handlers *hl = to_ah ? &ss->ahl : &ss->hl;
+	spi_event_cb_t **cbs;
+
+	/* the first subscriber decides on aggregation */
+	if (!ss->hl.size && !ss->ahl.size)
 		ss->aggstatus = aggregate ? SPI_AGG_READY : SPI_AGG_DISABLED;
 
-		thash_set(spi->subscribers, evname, ss);
+	/* append callback to appropriate subscriber list */
+	if (hl->num == hl->size) {
+		hl->size = hl->size ? hl->size * 2 : 4;
+		cbs = mmatic_alloc(spi->mm, hl->size * sizeof *cbs);
+		if (hl->cb) {
+			memcpy(cbs, hl->cb, hl->num * sizeof *cbs);
+			mmatic_free(hl->cb);
+		}
+		hl->cb = cbs;
 	}
 
-	/* append callback to appropriate subscriber list */
-	pf.func = cb;
-	tlist_push(to_ah ? ss->ahl : ss->hl, pf.ptr);
+	hl->cb[hl->num++] = cb;
 }
 
 void spi_subscribe(struct spi *spi, const char *evname, spi_event_cb_t *cb, bool aggregate)
@@ -350,35 +679,62 @@ void spi_free(struct spi *spi)
 		return;
 	}
 
+	if (spi->wdata)
+		worker_free(spi);
+
 	verdict_free(spi);
 	kissp_free(spi);
 
 	event_del(spi->evgc);
 	event_free(spi->evgc);
+	event_free(spi->evqueue_ev);
 	event_base_free(spi->eb);
 
+	_evqueue_free(spi);
+
 	tlist_free(spi->trainqueue);
 	tlist_free(spi->traindata);
-	thash_free(spi->subscribers);
-	thash_free(spi->flows);
-	thash_free(spi->eps);
+	if (spi->trainraw)
+		tlist_free(spi->trainraw);
+	trainset_free(spi);
+	_events_free(spi);
+	flow_table_free(spi->flows);
+	ep_table_free(spi->eps);
+	tlist_free(spi->wheels);
 	tlist_free(spi->sources);
+	pool_flush(&spi->sign_pool);
+	pool_flush(&spi->cr_pool);
 
 	mmatic_destroy(spi->mm);
 }
 
+bool spi_pending_id(struct spi *spi, spi_evid_t evid)
+{
+	return spi->events[evid].aggstatus == SPI_AGG_PENDING;
+}
+
 bool spi_pending(struct spi *spi, const char *evname)
 {
-	struct spi_subscribers *ss = thash_get(spi->subscribers, evname);
-	return (ss && ss->aggstatus == SPI_AGG_PENDING);
+	spi_evid_t evid = (intptr_t) thash_get(spi->evids, evname);
+	return (evid > 0 && spi_pending_id(spi, evid - 1));
 }
 
 void spi_train(struct spi *spi, struct spi_signature *sign)
 {
-	tlist_push(spi->traindata, sign);
+	/* worker shard: pass to the main thread; offline learning shard: keep until merged */
+	if (spi->root) {
+		if (spi->wdata)
+			worker_train(spi, sign);
+		else
+			tlist_push(spi->traindata, sign);
+		return;
+	}
+
+	if (!trainset_add(spi, sign))
+		return;
 
 	/* update model with a delay so many training samples have chance to be queued */
-	spi_announce(spi, "traindataUpdated", SPI_TRAINING_DELAY, NULL, false);
+	spi_announce_id(spi, SPI_EV_TRAINDATA_UPDATED, SPI_TRAINING_DELAY, NULL, false);
 
 	return;
 }
@@ -393,12 +749,22 @@ void spi_trainqueue_commit(struct spi *spi)
 	struct spi_signature *sign;
 
 	tlist_iter_loop(spi->trainqueue, sign) {
-		tlist_push(spi->traindata, sign); /* @1 */
+		trainset_add(spi, sign); /* @1 */
 		spi->stats.learned_tq++;
 	}
 
 	tlist_flush(spi->trainqueue);
-	spi_announce(spi, "traindataUpdated", 0, NULL, false);
+	spi_announce_id(spi, SPI_EV_TRAINDATA_UPDATED, 0, NULL, false);
+}
+
+uint64_t spi_mem(struct spi *spi)
+{
+	uint64_t mem = spi->eps->mem;
+
+	if (spi->flows)
+		mem += (uint64_t) spi->flows->count * SPI_FLOW_MEM;
+
+	return mem;
 }
 
 double spi_stats_fp(struct spi *spi, spi_label_t l)
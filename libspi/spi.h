@@ -29,13 +29,24 @@ struct spi *spi_init(struct spi_options *so);
  * @param type       type of the source
  * @param label      traffic label: if != 0 and param test is false, use this source for training
  * @param test       use this source for testing
- * @param args       source-specific arguments to the source, parsed by relevant handler
+ * @param args       source-specific arguments to the source, parsed by relevant handler:
+ *                   SPI_SOURCE_FILE: "<path> [filter]", SPI_SOURCE_SNIFF: "<interface> [filter]",
+ *                   SPI_SOURCE_RING: "<interface>[@<fanout group>] [filter]"
  * @retval 0         success
  * @retval 1         failure
  * @retval <0        error specific to source
  */
 int spi_add(struct spi *spi, spi_source_t type, spi_label_t label, bool test, const char *args);
 
+/** Learn from all learning files added so far, in parallel
+ * Effective only if options.learn_threads > 0: then spi_add() doesnt read file sources with
+ * a label and without test flag in the event loop. Instead, each file is read in one of
+ * options.learn_threads threads, with own endpoint and flow tables. Training samples are
+ * merged into traindata in order of spi_add() calls and the model is trained once.
+ * Blocks until all files are read.
+ */
+void spi_learn(struct spi *spi);
+
 /** Make one iteration of the main spi loop
  * @retval  0        success
  * @retval -1        temporary error
@@ -50,16 +61,25 @@ void spi_stop(struct spi *spi);
 /** Free spi memory, close all resources, etc */
 void spi_free(struct spi *spi);
 
+/** Get numeric ID of spi event, registering its name on first use
+ * @param evname     spi event name (copied)
+ * @note the IDs of events other than built-in spi_evid_t are valid only in given spi
+ */
+spi_evid_t spi_event(struct spi *spi, const char *evname);
+
 /** Announce a spi event
- * @param evname     spi event name (referenced)
+ * @param evname     spi event name
  * @param delay_ms   delay in miliseconds before delivering the event
  * @param arg        opaque data specific to given event
  * @param argfree    do mmatic_free(arg) after event handling / ignoring
  */
 void spi_announce(struct spi *spi, const char *evname, uint32_t delay_ms, void *arg, bool argfree);
 
+/** Like spi_announce(), but for event ID: avoids the name lookup on hot paths */
+void spi_announce_id(struct spi *spi, spi_evid_t evid, uint32_t delay_ms, void *arg, bool argfree);
+
 /** Subscribe to given spi event
- * @param evname     spi event name (referenced)
+ * @param evname     spi event name
  * @param cb         event handler - receives code and data from spi_announce()
  * @param aggregate  if true, ignore further events until the first one is handled
  */
@@ -71,7 +91,11 @@ void spi_subscribe_after(struct spi *spi, const char *evname, spi_event_cb_t *cb
 /** Check if spi event is pending for delivery */
 bool spi_pending(struct spi *spi, const char *evname);
 
+/** Like spi_pending(), but for event ID */
+bool spi_pending_id(struct spi *spi, spi_evid_t evid);
+
 /** Add given signature to training samples and schedule re-learning
+ * Duplicates and samples over options.train_cap are dropped, see trainset.h.
  * @param sign                signature
  * @param label               protocol label
  */
@@ -86,11 +110,40 @@ void spi_trainqueue(struct spi *spi, struct spi_signature *sign);
 /** Use the training samples queue and run re-learning immediately */
 void spi_trainqueue_commit(struct spi *spi);
 
+/** Create worker shard: spi handling part of endpoints in a worker thread
+ * @param root       main spi
+ */
+struct spi *spi_shard_create(struct spi *root);
+
+/** Free worker shard */
+void spi_shard_free(struct spi *spi);
+
+/** Handle all queued zero-delay spi events, including ones announced meanwhile
+ * @note worker shards have no event loop: they must call it themselves */
+void spi_dispatch(struct spi *spi);
+
+/** Allocate a struct spi_signature with coordinates in one piece, from the spi pool
+ * @param num                 number of coordinates, including the terminator
+ */
+struct spi_signature *spi_signature_new(struct spi *spi, int num);
+
 /** Free a struct spi_signature
  * @param arg                 address to memory occupied by a struct spi_signature
  */
 void spi_signature_free(void *arg);
 
+/** Get number of coordinates in signatures, excluding the terminator
+ * @note           depends on spi_options.N and spi_options.kiss_std
+ */
+int spi_signature_features(struct spi *spi);
+
+/** Get estimated memory used by endpoints and flows [B]
+ * @param spi      spi root or worker shard
+ * @note           with worker threads, each shard and the root have own share of spi_options.mem_limit,
+ *                 see worker_mem()
+ */
+uint64_t spi_mem(struct spi *spi);
+
 /** Get False Positive Percentage for given label
  * @retval -1.0    result not available
  */
@@ -112,10 +165,11 @@ double spi_stats_fn(struct spi *spi, spi_label_t label);
 /** Extract endpoint port number */
 #define spi_epa2port(epa) ((uint16_t) (epa & 0xffff))
 
-/** Print endpoint address in a human-readable format */
+/** Print endpoint address in a human-readable format
+ * @note buffer is per thread, as worker threads print endpoints too */
 static inline const char *spi_epa2a(spi_epaddr_t epa)
 {
-	static char buf[] = "AAA 111.111.111.111:11111";
+	static __thread char buf[] = "AAA 111.111.111.111:11111";
 	struct in_addr addr;
 
 	addr.s_addr = spi_epa2ip(epa);
@@ -140,6 +194,8 @@ static inline const char *spi_src2a(struct spi_source *src)
 			return src->as.file.path;
 	} else if (src->type == SPI_SOURCE_SNIFF) {
 		return src->as.sniff.ifname;
+	} else if (src->type == SPI_SOURCE_RING) {
+		return src->as.ring.ifname;
 	}
 	return "?";
 }
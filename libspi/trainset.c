@@ -0,0 +1,227 @@
+/*
+ * spi: Statistical Packet Inspection: filter of training samples
+ * Copyright (C) 2011 Paweł Foremski <pawel@foremski.pl>
+ * This software is licensed under GNU GPL version 3
+ */
+
+#include <math.h>
+#include <libpjf/lib.h>
+
+#include "datastructures.h"
+#include "spi.h"
+#include "trainset.h"
+#include "hash.h"
+
+/** Hash label and coordinates of sample, rounded to options.train_quant
+ * @return non-zero hash */
+static uint64_t _sign_hash(struct spi *spi, const struct spi_signature *sign)
+{
+	const struct spi_coordinate *c;
+	double q = spi->options.train_quant, r;
+	uint64_t h = hash_step(0, sign->label), v;
+
+	for (c = sign->c; c->index != -1; c++) {
+		r = (q > 0.0) ? floor(c->value / q + 0.5) : c->value;
+
+		/* NB: -0.0 == 0.0 */
+		if (q > 0.0 && fabs(r) < 1e18)
+			v = (int64_t) r;
+		else if (r == 0.0)
+			v = 0;
+		else
+			memcpy(&v, &r, sizeof v);
+
+		h = hash_step(h, c->index);
+		h = hash_step(h, v);
+	}
+
+	return h ? h : 1;
+}
+
+/** Find slot holding given hash, or the free slot where it should be inserted */
+static inline uint32_t _lookup(struct spi_trainset *ts, uint64_t h)
+{
+	uint32_t mask = ts->size - 1;
+	uint32_t i;
+
+	/* NB: terminates because there is always at least 1 free slot */
+	for (i = h & mask; ts->slots[i] && ts->slots[i] != h; i = (i + 1) & mask);
+
+	return i;
+}
+
+/** Rehash all hashes into a new slot array of given size */
+static void _resize(struct spi_trainset *ts, uint32_t size)
+{
+	uint64_t *old = ts->slots;
+	uint32_t i, oldsize = ts->size;
+
+	ts->slots = mmatic_zalloc(ts->mm, sizeof(uint64_t) * size);
+	ts->size = size;
+
+	for (i = 0; i < oldsize; i++) {
+		if (old[i])
+			ts->slots[_lookup(ts, old[i])] = old[i];
+	}
+
+	mmatic_free(old);
+	dbg(5, "traindata hash table resized to %u slots (%u samples)\n", size, ts->count);
+}
+
+/** Insert hash of new sample */
+static void _insert(struct spi_trainset *ts, uint64_t h)
+{
+	/* keep load factor below 3/4 */
+	if ((ts->count + 1) * 4 > ts->size * 3)
+		_resize(ts, ts->size * 2);
+
+	ts->slots[_lookup(ts, h)] = h;
+	ts->count++;
+}
+
+/** Remove hash of sample, moving back the following hashes of its probe sequence */
+static void _remove(struct spi_trainset *ts, uint64_t h)
+{
+	uint32_t mask = ts->size - 1;
+	uint32_t i, j, k;
+
+	i = _lookup(ts, h);
+	if (!ts->slots[i])
+		return;
+
+	for (j = (i + 1) & mask; ts->slots[j]; j = (j + 1) & mask) {
+		/* move the hash into the hole, unless its home slot k lies in (i, j] */
+		k = ts->slots[j] & mask;
+		if ((i < j) ? (k <= i || k > j) : (k <= i && k > j)) {
+			ts->slots[i] = ts->slots[j];
+			i = j;
+		}
+	}
+
+	ts->slots[i] = 0;
+	ts->count--;
+}
+
+/** Keep copy of training sample in spi->trainraw */
+static void _keep_raw(struct spi *spi, const struct spi_signature *sign)
+{
+	struct spi_signature *copy;
+	int n;
+
+	for (n = 0; sign->c[n].index != -1; n++);
+
+	copy = spi_signature_new(spi, n + 1);
+	copy->label = sign->label;
+	memcpy(copy->c, sign->c, sizeof(struct spi_coordinate) * (n + 1));
+	tlist_push(spi->trainraw, copy);
+}
+
+void trainset_init(struct spi *spi)
+{
+	struct spi_trainset *ts = &spi->trainset;
+
+	ts->mm = spi->mm;
+	ts->slots = mmatic_zalloc(ts->mm, sizeof(uint64_t) * SPI_TRAINSET_SIZE);
+	ts->size = SPI_TRAINSET_SIZE;
+	ts->count = 0;
+	ts->rnd = SPI_TRAINSET_SEED;
+	ts->replaced = 0;
+
+	if (spi->options.train_cap)
+		ts->res = mmatic_zalloc(ts->mm, sizeof(struct spi_reservoir) * (SPI_LABEL_MAX + 1));
+	else
+		ts->res = NULL;
+}
+
+bool trainset_add(struct spi *spi, struct spi_signature *sign)
+{
+	struct spi_trainset *ts = &spi->trainset;
+	struct spi_reservoir *res;
+	struct spi_signature *old, *s;
+	uint32_t cap = spi->options.train_cap;
+	uint64_t h = 0, j;
+	int n, m;
+
+	if (spi->trainraw)
+		_keep_raw(spi, sign);
+
+	/* drop duplicates */
+	if (!spi->options.train_dups) {
+		h = _sign_hash(spi, sign);
+		if (ts->slots[_lookup(ts, h)]) {
+			spi->stats.train_dups++;
+			spi_signature_free(sign);
+			return false;
+		}
+	}
+
+	/* reservoir sampling: n-th sample of label is kept with probability cap/n */
+	if (cap) {
+		res = &ts->res[sign->label];
+		res->seen++;
+
+		if (res->count >= cap) {
+			spi->stats.train_capped++;
+
+			j = hash_rand(&ts->rnd) % res->seen;
+			if (j >= cap) {
+				spi_signature_free(sign);
+				return false;
+			}
+
+			old = res->signs[j];
+			if (!spi->options.train_dups) {
+				_remove(ts, _sign_hash(spi, old));
+				_insert(ts, h);
+			}
+
+			for (n = 0; old->c[n].index != -1; n++);
+			for (m = 0; sign->c[m].index != -1; m++);
+
+			if (n == m) {
+				/* in place: order of other samples in traindata does not change */
+				memcpy(old->c, sign->c, sizeof(struct spi_coordinate) * (m + 1));
+				spi_signature_free(sign);
+			} else {
+				tlist_iter_loop(spi->traindata, s) {
+					if (s == old) {
+						tlist_remove(spi->traindata);
+						break;
+					}
+				}
+
+				tlist_push(spi->traindata, sign);
+				res->signs[j] = sign;
+			}
+
+			ts->replaced++;
+			return true;
+		}
+
+		if (!res->signs)
+			res->signs = mmatic_alloc(ts->mm, sizeof(struct spi_signature *) * cap);
+		res->signs[res->count++] = sign;
+	}
+
+	if (!spi->options.train_dups)
+		_insert(ts, h);
+
+	tlist_push(spi->traindata, sign);
+	return true;
+}
+
+void trainset_free(struct spi *spi)
+{
+	struct spi_trainset *ts = &spi->trainset;
+	int i;
+
+	if (ts->res) {
+		for (i = 0; i <= SPI_LABEL_MAX; i++) {
+			if (ts->res[i].signs)
+				mmatic_free(ts->res[i].signs);
+		}
+		mmatic_free(ts->res);
+	}
+
+	mmatic_free(ts->slots);
+}
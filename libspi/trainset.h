@@ -0,0 +1,36 @@
+/*
+ * spi: Statistical Packet Inspection: filter of training samples
+ * Copyright (C) 2011 Paweł Foremski <pawel@foremski.pl>
+ * This software is licensed under GNU GPL version 3
+ */
+
+#ifndef _TRAINSET_H_
+#define _TRAINSET_H_
+
+#include "settings.h"
+#include "datastructures.h"
+
+/** Initialize empty filter of spi->traindata */
+void trainset_init(struct spi *spi);
+
+/** Add training sample to spi->traindata
+ *
+ * Samples with the same label and coordinates equal after rounding to
+ * options.train_quant are dropped, unless options.train_dups is set. If
+ * options.train_cap is set, each label keeps a uniform random choice of its
+ * samples (reservoir sampling): a new sample may replace one of the kept
+ * samples in place, or be dropped.
+ *
+ * If options.train_raw is set, a copy of each sample is kept in spi->trainraw
+ * before filtering, e.g. so the application can save all of them.
+ *
+ * @param sign       sample, taken over
+ * @retval true      traindata changed
+ * @retval false     sample dropped and freed
+ */
+bool trainset_add(struct spi *spi, struct spi_signature *sign);
+
+/** Free memory of filter */
+void trainset_free(struct spi *spi);
+
+#endif
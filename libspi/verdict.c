@@ -10,35 +10,57 @@
 #include "spi.h"
 #include "ep.h"
 
-/** Find the distance between the first and the second highest value in cprob */
-static double _cprob_dist(spi_cprob_t cprob)
+/** Find the distance between the first and the second highest probability
+ * @param label       if not NULL, store the most probable label (the lowest on ties) */
+static double _cprob_dist(const struct spi_cprob *cprob, int num, spi_label_t *label)
 {
 	int i;
 	double m1 = 0.0, m2 = 0.0;
-
-	for (i = 1; i <= SPI_LABEL_MAX; i++) {
-		if (cprob[i] > m2) {
-			if (cprob[i] > m1) {
-				m2 = m1;
-				m1 = cprob[i];
-			} else {
-				m2 = cprob[i];
-			}
+	spi_label_t l1 = 0;
+
+	for (i = 0; i < num; i++) {
+		if (cprob[i].prob > m1 || (cprob[i].prob == m1 && cprob[i].label < l1)) {
+			m2 = m1;
+			m1 = cprob[i].prob;
+			l1 = cprob[i].label;
+		} else if (cprob[i].prob > m2) {
+			m2 = cprob[i].prob;
 		}
 	}
 
+	if (label)
+		*label = l1;
+
 	return (m1 - m2);
 }
 
-static void _cr_dump(struct spi_classresult *cr, int num)
+/** Find index of label in cprob
+ * @param hint        index to check first: arrays of the same model have the same order
+ * @retval -1         not found */
+static int _cprob_find(const struct spi_cprob *cprob, int num, spi_label_t label, int hint)
+{
+	int i;
+
+	if (hint < num && cprob[hint].label == label)
+		return hint;
+
+	for (i = 0; i < num; i++) {
+		if (cprob[i].label == label)
+			return i;
+	}
+
+	return -1;
+}
+
+static void _cr_dump(struct spi_classresult *cr)
 {
 	struct spi_ep *ep = cr->ep;
 	int i;
 
 	dbg(-1, "%-21s predicted as %d probs ", spi_epa2a(ep->epa), cr->result);
-	for (i = 1; i < num; i++)
-		dbg(-1, "%.2f ", cr->cprob[i]);
-	dbg(-1, "  -> dist %g\n", _cprob_dist(cr->cprob));
+	for (i = 0; i < cr->num; i++)
+		dbg(-1, "%d:%.2f ", cr->cprob[i].label, cr->cprob[i].prob);
+	dbg(-1, "  -> dist %g\n", _cprob_dist(cr->cprob, cr->num, NULL));
 }
 
 /*****/
@@ -48,7 +70,7 @@ static void _best_verdict(struct spi *spi, struct spi_classresult *cr)
 {
 	double dist;
 
-	dist = _cprob_dist(cr->cprob);
+	dist = _cprob_dist(cr->cprob, cr->num, NULL);
 	if (dist > cr->ep->verdict_prob) {
 		cr->ep->verdict = cr->result;
 		cr->ep->verdict_prob = dist;
@@ -60,18 +82,38 @@ static void _best_verdict(struct spi *spi, struct spi_classresult *cr)
 static void _simple_verdict(struct spi *spi, struct spi_classresult *cr)
 {
 	cr->ep->verdict = cr->result;
-	cr->ep->verdict_prob = _cprob_dist(cr->cprob);
+	cr->ep->verdict_prob = _cprob_dist(cr->cprob, cr->num, NULL);
 }
 
 /*****/
 
+/** Append label to EWMA histogram */
+static void _ewma_add(struct spi_ep *ep, struct ewma_verdict *ev, spi_label_t label, double prob)
+{
+	struct spi_cprob *cprob;
+
+	if (ev->num == ev->size) {
+		ev->size = ev->size ? ev->size * 2 : 8;
+		cprob = mmatic_alloc(ep->mm, ev->size * sizeof *cprob);
+		if (ev->cprob) {
+			memcpy(cprob, ev->cprob, ev->num * sizeof *cprob);
+			mmatic_free(ev->cprob);
+		}
+		ev->cprob = cprob;
+	}
+
+	ev->cprob[ev->num].label = label;
+	ev->cprob[ev->num].prob = prob;
+	ev->num++;
+}
+
 static void _ewma_verdict(struct spi *spi, struct spi_classresult *cr)
 {
 	struct verdict *v = spi->vdata;
 	struct ewma_verdict *ev = cr->ep->vdata;
-	int i;
-	double m1 = 0.0, m2 = 0.0;
-	spi_label_t max_label = 0;
+	int i, j;
+	double dist;
+	spi_label_t max_label;
 
 	/* special case if its first verdict request */
 	if (!ev) {
@@ -79,30 +121,30 @@ static void _ewma_verdict(struct spi *spi, struct spi_classresult *cr)
 		cr->ep->vdata = ev;
 
 		/* init EWMA with class. result */
-		memcpy(ev->cprob, cr->cprob, sizeof(spi_cprob_t));
+		ev->size = cr->num;
+		ev->cprob = mmatic_alloc(cr->ep->mm, ev->size * sizeof *ev->cprob);
+		memcpy(ev->cprob, cr->cprob, cr->num * sizeof *ev->cprob);
+		ev->num = cr->num;
 
 		/* fall-back on simple verdict */
 		_simple_verdict(spi, cr);
 	} else {
-		/* update EWMA */
-		for (i = 1; i <= SPI_LABEL_MAX; i++) {
-			ev->cprob[i] = EWMA(ev->cprob[i], cr->cprob[i], v->ewma.N);
-
-			/* collect info as _cprob_dist() */
-			if (ev->cprob[i] > m2) {
-				if (ev->cprob[i] > m1) {
-					max_label = i;
-					m2 = m1;
-					m1 = ev->cprob[i];
-				} else {
-					m2 = ev->cprob[i];
-				}
-			}
+		/* update EWMA: labels missing in the result decay */
+		for (i = 0; i < ev->num; i++) {
+			j = _cprob_find(cr->cprob, cr->num, ev->cprob[i].label, i);
+			ev->cprob[i].prob = EWMA(ev->cprob[i].prob, j < 0 ? 0.0 : cr->cprob[j].prob, v->ewma.N);
+		}
+
+		/* labels new in the model */
+		for (i = 0; i < cr->num; i++) {
+			if (_cprob_find(ev->cprob, ev->num, cr->cprob[i].label, i) < 0)
+				_ewma_add(cr->ep, ev, cr->cprob[i].label, EWMA(0.0, cr->cprob[i].prob, v->ewma.N));
 		}
 
-		if (m1 - m2 > cr->ep->verdict_prob) {
+		dist = _cprob_dist(ev->cprob, ev->num, &max_label);
+		if (dist > cr->ep->verdict_prob) {
 			cr->ep->verdict = max_label;
-			cr->ep->verdict_prob = (m1 - m2);
+			cr->ep->verdict_prob = dist;
 		}
 	}
 }
@@ -117,7 +159,7 @@ static bool _verdict_new_classification(struct spi *spi, const char *evname, voi
 	spi_label_t old_value;
 
 	if (debug >= 4)
-		_cr_dump(cr, 10);
+		_cr_dump(cr);
 
 	/* store current classification verdict */
 	old_value = cr->ep->verdict;
@@ -149,7 +191,7 @@ static bool _verdict_new_classification(struct spi *spi, const char *evname, voi
 	if (cr->ep->verdict != old_value) {
 		cr->ep->verdict_count++;
 		ep->gclock3++;
-		spi_announce(spi, "endpointVerdictChanged", 0, cr->ep, false);
+		spi_announce_id(spi, SPI_EV_ENDPOINT_VERDICT_CHANGED, 0, cr->ep, false);
 	}
 
 	ep->gclock2--;
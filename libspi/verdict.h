@@ -12,8 +12,10 @@
 /** Per-endpoint EWMA verdict data */
 struct ewma_verdict {
 	/** histogram of verdicts over time:
-	 * EWMA of classification probabilty for each label */
-	spi_cprob_t cprob;
+	 * EWMA of classification probabilty for each label seen in the results */
+	struct spi_cprob *cprob;
+	int num;                         /** number of labels in cprob */
+	int size;                        /** size of cprob */
 };
 
 /** Global verdict data */
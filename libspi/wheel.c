@@ -0,0 +1,219 @@
+/*
+ * spi: Statistical Packet Inspection: expiry timing wheels
+ * Copyright (C) 2011 Paweł Foremski <pawel@foremski.pl>
+ * This software is licensed under GNU GPL version 3
+ */
+
+#include <libpjf/lib.h>
+
+#include "datastructures.h"
+#include "wheel.h"
+
+/** Bit shift of slot index at given level */
+#define SHIFT(k) ((k) * SPI_WHEEL_BITS)
+
+/** Append entry to slot */
+static void _push(struct spi_wheel *wheel, struct spi_wheel_slot *slot, const struct spi_wheel_entry *e)
+{
+	struct spi_wheel_entry *entries;
+
+	if (slot->num == slot->size) {
+		slot->size = slot->size ? slot->size * 2 : 16;
+		entries = mmatic_alloc(wheel->mm, slot->size * sizeof *entries);
+		if (slot->e) {
+			memcpy(entries, slot->e, slot->num * sizeof *entries);
+			mmatic_free(slot->e);
+		}
+		slot->e = entries;
+	}
+
+	memcpy(&slot->e[slot->num++], e, sizeof *e);
+}
+
+/** Put entry into the slot of its expiry time
+ * @note e->expire must not be older than wheel->now */
+static void _place(struct spi_wheel *wheel, const struct spi_wheel_entry *e)
+{
+	int k;
+
+	/* find the lowest level which still reaches the expiry time */
+	for (k = 0; k < SPI_WHEEL_LEVELS - 1; k++) {
+		if ((e->expire >> SHIFT(k)) - (wheel->now >> SHIFT(k)) < SPI_WHEEL_SLOTS)
+			break;
+	}
+
+	_push(wheel, &wheel->slots[k][(e->expire >> SHIFT(k)) & (SPI_WHEEL_SLOTS - 1)], e);
+	wheel->num[k]++;
+	wheel->count++;
+}
+
+/** Move entries of higher levels that expire in current slot time to lower levels */
+static void _cascade(struct spi_wheel *wheel)
+{
+	struct spi_wheel_slot *slot;
+	uint32_t i;
+	int k;
+
+	/* NB: top-down, so the entries can go down more than one level */
+	for (k = SPI_WHEEL_LEVELS - 1; k > 0; k--) {
+		if (wheel->now & ((1U << SHIFT(k)) - 1))
+			continue;
+
+		slot = &wheel->slots[k][(wheel->now >> SHIFT(k)) & (SPI_WHEEL_SLOTS - 1)];
+
+		wheel->num[k] -= slot->num;
+		wheel->count -= slot->num;
+
+		/* NB: entries go to lower levels, so slot->e does not change */
+		for (i = 0; i < slot->num; i++)
+			_place(wheel, &slot->e[i]);
+
+		slot->num = 0;
+	}
+}
+
+/** Advance wheel time towards now, skipping over the empty levels */
+static void _advance(struct spi_wheel *wheel, uint32_t now)
+{
+	uint64_t next;
+	int k;
+
+	for (k = 0; k < SPI_WHEEL_LEVELS && wheel->num[k] == 0; k++);
+
+	/* empty wheel */
+	if (k == SPI_WHEEL_LEVELS) {
+		wheel->now = now;
+		return;
+	}
+
+	/* levels below k are empty: nothing happens until next level k slot */
+	next = (((uint64_t) wheel->now >> SHIFT(k)) + 1) << SHIFT(k);
+	if (next > now) {
+		wheel->now = now;
+		return;
+	}
+
+	wheel->now = next;
+	_cascade(wheel);
+}
+
+/******************/
+
+struct spi_wheel *wheel_get(struct spi *spi, struct spi_source *source)
+{
+	struct spi_wheel *wheel;
+
+	/* NB: live sources share system time */
+	if (source->type != SPI_SOURCE_FILE)
+		source = NULL;
+
+	tlist_iter_loop(spi->wheels, wheel) {
+		if (wheel->source == source)
+			return wheel;
+	}
+
+	wheel = mmatic_zalloc(spi->mm, sizeof *wheel);
+	wheel->mm = spi->mm;
+	wheel->source = source;
+	tlist_push(spi->wheels, wheel);
+
+	return wheel;
+}
+
+uint32_t wheel_time(struct spi_wheel *wheel, struct timeval *systime)
+{
+	if (wheel->source)
+		return wheel->source->as.file.time.tv_sec;
+	else
+		return systime->tv_sec;
+}
+
+uint32_t wheel_add(struct spi_wheel *wheel, int type, struct spi_source *source,
+	spi_epaddr_t epa1, spi_epaddr_t epa2, uint32_t now, uint32_t expire)
+{
+	struct spi_wheel_entry e;
+	uint64_t max;
+
+	/* nothing to return before now */
+	if (wheel->count == 0 && now > wheel->now)
+		wheel->now = now;
+
+	/* NB: current slot is already due */
+	if (expire < wheel->now)
+		expire = wheel->now;
+
+	/* beyond the wheel range: check in the last slot of top level, the owner will reschedule */
+	max = (((uint64_t) wheel->now >> SHIFT(SPI_WHEEL_LEVELS - 1)) + SPI_WHEEL_SLOTS - 1)
+		<< SHIFT(SPI_WHEEL_LEVELS - 1);
+	if (expire > max)
+		expire = MIN(max, UINT32_MAX);
+
+	e.source = source;
+	e.epa1 = epa1;
+	e.epa2 = epa2;
+	e.expire = expire;
+	e.type = type;
+	_place(wheel, &e);
+
+	return expire;
+}
+
+bool wheel_next(struct spi_wheel *wheel, uint32_t now, struct spi_wheel_entry *e)
+{
+	struct spi_wheel_slot *slot;
+	uint32_t i;
+
+	for (;;) {
+		slot = &wheel->slots[0][wheel->now & (SPI_WHEEL_SLOTS - 1)];
+		if (slot->num > 0) {
+			memcpy(e, &slot->e[--slot->num], sizeof *e);
+			wheel->num[0]--;
+			wheel->count--;
+			return true;
+		}
+
+		if (wheel->now >= now)
+			break;
+
+		_advance(wheel, now);
+	}
+
+	/* end of run: entries put back become due */
+	slot = &wheel->slots[0][wheel->now & (SPI_WHEEL_SLOTS - 1)];
+	for (i = 0; i < wheel->retry.num; i++)
+		_push(wheel, slot, &wheel->retry.e[i]);
+
+	wheel->num[0] += wheel->retry.num;
+	wheel->count += wheel->retry.num;
+	wheel->retry.num = 0;
+
+	return false;
+}
+
+void wheel_retry(struct spi_wheel *wheel, const struct spi_wheel_entry *e)
+{
+	_push(wheel, &wheel->retry, e);
+}
+
+void wheel_flush(struct spi *spi)
+{
+	tlist_flush(spi->wheels);
+}
+
+void wheel_free(void *arg)
+{
+	struct spi_wheel *wheel = arg;
+	int k, i;
+
+	for (k = 0; k < SPI_WHEEL_LEVELS; k++) {
+		for (i = 0; i < SPI_WHEEL_SLOTS; i++) {
+			if (wheel->slots[k][i].e)
+				mmatic_free(wheel->slots[k][i].e);
+		}
+	}
+
+	if (wheel->retry.e)
+		mmatic_free(wheel->retry.e);
+
+	mmatic_free(wheel);
+}
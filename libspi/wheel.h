@@ -0,0 +1,85 @@
+/*
+ * spi: Statistical Packet Inspection: expiry timing wheels
+ * Copyright (C) 2011 Paweł Foremski <pawel@foremski.pl>
+ * This software is licensed under GNU GPL version 3
+ */
+
+#ifndef _WHEEL_H_
+#define _WHEEL_H_
+
+#include "settings.h"
+#include "datastructures.h"
+
+/** Number of slots at each wheel level */
+#define SPI_WHEEL_SLOTS (1 << SPI_WHEEL_BITS)
+
+/** Pending expiry check of an endpoint or flow
+ * NB: the entry is just a key: the object may be gone or rescheduled before it expires */
+struct spi_wheel_entry {
+	struct spi_source *source;       /** source of the object */
+	spi_epaddr_t epa1;               /** endpoint address or lower flow epaddr */
+	spi_epaddr_t epa2;               /** greater flow epaddr */
+	uint32_t expire;                 /** time of the check */
+
+	enum {
+		SPI_WHEEL_EP = 1,            /** entry of struct spi_ep */
+		SPI_WHEEL_FLOW               /** entry of struct spi_flow */
+	} type;
+};
+
+/** Hierarchical timing wheel of expiry checks in single time domain
+ * Level k has SPI_WHEEL_SLOTS slots of 2^(k * SPI_WHEEL_BITS) seconds each */
+struct spi_wheel {
+	mmatic *mm;                      /** mm for the slots */
+	struct spi_source *source;       /** file source in virtual time or NULL for system time */
+	uint32_t now;                    /** current wheel time: all checks up to now were returned */
+	uint32_t count;                  /** number of entries */
+	uint32_t num[SPI_WHEEL_LEVELS];  /** number of entries at given level */
+
+	/** wheel slots */
+	struct spi_wheel_slot {
+		struct spi_wheel_entry *e;   /** entries */
+		uint32_t num;                /** number of entries */
+		uint32_t size;               /** size of the e array */
+	} slots[SPI_WHEEL_LEVELS][SPI_WHEEL_SLOTS];
+
+	struct spi_wheel_slot retry;     /** entries due again in next run, see wheel_retry() */
+};
+
+/** Get wheel of time domain of given source, create if needed
+ * @param spi        spi root or worker shard owning the objects
+ * @param source     packet source: all live sources share system time
+ */
+struct spi_wheel *wheel_get(struct spi *spi, struct spi_source *source);
+
+/** Get current time in the time domain of wheel
+ * @param systime    current system time */
+uint32_t wheel_time(struct spi_wheel *wheel, struct timeval *systime);
+
+/** Schedule expiry check
+ * @param type       SPI_WHEEL_EP or SPI_WHEEL_FLOW
+ * @param now        current time in the wheel time domain
+ * @param expire     time of the check: if already passed, due in current run
+ * @return           actual time of the check: store it in the object to match the entry
+ */
+uint32_t wheel_add(struct spi_wheel *wheel, int type, struct spi_source *source,
+	spi_epaddr_t epa1, spi_epaddr_t epa2, uint32_t now, uint32_t expire);
+
+/** Advance wheel and return next due expiry check
+ * @param now        current time in the wheel time domain (-1 for infinity)
+ * @param e          entry, removed from the wheel
+ * @retval false     no more checks due until now: end of run
+ */
+bool wheel_next(struct spi_wheel *wheel, uint32_t now, struct spi_wheel_entry *e);
+
+/** Put back entry returned by wheel_next(): it will be due again in next run
+ * @note the object keeps its expire time */
+void wheel_retry(struct spi_wheel *wheel, const struct spi_wheel_entry *e);
+
+/** Drop all wheels of spi */
+void wheel_flush(struct spi *spi);
+
+/** Free wheel memory (tlist callback) */
+void wheel_free(void *arg);
+
+#endif
@@ -0,0 +1,804 @@
+/*
+ * spi: Statistical Packet Inspection: worker threads
+ * Copyright (C) 2011 Paweł Foremski <pawel@foremski.pl>
+ * This software is licensed under GNU GPL version 3
+ */
+
+/*
+ * In worker mode, packets are parsed on the main thread and passed to worker
+ * threads by a hash of endpoint address, so each endpoint is always handled by
+ * the same worker. Each worker has its own shard: a struct spi with own
+ * endpoints, signature computation, classification and verdicts, but without
+ * flows and sources. Flows stay on the main thread, because a flow joins two
+ * endpoints that can be handled by different workers.
+ *
+ * Events of a shard are queued and handled in order by the worker thread.
+ * Verdict changes and training samples are passed back to the main thread,
+ * which announces them to its subscribers.
+ *
+ * Ring sources in a fanout group have one socket per worker. Kernel hashes
+ * flows on the sockets, so each worker parses its socket and keeps the flows
+ * in its shard, then passes endpoint packets directly to the owning workers.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <event2/event.h>
+
+#include "settings.h"
+#include "datastructures.h"
+#include "spi.h"
+#include "ep.h"
+#include "flow.h"
+#include "kissp.h"
+#include "source.h"
+#include "worker.h"
+#include "wheel.h"
+#include "trainset.h"
+#include "hash.h"
+
+/********** queues */
+
+static void _queue_init(mmatic *mm, struct worker_queue *q, uint32_t size, uint32_t slot)
+{
+	q->msgs = mmatic_zalloc(mm, size * slot);
+	q->slot = slot;
+	q->size = size;
+}
+
+/** Get free slot at queue tail
+ * @retval NULL      queue full */
+static inline void *_queue_slot(struct worker_queue *q)
+{
+	if (q->tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == q->size)
+		return NULL;
+
+	return q->msgs + (q->tail & (q->size - 1)) * q->slot;
+}
+
+/** Make message in slot from _queue_slot() visible to the consumer */
+static inline void _queue_push(struct worker_queue *q)
+{
+	__atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_SEQ_CST);
+}
+
+/** Get message at queue head
+ * @retval NULL      queue empty */
+static inline void *_queue_peek(struct worker_queue *q)
+{
+	if (q->head == __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST))
+		return NULL;
+
+	return q->msgs + (q->head & (q->size - 1)) * q->slot;
+}
+
+/** Drop message at queue head */
+static inline void _queue_pop(struct worker_queue *q)
+{
+	__atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+}
+
+/********** worker thread side */
+
+/** Find worker of given shard */
+static inline struct worker *_worker(struct spi *spi)
+{
+	return spi->wdata;
+}
+
+/** Wake up the main thread, if not done already */
+static void _notify(struct worker *w)
+{
+	struct workers *ws = w->root->wdata;
+
+	if (__atomic_exchange_n(&w->notified, true, __ATOMIC_SEQ_CST))
+		return;
+
+	while (write(ws->pipe[1], "", 1) < 0 && errno == EINTR);
+}
+
+/** Get slot for a reply, wait if needed */
+static struct worker_reply *_reply_slot(struct worker *w)
+{
+	struct worker_reply *r;
+
+	while (!(r = _queue_slot(&w->out))) {
+		_notify(w);
+		sched_yield();
+	}
+
+	return r;
+}
+
+/** Send reply in slot from _reply_slot() */
+static void _reply_push(struct worker *w)
+{
+	_queue_push(&w->out);
+	_notify(w);
+}
+
+/** Wait for new messages */
+static void _sleep(struct worker *w)
+{
+	/* NB: queues are checked at least each SPI_RING_TIMEOUT */
+	if (w->rings > 0) {
+		poll(w->pfd, w->rings, SPI_RING_TIMEOUT);
+		return;
+	}
+
+	pthread_mutex_lock(&w->lock);
+	__atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+
+	/* NB: re-check after announcing sleep, see _wake() */
+	if (!_queue_peek(&w->in))
+		pthread_cond_wait(&w->cond, &w->lock);
+
+	__atomic_store_n(&w->sleeping, 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/** Receives "endpointVerdictChanged" in worker shard */
+static bool _verdict_changed(struct spi *spi, const char *evname, void *data)
+{
+	struct spi_ep *ep = data;
+	struct worker *w = _worker(spi);
+	struct worker_reply *r;
+
+	r = _reply_slot(w);
+	r->type = WORKER_VERDICT;
+	r->source = ep->source;
+	r->epa = ep->epa;
+	r->verdict = ep->verdict;
+	r->verdict_prob = ep->verdict_prob;
+	r->verdict_count = ep->verdict_count;
+	_reply_push(w);
+
+	return true;
+}
+
+/** Handle packets passed by other workers
+ * @return number of packets */
+static int _mesh_read(struct worker *w)
+{
+	struct workers *ws = w->root->wdata;
+	struct worker_msg *msg;
+	int i, j, n = 0;
+
+	for (i = 0; i < ws->num; i++) {
+		for (j = 0; j < SPI_WORKER_MESH && (msg = _queue_peek(&w->mesh[i])); j++) {
+			ep_new_pkt(w->spi, msg->source, msg->epa, &msg->ts, msg->payload, msg->size);
+			_queue_pop(&w->mesh[i]);
+		}
+		n += j;
+	}
+
+	return n;
+}
+
+/** Read fanout sockets and packets passed by other workers
+ * @return number of packets and frames */
+static int _poll(struct worker *w)
+{
+	int i, n;
+
+	if (w->rings == 0)
+		return 0;
+
+	n = _mesh_read(w);
+	for (i = 0; i < w->rings; i++)
+		n += source_ring_block(w->spi, w->ring[i], &w->ring[i]->as.ring.rx[w->id]);
+
+	return n;
+}
+
+/** Start reading fanout socket */
+static void _ring_add(struct worker *w, struct spi_source *source)
+{
+	struct spi *spi = w->spi;
+
+	/* flows of this socket */
+	if (!spi->flows)
+		spi->flows = flow_table_create(spi->mm);
+
+	w->ring[w->rings] = source;
+	w->pfd[w->rings].fd = source->as.ring.rx[w->id].fd;
+	w->pfd[w->rings].events = POLLIN;
+	w->rings++;
+}
+
+/** Wait until other workers stop reading fanout sockets */
+static void _quit(struct worker *w)
+{
+	struct workers *ws = w->root->wdata;
+
+	if (w->rings == 0)
+		return;
+
+	/* NB: after WORKER_QUIT, workers pass no more packets */
+	__atomic_add_fetch(&ws->quitting, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&ws->quitting, __ATOMIC_SEQ_CST) < ws->num) {
+		if (_mesh_read(w) == 0)
+			sched_yield();
+	}
+
+	_mesh_read(w);
+}
+
+static void *_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct spi *spi = w->spi;
+	struct worker_msg *msg;
+	struct worker_reply *r;
+	int k, n = 0;
+
+	while (true) {
+		k = _poll(w);
+		msg = _queue_peek(&w->in);
+
+		/* no more packets: handle events, then wait */
+		if (!msg) {
+			if (k == 0) {
+				spi_dispatch(spi);
+				_sleep(w);
+				n = 0;
+			} else if ((n += k) >= SPI_PCAP_MAX) {
+				spi_dispatch(spi);
+				n = 0;
+			}
+			continue;
+		}
+
+		switch (msg->type) {
+			case WORKER_PKT:
+				ep_new_pkt(spi, msg->source, msg->epa, &msg->ts, msg->payload, msg->size);
+				break;
+			case WORKER_GC:
+				spi_announce_id(spi, SPI_EV_GC_SUGGESTION, 0, NULL, false);
+				spi_dispatch(spi);
+				break;
+			case WORKER_SYNC:
+				spi_dispatch(spi);
+
+				r = _reply_slot(w);
+				r->type = WORKER_SYNCED;
+				_reply_push(w);
+				break;
+			case WORKER_RING:
+				_ring_add(w, msg->source);
+				break;
+			case WORKER_MEM:
+				spi->mem_limit = __atomic_load_n(
+					&((struct workers *) spi->root->wdata)->mem_limit, __ATOMIC_RELAXED);
+				break;
+			case WORKER_QUIT:
+				_queue_pop(&w->in);
+				_quit(w);
+				spi_dispatch(spi);
+
+				__atomic_store_n(&w->done, true, __ATOMIC_RELEASE);
+				_notify(w);
+				return NULL;
+		}
+
+		_queue_pop(&w->in);
+
+		/* handle events each SPI_PCAP_MAX packets, like the main loop */
+		if ((n += k + 1) >= SPI_PCAP_MAX) {
+			spi_dispatch(spi);
+			n = 0;
+		}
+	}
+
+	return NULL;
+}
+
+void worker_train(struct spi *spi, struct spi_signature *sign)
+{
+	struct worker *w = _worker(spi);
+	struct worker_reply *r;
+	int num;
+
+	for (num = 0; sign->c[num].index != -1; num++);
+	num++;
+
+	r = _reply_slot(w);
+	r->type = WORKER_TRAIN;
+	r->label = sign->label;
+	r->num = num;
+	memcpy(r->c, sign->c, sizeof(struct spi_coordinate) * num);
+	_reply_push(w);
+
+	spi_signature_free(sign);
+}
+
+/********** main thread side */
+
+/** Wake up worker if it sleeps */
+static void _wake(struct worker *w)
+{
+	if (!__atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST))
+		return;
+
+	pthread_mutex_lock(&w->lock);
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/** Free copy of endpoint passed to "endpointVerdictChanged" by _replies() */
+static bool _verdict_free(struct spi *spi, const char *evname, void *data)
+{
+	mmatic_free(data);
+	return true;
+}
+
+/** Handle replies from all workers */
+static void _replies(struct spi *spi)
+{
+	struct workers *ws = spi->wdata;
+	struct worker *w;
+	struct worker_reply *r;
+	struct spi_signature *sign;
+	struct spi_ep *ep;
+	int i;
+
+	for (i = 0; i < ws->num; i++) {
+		w = &ws->w[i];
+
+		/* NB: before reading the queue, so new replies trigger new notification */
+		__atomic_store_n(&w->notified, false, __ATOMIC_SEQ_CST);
+
+		while ((r = _queue_peek(&w->out))) {
+			switch (r->type) {
+				case WORKER_VERDICT:
+					/* NB: released by verdict.c, freed by _verdict_free() */
+					ep = mmatic_zalloc(spi->mm, sizeof *ep);
+					ep->source = r->source;
+					ep->epa = r->epa;
+					ep->verdict = r->verdict;
+					ep->verdict_prob = r->verdict_prob;
+					ep->verdict_count = r->verdict_count;
+					ep->gclock3 = 1;
+					spi_announce_id(spi, SPI_EV_ENDPOINT_VERDICT_CHANGED, 0, ep, false);
+					break;
+				case WORKER_TRAIN:
+					sign = spi_signature_new(spi, r->num);
+					sign->label = r->label;
+					memcpy(sign->c, r->c, sizeof(struct spi_coordinate) * r->num);
+					spi_train(spi, sign);
+					break;
+				case WORKER_SYNCED:
+					if (--ws->syncs == 0)
+						spi_announce_id(spi, SPI_EV_WORKERS_SYNCED, 0, NULL, false);
+					break;
+			}
+
+			_queue_pop(&w->out);
+		}
+	}
+}
+
+/** Pipe read callback */
+static void _replies_cb(int fd, short evtype, void *arg)
+{
+	struct spi *spi = arg;
+	char buf[64];
+
+	while (read(fd, buf, sizeof buf) > 0);
+	_replies(spi);
+}
+
+/** Get slot for a message to worker, wait if needed */
+static struct worker_msg *_msg_slot(struct spi *spi, struct worker *w)
+{
+	struct worker_msg *msg;
+
+	while (!(msg = _queue_slot(&w->in))) {
+		/* NB: worker might be waiting for us */
+		_wake(w);
+		_replies(spi);
+		sched_yield();
+	}
+
+	return msg;
+}
+
+/** Send message in slot from _msg_slot() */
+static void _msg_push(struct worker *w)
+{
+	_queue_push(&w->in);
+	_wake(w);
+}
+
+/** Send control message to all workers */
+static void _broadcast(struct spi *spi, int type)
+{
+	struct workers *ws = spi->wdata;
+	struct worker_msg *msg;
+	int i;
+
+	for (i = 0; i < ws->num; i++) {
+		msg = _msg_slot(spi, &ws->w[i]);
+		msg->type = type;
+		_msg_push(&ws->w[i]);
+	}
+}
+
+/** Receives "sourceClosed": wait for workers to handle its packets */
+static bool _source_closed(struct spi *spi, const char *evname, void *data)
+{
+	struct workers *ws = spi->wdata;
+
+	ws->syncs += ws->num;
+	_broadcast(spi, WORKER_SYNC);
+
+	return true;
+}
+
+/** Add shard stats to main stats (NB: all counters up to train_capped are uint32_t) */
+static void _stats_add(struct spi_stats *dst, const struct spi_stats *src)
+{
+	uint32_t *d = (uint32_t *) dst;
+	const uint32_t *s = (const uint32_t *) src;
+	int i;
+
+	for (i = 0; i <= offsetof(struct spi_stats, train_capped) / sizeof(uint32_t); i++)
+		d[i] += s[i];
+
+	dst->classify_us += src->classify_us;
+}
+
+/**********/
+
+void worker_init(struct spi *spi)
+{
+	struct workers *ws;
+	struct worker *w;
+	uint32_t in_slot, out_slot;
+	int i, rc;
+
+	ws = mmatic_zalloc(spi->mm, sizeof *ws);
+	ws->num = MIN(spi->options.workers, SPI_WORKERS_MAX);
+	ws->w = mmatic_zalloc(spi->mm, sizeof(struct worker) * ws->num);
+	spi->wdata = ws;
+
+	/* share memory budget with shards, see worker_mem() */
+	spi->mem_limit /= ws->num + 1;
+	ws->mem_limit = spi->mem_limit;
+
+	/* wake-ups from workers */
+	if (pipe(ws->pipe) != 0)
+		die("pipe() failed: %s\n", strerror(errno));
+	fcntl(ws->pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(ws->pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(ws->pipe[1], F_SETFD, FD_CLOEXEC);
+
+	ws->ev = event_new(spi->eb, ws->pipe[0], EV_READ | EV_PERSIST, _replies_cb, spi);
+	event_add(ws->ev, 0);
+
+	/* dont announce "finished" before workers are done with closed sources */
+	spi_subscribe(spi, "sourceClosed", _source_closed, false);
+
+	/* endpoints announced in the main thread are copies, see _replies()
+	 * NB: after verdict.c releases them */
+	spi_subscribe_after(spi, "endpointVerdictChanged", _verdict_free, false);
+
+	/* packet with N bytes of payload; training sample with all KISS+ coordinates */
+	in_slot = (sizeof(struct worker_msg) + spi->options.N + 7) & ~7;
+	ws->slot = in_slot;
+	out_slot = (sizeof(struct worker_reply) +
+		sizeof(struct spi_coordinate) * (spi->options.N * 2 + SPI_KISSP_FEATURES + 1) + 7) & ~7;
+
+	for (i = 0; i < ws->num; i++) {
+		w = &ws->w[i];
+		w->id = i;
+		w->root = spi;
+		w->spi = spi_shard_create(spi);
+		w->spi->wdata = w;
+
+		/* pass verdicts to the main thread */
+		spi_subscribe(w->spi, "endpointVerdictChanged", _verdict_changed, false);
+
+		_queue_init(spi->mm, &w->in, SPI_WORKER_QUEUE, in_slot);
+		_queue_init(spi->mm, &w->out, SPI_WORKER_REPLIES, out_slot);
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->cond, NULL);
+
+		rc = pthread_create(&w->thread, NULL, _thread, w);
+		if (rc != 0)
+			die("pthread_create() failed: %s\n", strerror(rc));
+	}
+
+	dbg(3, "started %d worker threads\n", ws->num);
+}
+
+int worker_count(struct spi *spi)
+{
+	struct workers *ws = spi->wdata;
+	return ws->num;
+}
+
+/** Fill packet message */
+static inline void _pkt_msg(struct worker_msg *msg, struct spi_source *source, spi_epaddr_t epa,
+	const struct timeval *ts, const void *data, uint16_t size, int N)
+{
+	msg->type = WORKER_PKT;
+	msg->source = source;
+	msg->epa = epa;
+	msg->ts = *ts;
+	msg->size = size;
+	memcpy(msg->payload, data, N);
+}
+
+void worker_pkt(struct spi *spi, struct spi_source *source, spi_epaddr_t epa,
+	const struct timeval *ts, const void *data, uint16_t size)
+{
+	struct workers *ws = source->spi->wdata;
+	struct worker *w, *me;
+	struct worker_queue *q;
+	struct worker_msg *msg;
+
+	/* map hash uniformly on [0, num) */
+	w = &ws->w[((hash_u64(epa) >> 32) * ws->num) >> 32];
+
+	/* main thread */
+	if (!spi->root) {
+		msg = _msg_slot(spi, w);
+		_pkt_msg(msg, source, epa, ts, data, size, spi->options.N);
+		_msg_push(w);
+		return;
+	}
+
+	/* worker reading fanout socket */
+	me = _worker(spi);
+	if (w == me) {
+		ep_new_pkt(spi, source, epa, ts, (void *) data, size);
+		return;
+	}
+
+	/* NB: handle own queues while waiting, the receiver might wait for us */
+	q = &w->mesh[me->id];
+	while (!(msg = _queue_slot(q))) {
+		if (_mesh_read(me) == 0)
+			sched_yield();
+	}
+
+	_pkt_msg(msg, source, epa, ts, data, size, spi->options.N);
+	_queue_push(q);
+}
+
+int worker_ring(struct spi_source *source)
+{
+	struct spi *spi = source->spi;
+	struct workers *ws = spi->wdata;
+	struct worker_msg *msg;
+	int i, j;
+
+	if (ws->rings == SPI_WORKER_RINGS) {
+		dbg(0, "too many fanout sources (max. %d)\n", SPI_WORKER_RINGS);
+		return -1;
+	}
+
+	/* queues between workers, on first fanout source */
+	if (ws->rings++ == 0) {
+		for (i = 0; i < ws->num; i++) {
+			ws->w[i].mesh = mmatic_zalloc(spi->mm, sizeof(struct worker_queue) * ws->num);
+			for (j = 0; j < ws->num; j++)
+				_queue_init(spi->mm, &ws->w[i].mesh[j], SPI_WORKER_MESH, ws->slot);
+		}
+	}
+
+	for (i = 0; i < ws->num; i++) {
+		msg = _msg_slot(spi, &ws->w[i]);
+		msg->type = WORKER_RING;
+		msg->source = source;
+		_msg_push(&ws->w[i]);
+	}
+
+	return 0;
+}
+
+void worker_mem(struct spi *spi)
+{
+	struct workers *ws = spi->wdata;
+	struct spi_source *source;
+	uint64_t total = (uint64_t) spi->options.mem_limit << 20, share;
+	bool root = false;
+
+	/* NB: offline learning shards and fanout sockets parse packets in other threads */
+	tlist_iter_loop(spi->sources, source) {
+		if (!source->closed && !source->offline && source->fd >= 0)
+			root = true;
+	}
+
+	share = root ? total / (ws->num + 1) : total / ws->num;
+	if (share == ws->mem_limit || ws->stopped)
+		return;
+
+	/* NB: shards above the new share evict on next allocation */
+	__atomic_store_n(&ws->mem_limit, share, __ATOMIC_RELAXED);
+	_broadcast(spi, WORKER_MEM);
+}
+
+void worker_gc(struct spi *spi)
+{
+	struct workers *ws = spi->wdata;
+
+	if (!ws->stopped)
+		_broadcast(spi, WORKER_GC);
+}
+
+bool worker_busy(struct spi *spi)
+{
+	struct workers *ws = spi->wdata;
+	return (ws && ws->syncs > 0);
+}
+
+void worker_stop(struct spi *spi)
+{
+	struct workers *ws = spi->wdata;
+	struct worker *w;
+	int i;
+
+	if (ws->stopped)
+		return;
+
+	ws->stopped = true;
+	_broadcast(spi, WORKER_QUIT);
+
+	for (i = 0; i < ws->num; i++) {
+		w = &ws->w[i];
+
+		/* NB: worker might be waiting for us */
+		while (!__atomic_load_n(&w->done, __ATOMIC_ACQUIRE)) {
+			_replies(spi);
+			sched_yield();
+		}
+
+		pthread_join(w->thread, NULL);
+	}
+
+	/* last verdicts and training samples */
+	_replies(spi);
+
+	/* close flows and endpoints, collect their stats */
+	for (i = 0; i < ws->num; i++) {
+		w = &ws->w[i];
+		if (w->spi->flows)
+			flow_table_flush(w->spi->flows);
+		ep_table_flush(w->spi->eps);
+		wheel_flush(w->spi);
+		_stats_add(&spi->stats, &w->spi->stats);
+	}
+}
+
+/********** offline learning */
+
+static void *_learn_thread(void *arg)
+{
+	struct worker_learn *wl = arg;
+	struct spi *spi;
+	int i;
+
+	while ((i = __atomic_fetch_add(&wl->next, 1, __ATOMIC_RELAXED)) < wl->num) {
+		/* own endpoints, flows and training samples for each file */
+		spi = spi_shard_create(wl->root);
+		spi->flows = flow_table_create(spi->mm);
+		spi->traindata = tlist_create(NULL, spi->mm);
+		spi->mem_limit = ((uint64_t) spi->options.mem_limit << 20) / MIN(spi->options.learn_threads, wl->num);
+
+		source_file_learn(spi, wl->sources[i]);
+		ep_table_flush(spi->eps);
+		wheel_flush(spi);
+
+		wl->shards[i] = spi;
+	}
+
+	return NULL;
+}
+
+void worker_learn(struct spi *spi)
+{
+	struct worker_learn wl;
+	struct spi_source *source;
+	struct spi_signature *sign, *copy;
+	pthread_t *threads;
+	int i, num, n, c, rc;
+
+	memset(&wl, 0, sizeof wl);
+	wl.root = spi;
+
+	tlist_iter_loop(spi->sources, source) {
+		if (source->offline && !source->closed)
+			wl.num++;
+	}
+
+	if (wl.num == 0)
+		return;
+
+	wl.sources = mmatic_zalloc(spi->mm, sizeof(struct spi_source *) * wl.num);
+	wl.shards = mmatic_zalloc(spi->mm, sizeof(struct spi *) * wl.num);
+
+	i = 0;
+	tlist_iter_loop(spi->sources, source) {
+		if (source->offline && !source->closed)
+			wl.sources[i++] = source;
+	}
+
+	num = MIN(spi->options.learn_threads, wl.num);
+	threads = mmatic_zalloc(spi->mm, sizeof(pthread_t) * num);
+
+	dbg(3, "reading %d learning files in %d threads\n", wl.num, num);
+
+	for (i = 0; i < num; i++) {
+		rc = pthread_create(&threads[i], NULL, _learn_thread, &wl);
+		if (rc != 0)
+			die("pthread_create() failed: %s\n", strerror(rc));
+	}
+
+	for (i = 0; i < num; i++)
+		pthread_join(threads[i], NULL);
+
+	/* merge training samples in order of sources */
+	for (i = 0; i < wl.num; i++) {
+		n = 0;
+		tlist_iter_loop(wl.shards[i]->traindata, sign) {
+			for (c = 0; sign->c[c].index != -1; c++);
+			c++;
+
+			copy = spi_signature_new(spi, c);
+			copy->label = sign->label;
+			memcpy(copy->c, sign->c, sizeof(struct spi_coordinate) * c);
+
+			trainset_add(spi, copy);
+			n++;
+		}
+
+		spi->stats.learned_pkt += n;
+		spi_shard_free(wl.shards[i]);
+	}
+
+	/* train once, then go on as if the sources were read in the event loop */
+	spi_announce_id(spi, SPI_EV_TRAINDATA_UPDATED, 0, NULL, false);
+	for (i = 0; i < wl.num; i++)
+		spi_announce_id(spi, SPI_EV_SOURCE_CLOSED, 0, wl.sources[i], false);
+
+	mmatic_free(threads);
+	mmatic_free(wl.shards);
+	mmatic_free(wl.sources);
+}
+
+void worker_free(struct spi *spi)
+{
+	struct workers *ws = spi->wdata;
+	struct worker *w;
+	int i, j;
+
+	worker_stop(spi);
+
+	for (i = 0; i < ws->num; i++) {
+		w = &ws->w[i];
+		spi_shard_free(w->spi);
+		mmatic_free(w->in.msgs);
+		mmatic_free(w->out.msgs);
+		if (w->mesh) {
+			for (j = 0; j < ws->num; j++)
+				mmatic_free(w->mesh[j].msgs);
+			mmatic_free(w->mesh);
+		}
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->cond);
+	}
+
+	event_del(ws->ev);
+	event_free(ws->ev);
+	close(ws->pipe[0]);
+	close(ws->pipe[1]);
+
+	mmatic_free(ws->w);
+	mmatic_free(ws);
+	spi->wdata = NULL;
+}
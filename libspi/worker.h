@@ -0,0 +1,163 @@
+/*
+ * spi: Statistical Packet Inspection: worker threads
+ * Copyright (C) 2011 Paweł Foremski <pawel@foremski.pl>
+ * This software is licensed under GNU GPL version 3
+ */
+
+#ifndef _WORKER_H_
+#define _WORKER_H_
+
+#include <pthread.h>
+#include <poll.h>
+
+#include "settings.h"
+#include "datastructures.h"
+
+/** Single-producer, single-consumer queue of fixed-size messages */
+struct worker_queue {
+	uint8_t *msgs;                   /** message slots */
+	uint32_t slot;                   /** size of message slot */
+	uint32_t size;                   /** number of slots: a power of 2 */
+
+	/* NB: free-running counters, on separate cache lines */
+	uint32_t head __attribute__ ((aligned (64)));   /** consumer position */
+	uint32_t tail __attribute__ ((aligned (64)));   /** producer position */
+};
+
+/** Message to worker thread */
+struct worker_msg {
+	enum {
+		WORKER_PKT = 1,              /** new packet of endpoint */
+		WORKER_GC,                   /** run garbage collector */
+		WORKER_SYNC,                 /** finish all work queued so far, then reply */
+		WORKER_QUIT,                 /** finish work and exit */
+		WORKER_RING,                 /** start reading fanout socket of source */
+		WORKER_MEM                   /** apply new share of memory budget, see worker_mem() */
+	} type;
+
+	struct spi_source *source;       /** packet source */
+	spi_epaddr_t epa;                /** endpoint address */
+	struct timeval ts;               /** packet timestamp */
+	uint16_t size;                   /** real packet size */
+	uint8_t payload[];               /** payload (N bytes) */
+};
+
+/** Message from worker thread */
+struct worker_reply {
+	enum {
+		WORKER_VERDICT = 1,          /** endpoint verdict changed */
+		WORKER_TRAIN,                /** new training sample */
+		WORKER_SYNCED                /** reply to WORKER_SYNC */
+	} type;
+
+	/* copy of endpoint verdict: the worker keeps updating the endpoint */
+	struct spi_source *source;       /** endpoint source */
+	spi_epaddr_t epa;                /** endpoint address */
+	spi_label_t verdict;             /** endpoint verdict */
+	double verdict_prob;             /** verdict probability */
+	uint32_t verdict_count;          /** number of verdicts so far */
+
+	spi_label_t label;               /** training sample label */
+	int num;                         /** number of coordinates, including the terminator */
+	struct spi_coordinate c[];       /** training sample coordinates */
+};
+
+/** Worker thread */
+struct worker {
+	int id;                          /** worker index */
+	struct spi *spi;                 /** worker shard */
+	struct spi *root;                /** main spi */
+	pthread_t thread;                /** the thread */
+	bool done;                       /** thread finished */
+
+	struct worker_queue in;          /** messages to worker */
+	struct worker_queue out;         /** replies from worker */
+	bool notified;                   /** main thread notified about replies */
+
+	pthread_mutex_t lock;            /** for sleeping on empty queue */
+	pthread_cond_t cond;             /** signalled on new message */
+	int sleeping;                    /** worker waits on cond */
+	/* fanout sockets, see source_ring_init() */
+	struct worker_queue *mesh;       /** packets from other workers, indexed by sender id */
+	int rings;                       /** number of fanout sources read */
+	struct spi_source *ring[SPI_WORKER_RINGS];    /** fanout sources read */
+	struct pollfd pfd[SPI_WORKER_RINGS];          /** for sleeping on sockets */
+};
+
+/** Worker threads data */
+struct workers {
+	int num;                         /** number of workers */
+	struct worker *w;                /** workers */
+	int syncs;                       /** number of WORKER_SYNC replies to wait for */
+	bool stopped;                    /** worker_stop() called */
+	uint32_t slot;                   /** size of packet message */
+	int rings;                       /** number of fanout sources */
+	uint64_t mem_limit;              /** memory budget of each shard [B], NB: atomic */
+	int quitting;                    /** number of workers handling WORKER_QUIT */
+
+	int pipe[2];                     /** worker -> main thread wake-ups */
+	struct event *ev;                /** pipe read event */
+};
+
+/** Offline learning: files read by a pool of threads */
+struct worker_learn {
+	struct spi *root;                /** main spi */
+	int num;                         /** number of sources */
+	struct spi_source **sources;     /** learning file sources */
+	struct spi **shards;             /** shard that read given source */
+	int next;                        /** next source to read */
+};
+
+/** Start worker threads */
+void worker_init(struct spi *spi);
+
+/** Get number of worker threads */
+int worker_count(struct spi *spi);
+
+/** Pass packet to the worker owning given endpoint
+ * @param spi        spi root or worker shard that parsed the packet
+ * @param source     packet source
+ * @param epa        endpoint address
+ * @param ts         packet timestamp
+ * @param data       payload (N bytes)
+ * @param size       real packet size
+ */
+void worker_pkt(struct spi *spi, struct spi_source *source, spi_epaddr_t epa,
+	const struct timeval *ts, const void *data, uint16_t size);
+
+/** Make each worker thread read its socket of a fanout source
+ * @param source     ring source with one socket per worker
+ * @retval -1        too many fanout sources
+ */
+int worker_ring(struct spi_source *source);
+
+/** Share memory budget between the root and shards, after sources changed
+ *
+ * The root keeps the flows of sources it parses, so while it reads any, the
+ * budget is split evenly between the root and shards. Otherwise, e.g. with
+ * fanout sources only, the shards own all flows and share the whole budget.
+ */
+void worker_mem(struct spi *spi);
+
+/** Run garbage collector in all workers */
+void worker_gc(struct spi *spi);
+
+/** Pass training sample from worker shard to the main thread
+ * @param spi        worker shard
+ * @param sign       signature (freed)
+ */
+void worker_train(struct spi *spi, struct spi_signature *sign);
+
+/** Check if workers still handle packets of closed sources */
+bool worker_busy(struct spi *spi);
+
+/** Read offline learning sources in parallel and merge training samples, see spi_learn() */
+void worker_learn(struct spi *spi);
+
+/** Stop worker threads and close their endpoints */
+void worker_stop(struct spi *spi);
+
+/** Free worker threads memory */
+void worker_free(struct spi *spi);
+
+#endif
@@ -3,9 +3,20 @@
  * This software is licensed under GNU GPL version 3
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "samplefile.h"
 
-int sf_read(struct spid *spid, const char *path)
+/** Size of sample labels in binary file, including the padding */
+#define SF_LABELS_SIZE(samples) (((samples) + 7) & ~((uint64_t) 7))
+
+/** Read text sample file, line format: protocol coordinate1 coordinate2 ... */
+static int _read_text(struct spid *spid, const char *path)
 {
 	FILE *fp;
 	char buf[1024], *cur, *next;
@@ -38,14 +49,13 @@ int sf_read(struct spid *spid, const char *path)
 			cols = cols + 1 + 1 - 1;
 		}
 
-		sign = mmatic_zalloc(spid->mm, sizeof *sign);
-		sign->c = mmatic_zalloc(spid->mm, cols * sizeof *(sign->c));
-
 		/* read proto name */
 		cur = buf;
 		next = strchr(cur, ' ');
 		if (!next) continue;
 		*next++ = '\0';
+
+		sign = spi_signature_new(spid->spi, cols);
 		sign->label = proto_label(cur);
 
 		/* read coordinates */
@@ -69,6 +79,7 @@ int sf_read(struct spid *spid, const char *path)
 		} else {
 			dbg(2, "%s#%d: invalid number of columns (%d, expected %d)\n",
 				path, line, i, cols-2);
+			spi_signature_free(sign);
 		}
 	}
 
@@ -78,26 +89,271 @@ int sf_read(struct spid *spid, const char *path)
 	return j;
 }
 
-int sf_write(struct spid *spid, const char *path)
+/** Read binary sample file, see struct sf_header */
+static int _read_bin(struct spid *spid, const char *path, int fd)
 {
-	FILE *fp;
+	struct stat st;
+	uint8_t *map;
+	const struct sf_header *h;
+	const char *names;
+	const uint8_t *labels;
+	const double *x;
+	spi_label_t label[SPI_LABEL_MAX + 1];
+	char name[SF_PROTO_LEN];
 	struct spi_signature *sign;
-	int i, j = 0;
+	uint64_t i, size;
+	uint32_t j;
 
-	fp = fopen(path, "w");
-	if (!fp) {
-		dbg(0, "%s: opening for write failed: %m\n", path);
+	if (fstat(fd, &st) != 0) {
+		dbg(0, "%s: fstat() failed: %m\n", path);
+		return -1;
+	}
+
+	if (st.st_size < (off_t) sizeof *h) {
+		dbg(0, "%s: file truncated\n", path);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		dbg(0, "%s: mmap() failed: %m\n", path);
+		return -1;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	/* check header */
+	h = (const struct sf_header *) map;
+	if (h->version != SF_VERSION) {
+		dbg(0, "%s: unsupported file version %u\n", path, h->version);
+		goto fail;
+	}
+
+	if (h->N != spid->spi_opts.N || h->C != spid->spi_opts.C) {
+		dbg(0, "%s: signatures computed for N=%u C=%u, not N=%u C=%u\n", path,
+			h->N, h->C, spid->spi_opts.N, spid->spi_opts.C);
+		goto fail;
+	}
+
+	/* NB: KISS and KISS+ signatures differ in size */
+	if (h->samples > 0 && h->features != spi_signature_features(spid->spi)) {
+		dbg(0, "%s: signatures have %u features, not %d (KISS vs KISS+?)\n", path,
+			h->features, spi_signature_features(spid->spi));
+		goto fail;
+	}
+
+	/* check size, avoiding overflows */
+	size = sizeof *h + (uint64_t) h->labels * SF_PROTO_LEN;
+	if (h->labels > SPI_LABEL_MAX || h->samples > (uint64_t) st.st_size
+		|| size + SF_LABELS_SIZE(h->samples) > (uint64_t) st.st_size) {
+		dbg(0, "%s: file truncated or corrupted\n", path);
+		goto fail;
+	}
+	size += SF_LABELS_SIZE(h->samples);
+
+	if (h->samples > 0 && (h->features == 0 || h->samples > INT32_MAX
+		|| (st.st_size - size) / sizeof(double) / h->features < h->samples)) {
+		dbg(0, "%s: file truncated or corrupted\n", path);
+		goto fail;
+	}
+
+	names = (const char *) (h + 1);
+	labels = (const uint8_t *) (names + h->labels * SF_PROTO_LEN);
+	x = (const double *) (labels + SF_LABELS_SIZE(h->samples));
+
+	/* translate file labels into ours */
+	for (j = 0; j <= SPI_LABEL_MAX; j++)
+		label[j] = proto_label("unknown");
+
+	for (j = 0; j < h->labels; j++) {
+		memcpy(name, names + j * SF_PROTO_LEN, SF_PROTO_LEN);
+		name[SF_PROTO_LEN - 1] = '\0';
+		label[j + 1] = proto_label(name);
+	}
+
+	/* NB: coordinates are copied straight from the mapping */
+	for (i = 0; i < h->samples; i++) {
+		sign = spi_signature_new(spid->spi, h->features + 1);
+		sign->label = label[labels[i]];
+
+		for (j = 0; j < h->features; j++) {
+			sign->c[j].index = j + 1;
+			sign->c[j].value = x[j];
+		}
+		sign->c[j].index = -1;
+		x += h->features;
+
+		spi_trainqueue(spid->spi, sign);
+	}
+
+	munmap(map, st.st_size);
+	dbg(1, "%s: read %d samples into trainqueue\n", path, (int) i);
+
+	return i;
+
+fail:
+	munmap(map, st.st_size);
+	return -1;
+}
+
+int sf_read(struct spid *spid, const char *path)
+{
+	int fd, rc;
+	char magic[4];
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		dbg(0, "%s: opening for read failed: %m\n", path);
 		return -1;
 	}
 
-	tlist_iter_loop(spid->spi->traindata, sign) {
+	/* binary or text? */
+	if (read(fd, magic, sizeof magic) == sizeof magic && memcmp(magic, SF_MAGIC, sizeof magic) == 0)
+		rc = _read_bin(spid, path, fd);
+	else
+		rc = _read_text(spid, path);
+
+	close(fd);
+	return rc;
+}
+
+/** Get samples to write: all learned ones, if filtered for training */
+static tlist *_samples(struct spid *spid)
+{
+	return spid->spi->trainraw ? spid->spi->trainraw : spid->spi->traindata;
+}
+
+/** Write samples as text, one per line */
+static int _write_text(struct spid *spid, FILE *fp)
+{
+	tlist *samples = _samples(spid);
+	struct spi_signature *sign;
+	int i, j = 0;
+
+	tlist_iter_loop(samples, sign) {
 		fprintf(fp, "%s", label_proto(sign->label));
 		for (i = 0; sign->c[i].index != -1; i++)
-			fprintf(fp, " %g", sign->c[i].value);
+			fprintf(fp, " %.17g", sign->c[i].value);
 		fprintf(fp, "\n");
 		j++;
 	}
 
+	return j;
+}
+
+/** Write samples in binary format, see struct sf_header */
+static int _write_bin(struct spid *spid, FILE *fp, const char *path)
+{
+	tlist *samples = _samples(spid);
+	struct sf_header h;
+	struct spi_signature *sign;
+	char name[SF_PROTO_LEN];
+	uint8_t pad[8] = { 0 };
+	spi_label_t max = 0;
+	int i, features = -1, j = 0;
+
+	/* check samples */
+	tlist_iter_loop(samples, sign) {
+		for (i = 0; sign->c[i].index != -1; i++);
+
+		if (features < 0) {
+			features = i;
+		} else if (i != features) {
+			dbg(0, "%s: samples of different sizes (%d and %d)\n", path, features, i);
+			return -1;
+		}
+
+		if (sign->label > max)
+			max = sign->label;
+		j++;
+	}
+
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, SF_MAGIC, sizeof h.magic);
+	h.version = SF_VERSION;
+	h.N = spid->spi_opts.N;
+	h.C = spid->spi_opts.C;
+	h.features = features > 0 ? features : 0;
+	h.labels = max;
+	h.samples = j;
+	fwrite(&h, sizeof h, 1, fp);
+
+	/* label table */
+	for (i = 1; i <= max; i++) {
+		memset(name, 0, sizeof name);
+		strncpy(name, label_proto(i), sizeof name - 1);
+		fwrite(name, sizeof name, 1, fp);
+	}
+
+	/* sample labels */
+	tlist_iter_loop(samples, sign)
+		fputc(sign->label, fp);
+	fwrite(pad, 1, SF_LABELS_SIZE(h.samples) - h.samples, fp);
+
+	/* coordinates */
+	{
+		double row[h.features + 1];
+
+		tlist_iter_loop(samples, sign) {
+			for (i = 0; i < h.features; i++)
+				row[i] = sign->c[i].value;
+			fwrite(row, sizeof(double), h.features, fp);
+		}
+	}
+
+	return j;
+}
+
+int sf_write(struct spid *spid, const char *path, bool text)
+{
+	FILE *fp;
+	struct stat st;
+	char tmp[PATH_MAX];
+	bool direct;
+	int j;
+
+	/* write to a temporary file first, so a failure does not destroy the database
+	 * NB: special files, e.g. pipes, are written directly */
+	direct = (stat(path, &st) == 0 && !S_ISREG(st.st_mode));
+	snprintf(tmp, sizeof tmp, direct ? "%s" : "%s.tmp", path);
+
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		dbg(0, "%s: opening for write failed: %m\n", tmp);
+		return -1;
+	}
+
+	if (text)
+		j = _write_text(spid, fp);
+	else
+		j = _write_bin(spid, fp, path);
+
+	if (j < 0)
+		goto fail;
+
+	if (fflush(fp) != 0 || ferror(fp) || (!direct && fsync(fileno(fp)) != 0)) {
+		dbg(0, "%s: writing failed: %m\n", tmp);
+		goto fail;
+	}
+
+	if (fclose(fp) != 0) {
+		fp = NULL;
+		dbg(0, "%s: closing failed: %m\n", tmp);
+		goto fail;
+	}
+
+	if (!direct && rename(tmp, path) != 0) {
+		dbg(0, "%s: rename to %s failed: %m\n", tmp, path);
+		unlink(tmp);
+		return -1;
+	}
+
 	dbg(1, "%s: written %d samples\n", path, j);
 	return j;
+
+fail:
+	if (fp)
+		fclose(fp);
+	if (!direct)
+		unlink(tmp);
+	return -1;
 }
@@ -8,7 +8,34 @@
 
 #include "spid.h"
 
+/** Magic bytes of binary sample file */
+#define SF_MAGIC "SPDB"
+
+/** Version of binary sample file format */
+#define SF_VERSION 1
+
+/** Size of protocol name in label table, including the terminating zero */
+#define SF_PROTO_LEN 32
+
+/** Header of binary sample file, in host byte order
+ *
+ * The header is followed by:
+ *  - label table: labels x char[SF_PROTO_LEN], protocol name of label 1, 2, ...
+ *  - sample labels: samples x uint8_t, padded with zeros to multiple of 8 bytes
+ *  - coordinates: samples x features x double, sample by sample
+ */
+struct sf_header {
+	char magic[4];                 /** SF_MAGIC */
+	uint32_t version;              /** SF_VERSION */
+	uint32_t N;                    /** libspi N the signatures were computed with */
+	uint32_t C;                    /** libspi C the signatures were computed with */
+	uint32_t features;             /** number of coordinates in each sample */
+	uint32_t labels;               /** number of entries in label table */
+	uint64_t samples;              /** number of samples */
+};
+
 /** Read sample file into libspi trainqueue
+ * Binary files are memory-mapped, text files are parsed line by line.
  * @note does not issue spi_trainqueue_commit()
  * @return number of samples read
  * @retval -1 error
@@ -16,9 +43,11 @@
 int sf_read(struct spid *spid, const char *path);
 
 /** Write libspi samples into file
+ * The file is replaced atomically, after its data reaches the disk.
+ * @param text     write text file instead of binary
  * @return number of samples written
  * @retval -1 error
  */
-int sf_write(struct spid *spid, const char *path);
+int sf_write(struct spid *spid, const char *path, bool text);
 
 #endif
@@ -28,11 +28,38 @@ static void help(void)
 	printf("  --learndb=<file> learn according to <file>, line format:\n");
 	printf("                   protocol file [filter]\n");
 	printf("                   protocol interface [filter]\n");
-	printf("  --signdb=<file>  signature database file\n");
+	printf("  --signdb=<file>  signature database file, trained model is kept in <file>.model\n");
+	printf("  --signdb-import=<file>\n");
+	printf("                   convert text signature database <file> into --signdb and exit\n");
+	printf("  --signdb-export=<file>\n");
+	printf("                   convert --signdb into text signature database <file> and exit\n");
 	printf("  --test=<lspec>   as --learn, but use the source for testing\n");
 	printf("  --testdb=<file>  as --learndb, but use all sources for testing\n");
 	printf("\n");
 	printf("  --kiss-std       use standard KISS algorithm (without flow extensions)\n");
+	printf("  --kiss-stream    compute signatures incrementally, without storing packets\n");
+	printf("  --workers=<num>  handle endpoints in <num> worker threads [0]\n");
+	printf("  --learn-threads=<num>\n");
+	printf("                   read learning pcap files in <num> threads, then train once [0]\n");
+	printf("  --classifier=<name>\n");
+	printf("                   classifier backend: rbf (libsvm RBF kernel), linear (weight\n");
+	printf("                   vectors, faster but usually less accurate), rff (linear on\n");
+	printf("                   random Fourier features approximating rbf) or forest (random\n");
+	printf("                   forest of decision trees) [rbf]\n");
+	printf("  --rff-dim=<num>  number of random Fourier features for --classifier=rff [%d]\n",
+		SPI_DEFAULT_RFF_DIM);
+	printf("  --online         learn new samples online, retraining from scratch only\n");
+	printf("                   now and then (linear and rff classifiers)\n");
+	printf("  --keep-dups      keep duplicate learning samples\n");
+	printf("  --dedup-step=<x> treat learning samples with coordinates equal after rounding\n");
+	printf("                   to multiples of <x> as duplicates [%g]\n", SPI_DEFAULT_TRAIN_QUANT);
+	printf("  --train-cap=<num>\n");
+	printf("                   keep at most <num> random learning samples of each protocol [0 = no limit]\n");
+	printf("  --mem-limit=<MB> keep endpoints and flows within <MB> megabytes, evicting\n");
+	printf("                   the least recently active ones [0 = no limit]\n");
+	printf("  --ring           sniff interfaces using AF_PACKET mmap ring instead of libpcap\n");
+	printf("  --fanout=<group> as --ring, but read each interface in all worker threads,\n");
+	printf("                   using PACKET_FANOUT group <group> (requires --workers)\n");
 	printf("  --verdict-threshold=<t>\n");
 	printf("                   treat verdicts with probability below <t>%% as unknowns [%.0f]\n",
 		SPI_DEFAULT_VERDICT_THRESHOLD * 100);
@@ -197,6 +224,8 @@ fail:
 static int parse_config(int argc, char *argv[])
 {
 	int i, c;
+	size_t len;
+	char *model;
 
 	static char *short_opts = "hvd";
 	static struct option long_opts[] = {
@@ -211,6 +240,7 @@ static int parse_config(int argc, char *argv[])
 		{ "learndb",     1, NULL,  8 },
 		{ "signdb",      1, NULL,  9 },
 		{ "kiss-std",    0, NULL, 10 },
+		{ "kiss-stream", 0, NULL, 11 },
 		{ "verdict-ewma-len",  1, NULL, 12 },
 		{ "verdict-simple",    0, NULL, 13 },
 		{ "verdict-threshold", 1, NULL, 14 },
@@ -219,18 +249,33 @@ static int parse_config(int argc, char *argv[])
 		{ "test",        1, NULL,  17 },
 		{ "testdb",      1, NULL,  18 },
 		{ "stats",       0, NULL,  19 },
+		{ "workers",     1, NULL,  20 },
+		{ "ring",        0, NULL,  21 },
+		{ "fanout",      1, NULL,  22 },
+		{ "learn-threads", 1, NULL, 23 },
+		{ "mem-limit",   1, NULL,  24 },
+		{ "signdb-import", 1, NULL, 25 },
+		{ "signdb-export", 1, NULL, 26 },
+		{ "classifier",  1, NULL,  27 },
+		{ "rff-dim",     1, NULL,  28 },
+		{ "online",      0, NULL,  29 },
+		{ "keep-dups",   0, NULL,  30 },
+		{ "dedup-step",  1, NULL,  31 },
+		{ "train-cap",   1, NULL,  32 },
 		{ 0, 0, 0, 0 }
 	};
 
 	/* set defaults */
 	spid->options.daemonize = false;
 	spid->options.pidfile = SPID_PIDFILE;
+	spid->options.fanout = -1;
 
 	/* libspi */
 	spid->spi_opts.N = SPI_DEFAULT_N;
 	spid->spi_opts.P = SPI_DEFAULT_P;
 	spid->spi_opts.C = SPI_DEFAULT_C;
 	spid->spi_opts.verdict_threshold = SPI_DEFAULT_VERDICT_THRESHOLD;
+	spid->spi_opts.train_quant = SPI_DEFAULT_TRAIN_QUANT;
 
 	for (;;) {
 		c = getopt_long(argc, argv, short_opts, long_opts, &i);
@@ -258,6 +303,7 @@ static int parse_config(int argc, char *argv[])
 					break;
 			case  9 : spid->options.signdb = mmatic_strdup(spid->mm, optarg); break;
 			case 10 : spid->spi_opts.kiss_std = true; break;
+			case 11 : spid->spi_opts.kiss_stream = true; break;
 			case 12 : spid->spi_opts.verdict_ewma_len = atoi(optarg); break;
 			case 13 : spid->spi_opts.verdict_simple = true; break;
 			case 14 : spid->spi_opts.verdict_threshold = ((double) atoi(optarg)) / 100.0; break;
@@ -274,10 +320,59 @@ static int parse_config(int argc, char *argv[])
 				else
 					break;
 			case 19 : spid->options.stats = true; break;
+			case 20 : spid->spi_opts.workers = atoi(optarg); break;
+			case 21 : spid->options.ring = true; break;
+			case 22 : spid->options.ring = true; spid->options.fanout = atoi(optarg); break;
+			case 23 : spid->spi_opts.learn_threads = atoi(optarg); break;
+			case 24 : spid->spi_opts.mem_limit = atoi(optarg); break;
+			case 25 : spid->options.signdb_import = mmatic_strdup(spid->mm, optarg); break;
+			case 26 : spid->options.signdb_export = mmatic_strdup(spid->mm, optarg); break;
+			case 27 :
+				if (strcmp(optarg, "rbf") == 0) {
+					spid->spi_opts.classifier = SPI_CLASSIFIER_RBF;
+				} else if (strcmp(optarg, "linear") == 0) {
+					spid->spi_opts.classifier = SPI_CLASSIFIER_LINEAR;
+				} else if (strcmp(optarg, "rff") == 0) {
+					spid->spi_opts.classifier = SPI_CLASSIFIER_RFF;
+				} else if (strcmp(optarg, "forest") == 0) {
+					spid->spi_opts.classifier = SPI_CLASSIFIER_FOREST;
+				} else {
+					dbg(0, "Invalid classifier: %s\n", optarg);
+					return 2;
+				}
+				break;
+			case 28 : spid->spi_opts.rff_dim = atoi(optarg); break;
+			case 29 : spid->spi_opts.online = true; break;
+			case 30 : spid->spi_opts.train_dups = true; break;
+			case 31 : spid->spi_opts.train_quant = atof(optarg); break;
+			case 32 : spid->spi_opts.train_cap = atoi(optarg); break;
 			default: help(); return 2;
 		}
 	}
 
+	if ((spid->options.signdb_import || spid->options.signdb_export) && !spid->options.signdb) {
+		dbg(0, "Converting signature database requires --signdb option.\n");
+		return 2;
+	}
+
+	/* keep trained model next to the signatures */
+	if (spid->options.signdb && !spid->options.signdb_import && !spid->options.signdb_export) {
+		len = strlen(spid->options.signdb) + sizeof ".model";
+		model = mmatic_alloc(spid->mm, len);
+		snprintf(model, len, "%s.model", spid->options.signdb);
+		spid->spi_opts.model_file = model;
+
+		/* save all signatures, not only the ones kept for training */
+		if (!spid->spi_opts.train_dups || spid->spi_opts.train_cap)
+			spid->spi_opts.train_raw = true;
+	}
+
+	/* conversion keeps all signatures */
+	if (spid->options.signdb_import || spid->options.signdb_export) {
+		spid->spi_opts.train_dups = true;
+		spid->spi_opts.train_cap = 0;
+	}
+
 	/* check if there are any potential learning sources */
 	if (tlist_count(spid->learn) == 0 && !spid->options.signdb) {
 		dbg(0, "No learning sources. Provide --learn, --learndb or --signdb options.\n");
@@ -296,17 +391,31 @@ static int parse_config(int argc, char *argv[])
 static bool start_sourcelist(tlist *sources)
 {
 	struct source *src;
-	int rc;
+	int rc, len;
 	spi_source_t type;
+	const char *args;
+	char buf[BUFSIZ];
 
 	tlist_iter_loop(sources, src) {
+		args = src->cmd;
+
 		if (src->cmd[0] == '.' || src->cmd[0] == '/' || src->cmd[0] == '~' || pjf_isfile(src->cmd) > 0) {
 			type = SPI_SOURCE_FILE;
+		} else if (spid->options.ring) {
+			type = SPI_SOURCE_RING;
+
+			/* "<interface> [filter]" -> "<interface>@<group> [filter]" */
+			if (spid->options.fanout >= 0) {
+				len = strcspn(src->cmd, " ");
+				snprintf(buf, sizeof buf, "%.*s@%d%s",
+					len, src->cmd, spid->options.fanout, src->cmd + len);
+				args = buf;
+			}
 		} else {
 			type = SPI_SOURCE_SNIFF;
 		}
 
-		if ((rc = spi_add(spid->spi, type, proto_label(src->proto), src->test, src->cmd))) {
+		if ((rc = spi_add(spid->spi, type, proto_label(src->proto), src->test, args))) {
 			dbg(1, "starting source %s failed (rc=%d)\n", src->cmd, rc);
 			return false;
 		}
@@ -438,6 +547,50 @@ static void _print_stats()
 	printf("%18s %d\n", "tested signatures", total_signs);
 	printf("%18s %d\n", "valid", ok_signs);
 	printf("%18s %d\n", "invalid", total_signs - ok_signs);
+
+	printf("CLASSIFICATION SPEED:\n");
+	printf("%18s %u\n", "signatures", spi->stats.classified_signs);
+	printf("%18s %.2f us\n", "per signature", spi->stats.classified_signs ?
+		(double) spi->stats.classify_us / spi->stats.classified_signs : 0.0);
+
+	printf("TRAINING:\n");
+	printf("%18s %u\n", "full trainings", spi->stats.trainings);
+	printf("%18s %u\n", "online updates", spi->stats.online_updates);
+	printf("%18s %u\n", "online samples", spi->stats.online_signs);
+	printf("%18s %u\n", "samples", tlist_count(spi->traindata));
+	printf("%18s %u\n", "duplicates", spi->stats.train_dups);
+	printf("%18s %u\n", "over cap", spi->stats.train_capped);
+
+	if (spid->spi_opts.mem_limit) {
+		printf("MEMORY BUDGET:\n");
+		printf("%18s %u\n", "evicted endpoints", spi->stats.evicted_eps);
+		printf("%18s %u\n", "evicted flows", spi->stats.evicted_flows);
+	}
+}
+
+/** Convert signature database between text and binary format
+ * @retval 0     success */
+static int _signdb_convert(void)
+{
+	const char *from, *to;
+	bool text;
+
+	if (spid->options.signdb_import) {
+		from = spid->options.signdb_import;
+		to = spid->options.signdb;
+		text = false;
+	} else {
+		from = spid->options.signdb;
+		to = spid->options.signdb_export;
+		text = true;
+	}
+
+	if (sf_read(spid, from) < 0)
+		return 1;
+
+	spi_trainqueue_commit(spid->spi);
+
+	return (sf_write(spid, to, text) < 0);
 }
 
 int main(int argc, char *argv[])
@@ -464,9 +617,19 @@ int main(int argc, char *argv[])
 	/* register "unknown" as 1 */
 	proto_label("unknown");
 
+	if (spid->options.signdb_import || spid->options.signdb_export) {
+		rc = _signdb_convert();
+		spi_free(spid->spi);
+		mmatic_destroy(mm);
+		return rc;
+	}
+
 	if (tlist_count(spid->learn) > 0) {
 		if (!start_sourcelist(spid->learn))
 			return 2;
+
+		/* read learning files in parallel, if enabled */
+		spi_learn(spid->spi);
 	}
 
 	if (spid->options.signdb) {
@@ -499,7 +662,7 @@ int main(int argc, char *argv[])
 	while ((rc = spi_loop(spid->spi)) == 0);
 
 	if (spid->options.signdb && spid->spi->stats.learned_pkt > 0) {
-		sf_write(spid, spid->options.signdb);
+		sf_write(spid, spid->options.signdb, false);
 	}
 
 	if (spid->options.stats)
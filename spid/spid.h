@@ -33,8 +33,12 @@ struct spid {
 		bool daemonize;            /** run in foreground? */
 		const char *pidfile;       /** PID file */
 		const char *signdb;        /** signature database file */
+		const char *signdb_import; /** text signature database to convert into signdb */
+		const char *signdb_export; /** text signature database to convert signdb into */
 		bool print_prob;           /** print probabilities */
 		bool stats;                /** print perf stats */
+		bool ring;                 /** sniff using AF_PACKET mmap ring */
+		int fanout;                /** PACKET_FANOUT group for ring sources or -1 */
 	} options;
 };
 